@@ -0,0 +1,375 @@
+#include "emitter.h"
+#include "lexer.h"
+#include "parser.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <string>
+
+using namespace kscope;
+
+// Every heap allocation made through operator new, which includes LLVM's bump
+// allocator slabs. The front-end is single-threaded.
+static uint64_t num_allocs = 0;
+
+static void* counted_alloc(std::size_t size, std::size_t align = 0) {
+  num_allocs++;
+  void* ptr = nullptr;
+  if (align > alignof(std::max_align_t)) {
+    if (posix_memalign(&ptr, align, size ? size : 1) != 0) {
+      ptr = nullptr;
+    }
+  } else {
+    ptr = std::malloc(size ? size : 1);
+  }
+  if (!ptr) {
+    llvm::report_bad_alloc_error("kscope-bench: out of memory");
+  }
+  return ptr;
+}
+
+void* operator new(std::size_t size) {
+  return counted_alloc(size);
+}
+
+void* operator new[](std::size_t size) {
+  return counted_alloc(size);
+}
+
+void* operator new(std::size_t size, std::align_val_t align) {
+  return counted_alloc(size, static_cast<std::size_t>(align));
+}
+
+void* operator new[](std::size_t size, std::align_val_t align) {
+  return counted_alloc(size, static_cast<std::size_t>(align));
+}
+
+void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+
+namespace {
+
+namespace cl = llvm::cl;
+
+cl::OptionCategory bench_category("kscope-bench options");
+
+enum OutputFormat {
+  OF_TEXT,
+  OF_JSON,
+};
+
+cl::opt<OutputFormat> output_format(
+    "format", cl::desc("Output format"),
+    cl::values(
+      clEnumValN(OF_TEXT, "text", "table for humans"),
+      clEnumValN(OF_JSON, "json", "machine-readable results")),
+    cl::init(OF_TEXT), cl::cat(bench_category));
+
+cl::opt<unsigned> scale(
+    "scale", cl::desc("Size of each generated input, in units of about 1 MiB"),
+    cl::value_desc("n"), cl::init(1), cl::cat(bench_category));
+
+cl::opt<unsigned> repetitions(
+    "repetitions", cl::desc("Runs per input; the fastest one is reported"),
+    cl::value_desc("n"), cl::init(5), cl::cat(bench_category));
+
+cl::opt<std::string> filter(
+    "filter", cl::desc("Only run inputs whose name contains this string"),
+    cl::value_desc("name"), cl::init(""), cl::cat(bench_category));
+
+using Clock = std::chrono::steady_clock;
+
+/// Synthetic input exercising one aspect of the front-end.
+struct Generator {
+  const char* name;
+  const char* desc;
+  std::function<std::string(unsigned)> generate;
+};
+
+/// Definitions nesting parenthesized binary expressions 200 levels deep.
+std::string gen_deep_nesting(unsigned scale) {
+  constexpr unsigned DEPTH = 200;
+  std::string src;
+  for (unsigned i = 0; src.size() < (scale << 20); i++) {
+    src += "def deep" + std::to_string(i) + "(x) ";
+    src.append(DEPTH, '(');
+    src += "x";
+    for (unsigned d = 0; d < DEPTH; d++) {
+      src += " ";
+      src += "+-*<"[d % 4];
+      src += " " + std::to_string((i + d) % 97) + ")";
+    }
+    src += "\n";
+  }
+  return src;
+}
+
+/// Definitions taking 64 parameters, and calls passing 64 arguments.
+std::string gen_wide_args(unsigned scale) {
+  constexpr unsigned WIDTH = 64;
+  std::string src;
+  for (unsigned i = 0; src.size() < (scale << 20); i++) {
+    auto name = "wide" + std::to_string(i);
+    src += "def " + name + "(";
+    for (unsigned a = 0; a < WIDTH; a++) {
+      src += (a ? " a" : "a") + std::to_string(a);
+    }
+    src += ") a0";
+    for (unsigned a = 1; a < WIDTH; a++) {
+      src += " + a" + std::to_string(a);
+    }
+    src += "\ndef call" + std::to_string(i) + "(x) " + name + "(";
+    for (unsigned a = 0; a < WIDTH; a++) {
+      src += (a ? ", x + " : "x + ") + std::to_string(a);
+    }
+    src += ")\n";
+  }
+  return src;
+}
+
+/// Many one-line definitions calling their predecessors.
+std::string gen_small_defs(unsigned scale) {
+  std::string src = "def f0(x y) x + y\n";
+  for (unsigned i = 1; src.size() < (scale << 20); i++) {
+    src += "def f" + std::to_string(i) + "(x y) if x < y: f" + std::to_string(i - 1) +
+           "(y, x) else x * " + std::to_string(i % 10) + "\n";
+  }
+  return src;
+}
+
+/// Blocks of 40 comment lines between small definitions.
+std::string gen_comments(unsigned scale) {
+  std::string src;
+  for (unsigned i = 0; src.size() < (scale << 20); i++) {
+    for (unsigned line = 0; line < 40; line++) {
+      src += "# Comment line " + std::to_string(line) +
+             " describing the function below in far too much detail.\n";
+    }
+    src += "def c" + std::to_string(i) + "(x) x + " + std::to_string(i) + "\n";
+  }
+  return src;
+}
+
+/// Definitions made mostly of numeric literals, a few too long for the
+/// lexer's fast path.
+std::string gen_numeric(unsigned scale) {
+  std::string src;
+  uint64_t seed = 12345;
+  auto next = [&seed] {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return seed >> 33;
+  };
+  for (unsigned i = 0; src.size() < (scale << 20); i++) {
+    src += "def n" + std::to_string(i) + "(x) x";
+    for (unsigned term = 0; term < 16; term++) {
+      src += " ";
+      src += "+-*"[term % 3];
+      src += " " + std::to_string(next() % 100000) + "." + std::to_string(next() % 1000000);
+      if (term == 15) {
+        src += "12345678901234567";
+      }
+    }
+    src += "\n";
+  }
+  return src;
+}
+
+struct StageResult {
+  double seconds = 0;
+  uint64_t allocs = 0;
+};
+
+struct BenchResult {
+  size_t bytes = 0;
+  size_t tokens = 0;
+  uint64_t nodes = 0;
+  uint64_t instrs = 0;
+  StageResult lex, parse, codegen;
+};
+
+double seconds_since(Clock::time_point start) {
+  std::chrono::duration<double> dur = Clock::now() - start;
+  return dur.count();
+}
+
+/// Run each stage once over the source.
+BenchResult run_once(const std::string& src) {
+  BenchResult res;
+  res.bytes = src.size();
+
+  auto allocs = num_allocs;
+  auto start = Clock::now();
+  {
+    Lexer lexer(src);
+    res.lex.seconds = seconds_since(start);
+    res.lex.allocs = num_allocs - allocs;
+    res.tokens = lexer.tokens().size();
+  }
+
+  // The parser lexes on construction, which is not part of its stage.
+  AstContext ast;
+  Parser parser(src, ast);
+  allocs = num_allocs;
+  start = Clock::now();
+  auto items = parser.parse();
+  res.parse.seconds = seconds_since(start);
+  res.parse.allocs = num_allocs - allocs;
+  res.nodes = ast.nodes_made();
+
+  Emitter emitter("__bench__", llvm::DataLayout(""));
+  allocs = num_allocs;
+  start = Clock::now();
+  for (auto* item : items) {
+    if (auto* proto = llvm::dyn_cast<PrototypeAST>(item)) {
+      emitter.codegen(proto);
+      emitter.register_proto(proto);
+    } else {
+      emitter.codegen(llvm::cast<FunctionAST>(item));
+    }
+  }
+  res.codegen.seconds = seconds_since(start);
+  res.codegen.allocs = num_allocs - allocs;
+
+  auto tsm = emitter.take_mod();
+  for (auto& fn : *tsm.getModuleUnlocked()) {
+    res.instrs += fn.getInstructionCount();
+  }
+  return res;
+}
+
+/// Keep the fastest time of each stage. Allocation counts come from the last
+/// run, when the symbol table is warm.
+BenchResult run(const std::string& src) {
+  BenchResult best;
+  for (unsigned i = 0; i < std::max(1u, repetitions.getValue()); i++) {
+    auto res = run_once(src);
+    if (i > 0) {
+      res.lex.seconds = std::min(res.lex.seconds, best.lex.seconds);
+      res.parse.seconds = std::min(res.parse.seconds, best.parse.seconds);
+      res.codegen.seconds = std::min(res.codegen.seconds, best.codegen.seconds);
+    }
+    best = res;
+  }
+  return best;
+}
+
+double per_sec(uint64_t count, double seconds) {
+  return seconds > 0 ? count / seconds : 0.0;
+}
+
+double per_node(uint64_t allocs, uint64_t nodes) {
+  return nodes > 0 ? double(allocs) / nodes : 0.0;
+}
+
+llvm::json::Object stage_json(const StageResult& stage, const char* rate_name,
+                              uint64_t count, uint64_t nodes) {
+  return llvm::json::Object{
+    {"seconds", stage.seconds},
+    {rate_name, per_sec(count, stage.seconds)},
+    {"allocations", int64_t(stage.allocs)},
+    {"allocations_per_node", per_node(stage.allocs, nodes)},
+  };
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  cl::HideUnrelatedOptions(bench_category);
+  cl::ParseCommandLineOptions(argc, argv, "kscope-bench - front-end microbenchmarks\n");
+
+  std::vector<Generator> generators = {
+    {"deep_nesting", "binary expressions nested 200 deep", gen_deep_nesting},
+    {"wide_args", "64 parameters and arguments", gen_wide_args},
+    {"small_defs", "one-line definitions", gen_small_defs},
+    {"comments", "long comment blocks", gen_comments},
+    {"numeric", "numeric literals", gen_numeric},
+  };
+
+  llvm::json::Array json_results;
+  auto& out = llvm::outs();
+  if (output_format == OF_TEXT) {
+    out << llvm::formatv("{0,-14} {1,8} {2,10} {3,10} {4,10} | {5,8} {6,9} {7,9} {8,9} | {9}\n",
+                         "input", "KiB", "tokens", "nodes", "instrs", "MiB/s", "Mtok/s",
+                         "Mnode/s", "Minstr/s", "allocs/node lex/parse/codegen");
+  }
+
+  for (auto& gen : generators) {
+    if (!llvm::StringRef(gen.name).contains(filter)) {
+      continue;
+    }
+    auto src = gen.generate(scale);
+    auto res = run(src);
+
+    if (output_format == OF_TEXT) {
+      out << llvm::formatv(
+          "{0,-14} {1,8} {2,10} {3,10} {4,10} | {5,8:f1} {6,9:f2} {7,9:f2} {8,9:f2} | "
+          "{9:f2} / {10:f2} / {11:f2}\n",
+          gen.name, res.bytes >> 10, res.tokens, res.nodes, res.instrs,
+          per_sec(res.bytes, res.lex.seconds) / (1 << 20),
+          per_sec(res.tokens, res.lex.seconds) / 1e6,
+          per_sec(res.nodes, res.parse.seconds) / 1e6,
+          per_sec(res.instrs, res.codegen.seconds) / 1e6,
+          per_node(res.lex.allocs, res.nodes), per_node(res.parse.allocs, res.nodes),
+          per_node(res.codegen.allocs, res.nodes));
+    } else {
+      auto lex = stage_json(res.lex, "tokens_per_sec", res.tokens, res.nodes);
+      lex["bytes_per_sec"] = per_sec(res.bytes, res.lex.seconds);
+      json_results.push_back(llvm::json::Object{
+        {"name", gen.name},
+        {"description", gen.desc},
+        {"bytes", int64_t(res.bytes)},
+        {"tokens", int64_t(res.tokens)},
+        {"nodes", int64_t(res.nodes)},
+        {"ir_instructions", int64_t(res.instrs)},
+        {"lex", std::move(lex)},
+        {"parse", stage_json(res.parse, "nodes_per_sec", res.nodes, res.nodes)},
+        {"codegen", stage_json(res.codegen, "instructions_per_sec", res.instrs, res.nodes)},
+      });
+    }
+  }
+
+  if (output_format == OF_JSON) {
+    out << llvm::formatv("{0:2}", llvm::json::Value(llvm::json::Object{
+      {"scale", int64_t(scale)},
+      {"repetitions", int64_t(repetitions)},
+      {"benchmarks", std::move(json_results)},
+    })) << "\n";
+  }
+  return 0;
+}
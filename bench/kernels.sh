@@ -0,0 +1,26 @@
+#!/usr/bin/env bash
+# Numeric kernel benchmark: runs every program in bench/kernels and prints
+# its result and the time spent running top-level expressions, which
+# excludes compilation.
+#
+#   bench/kernels.sh [kscope flags...]
+#
+# KSCOPE overrides the binary, KERNELS the programs to run.
+set -uo pipefail
+
+KSCOPE=${KSCOPE:-./build/bin/kscope}
+KERNELS=${KERNELS:-$(dirname "$0")/kernels/*.ks}
+
+log=$(mktemp)
+trap 'rm -f "$log"' EXIT
+
+for kernel in $KERNELS; do
+  name=$(basename "$kernel" .ks)
+  if result=$("$KSCOPE" --time-report "$@" "$kernel" 2>"$log"); then
+    ms=$(awk '$1 == "[time]" && $2 == "call" { print $5 }' "$log")
+    printf '%-16s %12s ms   result %s\n' "$name" "${ms:-?}" "$(echo $result)"
+  else
+    echo "$name: kscope failed with status $?"
+    tail -n 5 "$log"
+  fi
+done
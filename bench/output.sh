@@ -0,0 +1,39 @@
+#!/usr/bin/env bash
+# Output throughput benchmark: prints COUNT values with `printd`, as text and
+# as raw doubles (KSCOPE_OUTPUT=binary), from one thread and from a `pfor`
+# loop, and reports values per second. The output goes to /dev/null; the
+# times include starting kscope and compiling the program.
+#
+#   bench/output.sh [kscope flags...]
+#
+# KSCOPE overrides the binary, COUNT the number of values.
+set -uo pipefail
+
+KSCOPE=${KSCOPE:-./build/bin/kscope}
+COUNT=${COUNT:-5000000}
+
+program() {
+  echo "extern printd(x);"
+  echo "def dump(n) $1 i in 0..n: printd(i*0.001 - 42);"
+  echo "dump($COUNT);"
+}
+
+run() {
+  local name=$1 loop=$2 mode=$3
+  shift 3
+  local start=$EPOCHREALTIME
+  if ! program "$loop" | KSCOPE_OUTPUT=$mode "$KSCOPE" "$@" >/dev/null 2>&1; then
+    echo "$name: kscope failed with status $?"
+    return
+  fi
+  local end=$EPOCHREALTIME
+  awk -v name="$name" -v n="$COUNT" -v s="$start" -v e="$end" 'BEGIN {
+    ms = (e - s) * 1000
+    printf "%-12s %10d values %10.1f ms %8.2f M values/sec\n", name, n, ms, n / ms / 1000
+  }'
+}
+
+run text for text "$@"
+run binary for binary "$@"
+run text-pfor pfor text "$@"
+run binary-pfor pfor binary "$@"
@@ -0,0 +1,38 @@
+#!/usr/bin/env bash
+# Front-end scaling benchmark: loads 10k, 100k and 1M generated definitions in
+# batch mode and prints the throughput summary of each run. Every definition
+# calls earlier ones, so symbol lookups grow with the program.
+#
+#   bench/scaling.sh [kscope flags...]
+#
+# KSCOPE overrides the binary, SIZES the definition counts. Without
+# --jit-threads, all definitions end up in one module, and 1M of them need
+# more than 6 GiB of memory.
+set -uo pipefail
+
+KSCOPE=${KSCOPE:-./build/bin/kscope}
+SIZES=${SIZES:-"10000 100000 1000000"}
+
+generate() {
+  awk -v n="$1" 'BEGIN {
+    print "extern sin(x)"
+    print "def f0(a b) a + b"
+    for (i = 1; i < n; i++) {
+      printf "def f%d(a b) if a < b: f%d(b, a) * %d else sin(a) + f%d(a - 1, b)\n",
+             i, i - 1, i % 10, int(i / 2)
+    }
+  }'
+}
+
+log=$(mktemp)
+trap 'rm -f "$log"' EXIT
+
+for size in $SIZES; do
+  echo "== $size definitions"
+  if generate "$size" | "$KSCOPE" -O0 "$@" >/dev/null 2>"$log"; then
+    grep -E '^\[(batch|ast)\]' "$log"
+  else
+    echo "kscope failed with status $?"
+    tail -n 5 "$log"
+  fi
+done
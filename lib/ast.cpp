@@ -1,50 +1,316 @@
 #include "ast.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Support/MathExtras.h"
+
+using namespace llvm;
 
 namespace kscope {
 
-PrototypeAST::PrototypeAST(const std::string& name, std::vector<std::string> args)
-    : ItemAST(IK_PROTO), name_(name), args_(std::move(args)) {}
+namespace {
 
-FunctionAST::FunctionAST(Box<PrototypeAST> proto, Box<ExprAST> body)
-    : ItemAST(IK_FUNC), proto_(std::move(proto)), body_(std::move(body)) {}
+uint64_t to_bits(uint64_t val) {
+  return val;
+}
 
-Box<FunctionAST> FunctionAST::make_anon(Box<ExprAST> expr) {
-  std::vector<std::string> empty;
-  auto anon_proto = std::make_unique<PrototypeAST>(ANON_NAME, empty);
-  return std::make_unique<FunctionAST>(std::move(anon_proto), std::move(expr));
+uint64_t to_bits(const void* ptr) {
+  return reinterpret_cast<uintptr_t>(ptr);
 }
 
-Box<PrototypeAST> FunctionAST::clone_proto() const {
-  std::vector<std::string> args(proto_->args());
-  return std::make_unique<PrototypeAST>(proto_->name(), args);
+/// Multiplicative hash over a few words. Node fields are mostly pointers, so
+/// this is plenty, and much cheaper than `hash_combine` on the parser's path.
+template <class... Ts>
+unsigned hash_fields(Ts... vals) {
+  uint64_t hash = 0;
+  ((hash = (hash ^ to_bits(vals)) * 0x9e3779b97f4a7c15ULL), ...);
+  return hash ^ (hash >> 32);
 }
 
-NumExprAST::NumExprAST(double val)
-    : ExprAST(IK_NUM_EXPR), val_(val) {}
+} // namespace
 
-VarExprAST::VarExprAST(const std::string& name)
-    : ExprAST(IK_VAR_EXPR), name_(name) {}
+bool PrototypeAST::has_array_args() const {
+  return is_contained(arg_types_, VT_ARRAY);
+}
 
-BinExprAST::BinExprAST(char op, Box<ExprAST> lhs, Box<ExprAST> rhs)
-    : ExprAST(IK_BIN_EXPR), op_(op), lhs_(std::move(lhs)), rhs_(std::move(rhs)) {}
+void for_each_child(const ExprAST* expr, function_ref<void(const ExprAST*)> fn) {
+  if (auto* bin = dyn_cast<BinExprAST>(expr)) {
+    fn(bin->lhs());
+    fn(bin->rhs());
+  } else if (auto* call = dyn_cast<CallExprAST>(expr)) {
+    for (auto* arg : call->args()) {
+      fn(arg);
+    }
+  } else if (auto* ifexpr = dyn_cast<IfExprAST>(expr)) {
+    fn(ifexpr->cond_expr());
+    fn(ifexpr->then_expr());
+    fn(ifexpr->else_expr());
+  } else if (auto* forexpr = dyn_cast<ForExprAST>(expr)) {
+    fn(forexpr->init_expr());
+    fn(forexpr->stop_expr());
+    if (forexpr->has_step()) {
+      fn(forexpr->step_expr());
+    }
+    if (forexpr->has_grain()) {
+      fn(forexpr->grain_expr());
+    }
+    fn(forexpr->body_expr());
+  } else if (auto* index = dyn_cast<IndexExprAST>(expr)) {
+    fn(index->index_expr());
+  } else if (auto* store = dyn_cast<StoreExprAST>(expr)) {
+    fn(store->index_expr());
+    fn(store->value_expr());
+  } else if (auto* array = dyn_cast<ArrayExprAST>(expr)) {
+    fn(array->size_expr());
+  } else if (auto* let = dyn_cast<LetExprAST>(expr)) {
+    fn(let->init_expr());
+    fn(let->body_expr());
+  } else if (auto* assign = dyn_cast<AssignExprAST>(expr)) {
+    fn(assign->value_expr());
+  } else if (auto* reduce = dyn_cast<ReduceExprAST>(expr)) {
+    if (reduce->op() == ReduceExprAST::RO_FOLD) {
+      fn(reduce->init_expr());
+    }
+    fn(reduce->loop());
+  } else if (auto* par = dyn_cast<ParExprAST>(expr)) {
+    fn(par->bin());
+  }
+}
 
-CallExprAST::CallExprAST(const std::string& callee, std::vector<Box<ExprAST>> args)
-    : ExprAST(IK_CALL_EXPR), callee_(callee), args_(std::move(args)) {}
+template <class T>
+const T* AstContext::unique(const T& node) {
+  nodes_made_++;
+  HashedNode key{&node, NodeInfo::hash(&node)};
+  auto iter = nodes_.find(key);
+  if (iter != nodes_.end()) {
+    return cast<T>(iter->expr);
+  }
+  auto* res = new (alloc_.Allocate<T>()) T(node);
+  nodes_.insert({res, key.hash});
+  return res;
+}
+
+template <class T>
+ArrayRef<T> AstContext::copy(ArrayRef<T> elems) {
+  auto* res = alloc_.Allocate<T>(elems.size());
+  std::uninitialized_copy(elems.begin(), elems.end(), res);
+  return makeArrayRef(res, elems.size());
+}
+
+const PrototypeAST* AstContext::proto(Symbol name, ArrayRef<Symbol> args,
+                                      ArrayRef<ValueType> arg_types) {
+  assert((arg_types.empty() || arg_types.size() == args.size()) && "one type per argument");
+  ArrayRef<ValueType> types;
+  if (arg_types.empty()) {
+    auto* nums = alloc_.Allocate<ValueType>(args.size());
+    std::uninitialized_fill_n(nums, args.size(), VT_NUM);
+    types = makeArrayRef(nums, args.size());
+  } else {
+    types = copy(arg_types);
+  }
+  return new (alloc_.Allocate<PrototypeAST>()) PrototypeAST(name, copy(args), types);
+}
+
+const FunctionAST* AstContext::function(const PrototypeAST* proto, const ExprAST* body,
+                                        bool memo) {
+  return new (alloc_.Allocate<FunctionAST>()) FunctionAST(proto, body, false, memo);
+}
+
+const FunctionAST* AstContext::anon(const ExprAST* expr, StringRef name) {
+  auto* anon_proto = proto(Symbol::get(name), {});
+  return new (alloc_.Allocate<FunctionAST>()) FunctionAST(anon_proto, expr, true, false);
+}
 
-IfExprAST::IfExprAST(Box<ExprAST> cond, Box<ExprAST> then_case, Box<ExprAST> else_case)
-    : ExprAST(IK_IF_EXPR),
-      cond_(std::move(cond)),
-      then_(std::move(then_case)),
-      else_(std::move(else_case)) {}
+const NumExprAST* AstContext::num(double val) {
+  return unique(NumExprAST(val));
+}
+
+const VarExprAST* AstContext::var(Symbol name) {
+  return unique(VarExprAST(name));
+}
+
+const BinExprAST* AstContext::bin(char op, const ExprAST* lhs, const ExprAST* rhs) {
+  return unique(BinExprAST(op, lhs, rhs));
+}
+
+const CallExprAST* AstContext::call(Symbol callee, ArrayRef<const ExprAST*> args) {
+  CallExprAST node(callee, args);
+  nodes_made_++;
+  HashedNode key{&node, NodeInfo::hash(&node)};
+  auto iter = nodes_.find(key);
+  if (iter != nodes_.end()) {
+    return cast<CallExprAST>(iter->expr);
+  }
+
+  // Only a new node needs its own copy of the arguments.
+  auto* res = new (alloc_.Allocate<CallExprAST>()) CallExprAST(callee, copy(args));
+  nodes_.insert({res, key.hash});
+  return res;
+}
+
+const IfExprAST* AstContext::if_expr(const ExprAST* cond, const ExprAST* then_case,
+                                     const ExprAST* else_case) {
+  return unique(IfExprAST(cond, then_case, else_case));
+}
+
+const ForExprAST* AstContext::for_expr(Symbol itervar, const ExprAST* init,
+                                       const ExprAST* stop, const ExprAST* body,
+                                       const ExprAST* step, bool parallel,
+                                       const ExprAST* grain) {
+  return unique(ForExprAST(itervar, init, stop, body, step, parallel, grain));
+}
 
-ForExprAST::ForExprAST(const std::string& itervar_name,
-                       Box<ExprAST> init_val, Box<ExprAST> stop_val,
-                       Box<ExprAST> body_expr, Box<ExprAST> step_val)
-    : ExprAST(IK_FOR_EXPR),
-      itervar_(itervar_name),
-      init_(std::move(init_val)),
-      stop_(std::move(stop_val)),
-      body_(std::move(body_expr)),
-      step_(std::move(step_val)) {}
+const IndexExprAST* AstContext::index(Symbol array, const ExprAST* index) {
+  return unique(IndexExprAST(array, index));
+}
+
+const StoreExprAST* AstContext::store(Symbol array, const ExprAST* index,
+                                      const ExprAST* value) {
+  return unique(StoreExprAST(array, index, value));
+}
+
+const LenExprAST* AstContext::len(Symbol array) {
+  return unique(LenExprAST(array));
+}
+
+const ArrayExprAST* AstContext::array(const ExprAST* size) {
+  return unique(ArrayExprAST(size));
+}
+
+const LetExprAST* AstContext::let(Symbol var, const ExprAST* init, const ExprAST* body) {
+  return unique(LetExprAST(var, init, body));
+}
+
+const AssignExprAST* AstContext::assign(Symbol var, const ExprAST* value) {
+  return unique(AssignExprAST(var, value));
+}
+
+const ReduceExprAST* AstContext::reduce(ReduceExprAST::ReduceOp op, const ForExprAST* loop,
+                                        Symbol fold, const ExprAST* init) {
+  return unique(ReduceExprAST(op, loop, fold, init));
+}
+
+const ParExprAST* AstContext::par(const BinExprAST* bin) {
+  return unique(ParExprAST(bin));
+}
+
+AstContext::HashedNode AstContext::NodeInfo::getEmptyKey() {
+  return {DenseMapInfo<const ExprAST*>::getEmptyKey(), 0};
+}
+
+AstContext::HashedNode AstContext::NodeInfo::getTombstoneKey() {
+  return {DenseMapInfo<const ExprAST*>::getTombstoneKey(), 0};
+}
+
+unsigned AstContext::NodeInfo::hash(const ExprAST* expr) {
+  if (auto* num = dyn_cast<NumExprAST>(expr)) {
+    return hash_fields(expr->kind(), DoubleToBits(num->value()));
+  } else if (auto* var = dyn_cast<VarExprAST>(expr)) {
+    return hash_fields(expr->kind(), var->symbol().id());
+  } else if (auto* bin = dyn_cast<BinExprAST>(expr)) {
+    return hash_fields(expr->kind(), bin->op(), bin->lhs(), bin->rhs());
+  } else if (auto* call = dyn_cast<CallExprAST>(expr)) {
+    uint64_t hash = hash_fields(expr->kind(), call->callee_symbol().id(), call->num_args());
+    for (auto* arg : call->args()) {
+      hash = hash_fields(hash, arg);
+    }
+    return hash;
+  } else if (auto* ifexpr = dyn_cast<IfExprAST>(expr)) {
+    return hash_fields(expr->kind(), ifexpr->cond_expr(), ifexpr->then_expr(),
+                       ifexpr->else_expr());
+  } else if (auto* forexpr = dyn_cast<ForExprAST>(expr)) {
+    return hash_fields(expr->kind(), forexpr->itervar_symbol().id(), forexpr->init_expr(),
+                       forexpr->stop_expr(), forexpr->body_expr(), forexpr->step_expr(),
+                       forexpr->is_parallel(), forexpr->grain_expr());
+  } else if (auto* index = dyn_cast<IndexExprAST>(expr)) {
+    return hash_fields(expr->kind(), index->array_symbol().id(), index->index_expr());
+  } else if (auto* store = dyn_cast<StoreExprAST>(expr)) {
+    return hash_fields(expr->kind(), store->array_symbol().id(), store->index_expr(),
+                       store->value_expr());
+  } else if (auto* len = dyn_cast<LenExprAST>(expr)) {
+    return hash_fields(expr->kind(), len->array_symbol().id());
+  } else if (auto* array = dyn_cast<ArrayExprAST>(expr)) {
+    return hash_fields(expr->kind(), array->size_expr());
+  } else if (auto* let = dyn_cast<LetExprAST>(expr)) {
+    return hash_fields(expr->kind(), let->var_symbol().id(), let->init_expr(),
+                       let->body_expr());
+  } else if (auto* assign = dyn_cast<AssignExprAST>(expr)) {
+    return hash_fields(expr->kind(), assign->var_symbol().id(), assign->value_expr());
+  } else if (auto* reduce = dyn_cast<ReduceExprAST>(expr)) {
+    return hash_fields(expr->kind(), reduce->op(), reduce->loop(), reduce->fold_symbol().id(),
+                       reduce->init_expr());
+  } else {
+    return hash_fields(expr->kind(), cast<ParExprAST>(expr)->bin());
+  }
+}
+
+bool AstContext::NodeInfo::isEqual(const HashedNode& lhs_node, const HashedNode& rhs_node) {
+  auto* lhs = lhs_node.expr;
+  auto* rhs = rhs_node.expr;
+  if (lhs == rhs) {
+    return true;
+  }
+  if (lhs_node.hash != rhs_node.hash ||
+      lhs == getEmptyKey().expr || lhs == getTombstoneKey().expr ||
+      rhs == getEmptyKey().expr || rhs == getTombstoneKey().expr ||
+      lhs->kind() != rhs->kind()) {
+    return false;
+  }
+
+  if (auto* num = dyn_cast<NumExprAST>(lhs)) {
+    // Compare bits, so 0.0 and -0.0 stay apart and NaN equals itself.
+    return DoubleToBits(num->value()) == DoubleToBits(cast<NumExprAST>(rhs)->value());
+  } else if (auto* var = dyn_cast<VarExprAST>(lhs)) {
+    return var->symbol().id() == cast<VarExprAST>(rhs)->symbol().id();
+  } else if (auto* bin = dyn_cast<BinExprAST>(lhs)) {
+    auto* other = cast<BinExprAST>(rhs);
+    return bin->op() == other->op() && bin->lhs() == other->lhs() &&
+           bin->rhs() == other->rhs();
+  } else if (auto* call = dyn_cast<CallExprAST>(lhs)) {
+    auto* other = cast<CallExprAST>(rhs);
+    return call->callee_symbol().id() == other->callee_symbol().id() && call->args() == other->args();
+  } else if (auto* ifexpr = dyn_cast<IfExprAST>(lhs)) {
+    auto* other = cast<IfExprAST>(rhs);
+    return ifexpr->cond_expr() == other->cond_expr() &&
+           ifexpr->then_expr() == other->then_expr() &&
+           ifexpr->else_expr() == other->else_expr();
+  } else if (auto* forexpr = dyn_cast<ForExprAST>(lhs)) {
+    auto* other = cast<ForExprAST>(rhs);
+    return forexpr->itervar_symbol().id() == other->itervar_symbol().id() &&
+           forexpr->init_expr() == other->init_expr() &&
+           forexpr->stop_expr() == other->stop_expr() &&
+           forexpr->body_expr() == other->body_expr() &&
+           forexpr->step_expr() == other->step_expr() &&
+           forexpr->is_parallel() == other->is_parallel() &&
+           forexpr->grain_expr() == other->grain_expr();
+  } else if (auto* index = dyn_cast<IndexExprAST>(lhs)) {
+    auto* other = cast<IndexExprAST>(rhs);
+    return index->array_symbol() == other->array_symbol() &&
+           index->index_expr() == other->index_expr();
+  } else if (auto* store = dyn_cast<StoreExprAST>(lhs)) {
+    auto* other = cast<StoreExprAST>(rhs);
+    return store->array_symbol() == other->array_symbol() &&
+           store->index_expr() == other->index_expr() &&
+           store->value_expr() == other->value_expr();
+  } else if (auto* len = dyn_cast<LenExprAST>(lhs)) {
+    return len->array_symbol() == cast<LenExprAST>(rhs)->array_symbol();
+  } else if (auto* array = dyn_cast<ArrayExprAST>(lhs)) {
+    return array->size_expr() == cast<ArrayExprAST>(rhs)->size_expr();
+  } else if (auto* let = dyn_cast<LetExprAST>(lhs)) {
+    auto* other = cast<LetExprAST>(rhs);
+    return let->var_symbol() == other->var_symbol() &&
+           let->init_expr() == other->init_expr() &&
+           let->body_expr() == other->body_expr();
+  } else if (auto* assign = dyn_cast<AssignExprAST>(lhs)) {
+    auto* other = cast<AssignExprAST>(rhs);
+    return assign->var_symbol() == other->var_symbol() &&
+           assign->value_expr() == other->value_expr();
+  } else if (auto* reduce = dyn_cast<ReduceExprAST>(lhs)) {
+    auto* other = cast<ReduceExprAST>(rhs);
+    return reduce->op() == other->op() && reduce->loop() == other->loop() &&
+           reduce->fold_symbol() == other->fold_symbol() &&
+           reduce->init_expr() == other->init_expr();
+  } else {
+    return cast<ParExprAST>(lhs)->bin() == cast<ParExprAST>(rhs)->bin();
+  }
+}
 
 } // namespace kscope
@@ -1,29 +1,32 @@
 #pragma once
 
 #include "common.h"
+#include "symbol.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Support/Allocator.h"
 
 namespace kscope {
 
 class ExprAST;
 
-/// Base class for all items in AST.
+/// Types of values. Numbers are doubles; arrays of numbers are passed around
+/// as a pointer to their elements plus a length.
+enum ValueType : uint8_t {
+  VT_NUM,
+  VT_ARRAY,
+};
+
+/// Base class for all top-level items in AST. Like expressions, items are
+/// allocated in an `AstContext` and live as long as it does.
 class ItemAST {
 public:
-  enum ItemKind {
+  enum ItemKind : uint8_t {
     IK_PROTO,
     IK_FUNC,
-    IK_EXPR_,
-    IK_IF_EXPR,
-    IK_FOR_EXPR,
-    IK_NUM_EXPR,
-    IK_VAR_EXPR,
-    IK_BIN_EXPR,
-    IK_CALL_EXPR,
-    IK_LAST_EXPR_,
   };
 
-  virtual ~ItemAST() = default;
-
   ItemKind kind() const {
     return kind_;
   }
@@ -41,13 +44,15 @@ public:
     return item->kind() == IK_PROTO;
   }
 
-  PrototypeAST(const std::string& name, std::vector<std::string> args);
-
-  const std::string& name() const {
+  Symbol symbol() const {
     return name_;
   }
 
-  const std::vector<std::string>& args() const {
+  llvm::StringRef name() const {
+    return name_.str();
+  }
+
+  llvm::ArrayRef<Symbol> args() const {
     return args_;
   }
 
@@ -55,9 +60,21 @@ public:
     return args_.size();
   }
 
+  /// Returns the types of the arguments, in the order of `args`.
+  llvm::ArrayRef<ValueType> arg_types() const {
+    return arg_types_;
+  }
+
+  bool has_array_args() const;
+
 private:
-  std::string name_;
-  std::vector<std::string> args_;
+  friend class AstContext;
+  Symbol name_;
+  llvm::ArrayRef<Symbol> args_;
+  llvm::ArrayRef<ValueType> arg_types_;
+
+  PrototypeAST(Symbol name, llvm::ArrayRef<Symbol> args, llvm::ArrayRef<ValueType> arg_types)
+      : ItemAST(IK_PROTO), name_(name), args_(args), arg_types_(arg_types) {}
 };
 
 /// A function definition, with its prototype and body.
@@ -69,113 +86,151 @@ public:
     return item->kind() == IK_FUNC;
   }
 
-  /// Wrap the expression in an anonymous function definition.
-  static Box<FunctionAST> make_anon(Box<ExprAST> expr);
-
-  FunctionAST(Box<PrototypeAST> proto, Box<ExprAST> body);
-
-  Box<PrototypeAST> clone_proto() const;
-
   const PrototypeAST* proto() const {
-    return proto_.get();
+    return proto_;
   }
 
   const ExprAST* body() const {
-    return body_.get();
+    return body_;
+  }
+
+  /// Whether this wraps a top-level expression.
+  bool is_anon() const {
+    return anon_;
+  }
+
+  /// Whether results are cached by argument values, `memo def`.
+  bool is_memo() const {
+    return memo_;
   }
 
 private:
-  Box<PrototypeAST> proto_;
-  Box<ExprAST> body_;
+  friend class AstContext;
+  bool anon_;
+  bool memo_;
+  const PrototypeAST* proto_;
+  const ExprAST* body_;
+
+  FunctionAST(const PrototypeAST* proto, const ExprAST* body, bool anon, bool memo)
+      : ItemAST(IK_FUNC), anon_(anon), memo_(memo), proto_(proto), body_(body) {}
 };
 
-/// Base class for all expression nodes.
-class ExprAST : public ItemAST {
+/// Base class for all expression nodes. Expressions are immutable, allocated
+/// in an `AstContext` and shared between all places they occur in, so they
+/// have neither a vtable nor a destructor.
+class ExprAST {
 public:
-  static bool classof(const ItemAST* item) {
-    return IK_EXPR_ < item->kind() && item->kind() < IK_LAST_EXPR_;
-  }
+  enum ExprKind : uint8_t {
+    EK_NUM,
+    EK_VAR,
+    EK_BIN,
+    EK_CALL,
+    EK_IF,
+    EK_FOR,
+    EK_INDEX,
+    EK_STORE,
+    EK_LEN,
+    EK_ARRAY,
+    EK_LET,
+    EK_ASSIGN,
+    EK_REDUCE,
+    EK_PAR,
+  };
 
-  virtual ~ExprAST() = default;
+  ExprKind kind() const {
+    return kind_;
+  }
 
 protected:
-  ExprAST(ItemKind expr_kind) : ItemAST(expr_kind) {}
+  const ExprKind kind_;
+
+  ExprAST(ExprKind kind) : kind_(kind) {}
 };
 
 /// Represents numeric literals.
 class NumExprAST : public ExprAST {
 public:
-  static bool classof(const ItemAST* item) {
-    return item->kind() == IK_NUM_EXPR;
+  static bool classof(const ExprAST* expr) {
+    return expr->kind() == EK_NUM;
   }
 
-  NumExprAST(double val);
-
   double value() const {
     return val_;
   }
 
 private:
+  friend class AstContext;
   double val_;
+
+  NumExprAST(double val) : ExprAST(EK_NUM), val_(val) {}
 };
 
 /// Represents a variable reference.
 class VarExprAST : public ExprAST {
 public:
-  static bool classof(const ItemAST* item) {
-    return item->kind() == IK_VAR_EXPR;
+  static bool classof(const ExprAST* expr) {
+    return expr->kind() == EK_VAR;
   }
 
-  VarExprAST(const std::string& name);
-
-  const std::string& name() const {
+  Symbol symbol() const {
     return name_;
   }
 
+  llvm::StringRef name() const {
+    return name_.str();
+  }
+
 private:
-  std::string name_;
+  friend class AstContext;
+  Symbol name_;
+
+  VarExprAST(Symbol name) : ExprAST(EK_VAR), name_(name) {}
 };
 
 /// Represents a binary operator.
 class BinExprAST : public ExprAST {
 public:
-  static bool classof(const ItemAST* item) {
-    return item->kind() == IK_BIN_EXPR;
+  static bool classof(const ExprAST* expr) {
+    return expr->kind() == EK_BIN;
   }
 
-  BinExprAST(char op, Box<ExprAST> lhs, Box<ExprAST> rhs);
-
   char op() const {
     return op_;
   }
 
   const ExprAST* lhs() const {
-    return lhs_.get();
+    return lhs_;
   }
 
   const ExprAST* rhs() const {
-    return rhs_.get();
+    return rhs_;
   }
 
 private:
+  friend class AstContext;
   char op_;
-  Box<ExprAST> lhs_, rhs_;
+  const ExprAST *lhs_, *rhs_;
+
+  BinExprAST(char op, const ExprAST* lhs, const ExprAST* rhs)
+      : ExprAST(EK_BIN), op_(op), lhs_(lhs), rhs_(rhs) {}
 };
 
 /// Represents a function call.
 class CallExprAST : public ExprAST {
 public:
-  static bool classof(const ItemAST* item) {
-    return item->kind() == IK_CALL_EXPR;
+  static bool classof(const ExprAST* expr) {
+    return expr->kind() == EK_CALL;
   }
 
-  CallExprAST(const std::string& callee, std::vector<Box<ExprAST>> args);
-
-  const std::string& callee() const {
+  Symbol callee_symbol() const {
     return callee_;
   }
 
-  const std::vector<Box<ExprAST>>& args() const {
+  llvm::StringRef callee() const {
+    return callee_.str();
+  }
+
+  llvm::ArrayRef<const ExprAST*> args() const {
     return args_;
   }
 
@@ -184,62 +239,69 @@ public:
   }
 
 private:
-  std::string callee_;
-  std::vector<Box<ExprAST>> args_;
+  friend class AstContext;
+  Symbol callee_;
+  llvm::ArrayRef<const ExprAST*> args_;
+
+  CallExprAST(Symbol callee, llvm::ArrayRef<const ExprAST*> args)
+      : ExprAST(EK_CALL), callee_(callee), args_(args) {}
 };
 
 /// Represents an if/else expression.
 class IfExprAST : public ExprAST {
 public:
-  static bool classof(const ItemAST* item) {
-    return item->kind() == IK_IF_EXPR;
+  static bool classof(const ExprAST* expr) {
+    return expr->kind() == EK_IF;
   }
 
-  IfExprAST(Box<ExprAST> cond, Box<ExprAST> then_case, Box<ExprAST> else_case);
-
   const ExprAST* cond_expr() const {
-    return cond_.get();
+    return cond_;
   }
 
   const ExprAST* then_expr() const {
-    return then_.get();
+    return then_;
   }
 
   const ExprAST* else_expr() const {
-    return else_.get();
+    return else_;
   }
 
 private:
-  Box<ExprAST> cond_, then_, else_;
+  friend class AstContext;
+  const ExprAST *cond_, *then_, *else_;
+
+  IfExprAST(const ExprAST* cond, const ExprAST* then_case, const ExprAST* else_case)
+      : ExprAST(EK_IF), cond_(cond), then_(then_case), else_(else_case) {}
 };
 
-/// Represents a for/in loop expression.
+/// Represents a for/in loop expression. A `pfor` loop may run its
+/// iterations in parallel, in ranges of about `grain` iterations.
 class ForExprAST : public ExprAST {
 public:
   inline static double DEFAULT_STEP = 1.0;
 
-  static bool classof(const ItemAST* item) {
-    return item->kind() == IK_FOR_EXPR;
+  static bool classof(const ExprAST* expr) {
+    return expr->kind() == EK_FOR;
   }
 
-  ForExprAST(const std::string& itervar_name,
-             Box<ExprAST> init_val, Box<ExprAST> stop_val,
-             Box<ExprAST> body_expr, Box<ExprAST> step_val = nullptr);
-
-  const std::string& itervar() const {
+  Symbol itervar_symbol() const {
     return itervar_;
   }
 
+  llvm::StringRef itervar() const {
+    return itervar_.str();
+  }
+
   const ExprAST* init_expr() const {
-    return init_.get();
+    return init_;
   }
 
   const ExprAST* stop_expr() const {
-    return stop_.get();
+    return stop_;
   }
 
   const ExprAST* body_expr() const {
-    return body_.get();
+    return body_;
   }
 
   bool has_step() const {
@@ -247,13 +309,361 @@ public:
   }
 
   const ExprAST* step_expr() const {
-    return step_ ? step_.get() : nullptr;
+    return step_;
+  }
+
+  bool is_parallel() const {
+    return parallel_;
+  }
+
+  bool has_grain() const {
+    return grain_ != nullptr;
+  }
+
+  const ExprAST* grain_expr() const {
+    return grain_;
+  }
+
+private:
+  friend class AstContext;
+  Symbol itervar_;
+  const ExprAST *init_, *stop_, *body_;
+  const ExprAST* step_;  // Optional.
+  bool parallel_;
+  const ExprAST* grain_;  // Optional, `pfor` only.
+
+  ForExprAST(Symbol itervar_name, const ExprAST* init_val, const ExprAST* stop_val,
+             const ExprAST* body_expr, const ExprAST* step_val, bool parallel,
+             const ExprAST* grain_val)
+      : ExprAST(EK_FOR),
+        itervar_(itervar_name),
+        init_(init_val),
+        stop_(stop_val),
+        body_(body_expr),
+        step_(step_val),
+        parallel_(parallel),
+        grain_(grain_val) {}
+};
+
+/// Represents reading an array element, `array[index]`. The index is
+/// truncated towards zero.
+class IndexExprAST : public ExprAST {
+public:
+  static bool classof(const ExprAST* expr) {
+    return expr->kind() == EK_INDEX;
+  }
+
+  Symbol array_symbol() const {
+    return array_;
+  }
+
+  llvm::StringRef array_name() const {
+    return array_.str();
+  }
+
+  const ExprAST* index_expr() const {
+    return index_;
+  }
+
+private:
+  friend class AstContext;
+  Symbol array_;
+  const ExprAST* index_;
+
+  IndexExprAST(Symbol array, const ExprAST* index)
+      : ExprAST(EK_INDEX), array_(array), index_(index) {}
+};
+
+/// Represents writing an array element, `array[index] = value`, which
+/// evaluates to the value.
+class StoreExprAST : public ExprAST {
+public:
+  static bool classof(const ExprAST* expr) {
+    return expr->kind() == EK_STORE;
+  }
+
+  Symbol array_symbol() const {
+    return array_;
+  }
+
+  llvm::StringRef array_name() const {
+    return array_.str();
+  }
+
+  const ExprAST* index_expr() const {
+    return index_;
+  }
+
+  const ExprAST* value_expr() const {
+    return value_;
+  }
+
+private:
+  friend class AstContext;
+  Symbol array_;
+  const ExprAST *index_, *value_;
+
+  StoreExprAST(Symbol array, const ExprAST* index, const ExprAST* value)
+      : ExprAST(EK_STORE), array_(array), index_(index), value_(value) {}
+};
+
+/// Represents the length of an array, `len(array)`.
+class LenExprAST : public ExprAST {
+public:
+  static bool classof(const ExprAST* expr) {
+    return expr->kind() == EK_LEN;
+  }
+
+  Symbol array_symbol() const {
+    return array_;
+  }
+
+  llvm::StringRef array_name() const {
+    return array_.str();
+  }
+
+private:
+  friend class AstContext;
+  Symbol array_;
+
+  LenExprAST(Symbol array) : ExprAST(EK_LEN), array_(array) {}
+};
+
+/// Represents allocating an array of zeros, `array(size)`. The array lives
+/// until the function evaluating the expression returns.
+class ArrayExprAST : public ExprAST {
+public:
+  static bool classof(const ExprAST* expr) {
+    return expr->kind() == EK_ARRAY;
+  }
+
+  const ExprAST* size_expr() const {
+    return size_;
+  }
+
+private:
+  friend class AstContext;
+  const ExprAST* size_;
+
+  ArrayExprAST(const ExprAST* size) : ExprAST(EK_ARRAY), size_(size) {}
+};
+
+/// Represents binding a mutable variable, `var name = init in body`, which
+/// evaluates to the body.
+class LetExprAST : public ExprAST {
+public:
+  static bool classof(const ExprAST* expr) {
+    return expr->kind() == EK_LET;
+  }
+
+  Symbol var_symbol() const {
+    return var_;
+  }
+
+  llvm::StringRef var_name() const {
+    return var_.str();
+  }
+
+  const ExprAST* init_expr() const {
+    return init_;
+  }
+
+  const ExprAST* body_expr() const {
+    return body_;
+  }
+
+private:
+  friend class AstContext;
+  Symbol var_;
+  const ExprAST *init_, *body_;
+
+  LetExprAST(Symbol var, const ExprAST* init, const ExprAST* body)
+      : ExprAST(EK_LET), var_(var), init_(init), body_(body) {}
+};
+
+/// Represents assigning a variable bound by `var`, `name = value`, which
+/// evaluates to the value.
+class AssignExprAST : public ExprAST {
+public:
+  static bool classof(const ExprAST* expr) {
+    return expr->kind() == EK_ASSIGN;
+  }
+
+  Symbol var_symbol() const {
+    return var_;
+  }
+
+  llvm::StringRef var_name() const {
+    return var_.str();
+  }
+
+  const ExprAST* value_expr() const {
+    return value_;
   }
 
 private:
-  std::string itervar_;
-  Box<ExprAST> init_, stop_, body_;
-  Box<ExprAST> step_;  // Optional.
+  friend class AstContext;
+  Symbol var_;
+  const ExprAST* value_;
+
+  AssignExprAST(Symbol var, const ExprAST* value)
+      : ExprAST(EK_ASSIGN), var_(var), value_(value) {}
+};
+
+/// Represents a reduction over the iterations of a loop, such as `sum i in
+/// 0..n: a[i]`, which evaluates to the values of the body combined with the
+/// operator. `fold(f, init)` combines them as `f(f(init, first), second)`
+/// and so on. The loop is a `pfor`, as reductions may run in parallel.
+class ReduceExprAST : public ExprAST {
+public:
+  enum ReduceOp : uint8_t {
+    RO_SUM,
+    RO_MIN,
+    RO_MAX,
+    RO_FOLD,
+  };
+
+  static bool classof(const ExprAST* expr) {
+    return expr->kind() == EK_REDUCE;
+  }
+
+  ReduceOp op() const {
+    return op_;
+  }
+
+  const ForExprAST* loop() const {
+    return loop_;
+  }
+
+  /// The function combining values, `fold` only.
+  Symbol fold_symbol() const {
+    return fold_;
+  }
+
+  llvm::StringRef fold_name() const {
+    return fold_.str();
+  }
+
+  /// The value combined with the first one, `fold` only.
+  const ExprAST* init_expr() const {
+    return init_;
+  }
+
+private:
+  friend class AstContext;
+  ReduceOp op_;
+  const ForExprAST* loop_;
+  Symbol fold_;
+  const ExprAST* init_;
+
+  ReduceExprAST(ReduceOp op, const ForExprAST* loop, Symbol fold, const ExprAST* init)
+      : ExprAST(EK_REDUCE), op_(op), loop_(loop), fold_(fold), init_(init) {}
+};
+
+/// Represents evaluating the operands of a binary operator concurrently,
+/// `par lhs op rhs`, which evaluates to the result of the operator.
+class ParExprAST : public ExprAST {
+public:
+  static bool classof(const ExprAST* expr) {
+    return expr->kind() == EK_PAR;
+  }
+
+  const BinExprAST* bin() const {
+    return bin_;
+  }
+
+private:
+  friend class AstContext;
+  const BinExprAST* bin_;
+
+  ParExprAST(const BinExprAST* bin) : ExprAST(EK_PAR), bin_(bin) {}
+};
+
+/// Call `fn` on each direct subexpression, in evaluation order.
+void for_each_child(const ExprAST* expr, llvm::function_ref<void(const ExprAST*)> fn);
+
+/// Owns items and expression nodes. Both are bump-allocated and freed when
+/// the context is destroyed. Expressions are also hash-consed: making a node
+/// structurally equal to an existing one returns the existing node, so equal
+/// subtrees are shared and compare equal by pointer.
+class AstContext {
+public:
+  AstContext() = default;
+  AstContext(const AstContext&) = delete;
+  AstContext& operator=(const AstContext&) = delete;
+
+  /// Arguments are numbers unless `arg_types` says otherwise.
+  const PrototypeAST* proto(Symbol name, llvm::ArrayRef<Symbol> args,
+                            llvm::ArrayRef<ValueType> arg_types = {});
+  const FunctionAST* function(const PrototypeAST* proto, const ExprAST* body,
+                             bool memo = false);
+  /// Wrap the expression in an anonymous function definition.
+  const FunctionAST* anon(const ExprAST* expr,
+                          llvm::StringRef name = FunctionAST::ANON_NAME);
+
+  const NumExprAST* num(double val);
+  const VarExprAST* var(Symbol name);
+  const BinExprAST* bin(char op, const ExprAST* lhs, const ExprAST* rhs);
+  const CallExprAST* call(Symbol callee, llvm::ArrayRef<const ExprAST*> args);
+  const IfExprAST* if_expr(const ExprAST* cond, const ExprAST* then_case,
+                           const ExprAST* else_case);
+  const ForExprAST* for_expr(Symbol itervar, const ExprAST* init, const ExprAST* stop,
+                             const ExprAST* body, const ExprAST* step = nullptr,
+                             bool parallel = false, const ExprAST* grain = nullptr);
+  const IndexExprAST* index(Symbol array, const ExprAST* index);
+  const StoreExprAST* store(Symbol array, const ExprAST* index, const ExprAST* value);
+  const LenExprAST* len(Symbol array);
+  const ArrayExprAST* array(const ExprAST* size);
+  const LetExprAST* let(Symbol var, const ExprAST* init, const ExprAST* body);
+  const AssignExprAST* assign(Symbol var, const ExprAST* value);
+  const ReduceExprAST* reduce(ReduceExprAST::ReduceOp op, const ForExprAST* loop,
+                              Symbol fold = Symbol(), const ExprAST* init = nullptr);
+  const ParExprAST* par(const BinExprAST* bin);
+
+  /// Number of nodes made, counting shared ones once per use.
+  uint64_t nodes_made() const {
+    return nodes_made_;
+  }
+
+  /// Number of distinct nodes allocated.
+  uint64_t nodes_unique() const {
+    return nodes_.size();
+  }
+
+  /// Bytes held by the context: items, nodes and the hash-consing table.
+  size_t bytes() const {
+    return alloc_.getTotalMemory() + nodes_.getMemorySize();
+  }
+
+private:
+  /// A node together with its hash, so that growing the table and probing
+  /// past other nodes does not touch the nodes themselves.
+  struct HashedNode {
+    const ExprAST* expr;
+    unsigned hash;
+  };
+
+  /// Hashes and compares nodes by kind, fields and child pointers. Children
+  /// are already unique, so this is enough for structural equality.
+  struct NodeInfo {
+    static HashedNode getEmptyKey();
+    static HashedNode getTombstoneKey();
+    static unsigned getHashValue(const HashedNode& node) {
+      return node.hash;
+    }
+    static bool isEqual(const HashedNode& lhs, const HashedNode& rhs);
+    static unsigned hash(const ExprAST* expr);
+  };
+
+  template <class T>
+  const T* unique(const T& node);
+
+  template <class T>
+  llvm::ArrayRef<T> copy(llvm::ArrayRef<T> elems);
+
+  llvm::BumpPtrAllocator alloc_;
+  llvm::DenseSet<HashedNode, NodeInfo> nodes_;
+  uint64_t nodes_made_ = 0;
 };
 
 } // namespace kscope
@@ -0,0 +1,153 @@
+#include "cache.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <iostream>
+
+using namespace llvm;
+
+namespace kscope {
+
+namespace {
+
+constexpr const char* OBJ_EXT = ".o";
+
+} // namespace
+
+DiskCache::DiskCache(const std::string& dir, uint64_t max_bytes, const std::string& target_key)
+    : dir_(dir), max_bytes_(max_bytes), target_key_(target_key) {
+  hits_ = 0;
+  misses_ = 0;
+  evictions_ = 0;
+  if (auto ec = sys::fs::create_directories(dir_)) {
+    std::cerr << "[error] cannot create cache directory: " << ec.message() << std::endl;
+  }
+  total_bytes_ = scan_size();
+}
+
+Box<MemoryBuffer> DiskCache::getObject(const Module* mod) {
+  auto key = compute_key(mod);
+  auto path = object_path(key);
+  auto buf = MemoryBuffer::getFile(path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+  if (!buf) {
+    misses_++;
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_keys_[mod] = std::move(key);
+    return nullptr;
+  }
+
+  // Bump the timestamp so eviction is least-recently-used.
+  int fd;
+  if (!sys::fs::openFileForWrite(path, fd, sys::fs::CD_OpenExisting, sys::fs::OF_Append)) {
+    sys::fs::setLastAccessAndModificationTime(fd, std::chrono::system_clock::now());
+    sys::fs::closeFile(fd);
+  }
+  hits_++;
+  return std::move(*buf);
+}
+
+void DiskCache::notifyObjectCompiled(const Module* mod, MemoryBufferRef obj) {
+  std::string key;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = pending_keys_.find(mod);
+    if (iter != pending_keys_.end()) {
+      key = std::move(iter->second);
+      pending_keys_.erase(iter);
+    }
+  }
+  if (key.empty()) {
+    key = compute_key(mod);
+  }
+
+  // Write to a unique temporary file and rename, so concurrent sessions never
+  // observe a partially written object.
+  SmallString<128> model(dir_);
+  sys::path::append(model, "tmp-%%%%%%%%");
+  int fd;
+  SmallString<128> tmp_path;
+  if (sys::fs::createUniqueFile(model, fd, tmp_path)) {
+    return;
+  }
+  {
+    raw_fd_ostream out(fd, /*shouldClose=*/true);
+    out << obj.getBuffer();
+  }
+  if (sys::fs::rename(tmp_path, object_path(key))) {
+    sys::fs::remove(tmp_path);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  total_bytes_ += obj.getBufferSize();
+  if (total_bytes_ > max_bytes_) {
+    evict();
+  }
+}
+
+std::string DiskCache::compute_key(const Module* mod) const {
+  std::string buf;
+  raw_string_ostream stream(buf);
+  stream << target_key_ << '\n';
+  mod->print(stream, nullptr);
+  return toHex(SHA1::hash(arrayRefFromStringRef(stream.str())), /*LowerCase=*/true);
+}
+
+std::string DiskCache::object_path(StringRef key) const {
+  SmallString<128> path(dir_);
+  sys::path::append(path, key + OBJ_EXT);
+  return std::string(path);
+}
+
+uint64_t DiskCache::scan_size() const {
+  uint64_t total = 0;
+  std::error_code ec;
+  for (sys::fs::directory_iterator it(dir_, ec), end; it != end && !ec; it.increment(ec)) {
+    if (auto status = it->status()) {
+      total += status->getSize();
+    }
+  }
+  return total;
+}
+
+void DiskCache::evict() {
+  struct Entry {
+    std::string path;
+    uint64_t size;
+    sys::TimePoint<> mtime;
+  };
+
+  std::vector<Entry> entries;
+  std::error_code ec;
+  for (sys::fs::directory_iterator it(dir_, ec), end; it != end && !ec; it.increment(ec)) {
+    if (sys::path::extension(it->path()) != OBJ_EXT) {
+      continue;
+    }
+    if (auto status = it->status()) {
+      entries.push_back({it->path(), status->getSize(), status->getLastModificationTime()});
+    }
+  }
+  std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+    return a.mtime < b.mtime;
+  });
+
+  total_bytes_ = 0;
+  for (auto& entry : entries) {
+    total_bytes_ += entry.size;
+  }
+  for (auto& entry : entries) {
+    if (total_bytes_ <= max_bytes_) {
+      break;
+    }
+    if (!sys::fs::remove(entry.path)) {
+      total_bytes_ -= entry.size;
+      evictions_++;
+    }
+  }
+}
+
+} // namespace kscope
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "common.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <atomic>
+#include <mutex>
+
+namespace kscope {
+
+/// Persistent object cache for the JIT. Objects are stored under a directory
+/// keyed by a hash of the optimized module and the code generation target, so
+/// identical modules compiled in later sessions skip machine code generation.
+/// The directory is kept under a size cap by evicting the least recently used
+/// objects.
+class DiskCache : public llvm::ObjectCache {
+public:
+  /// The target key should identify everything besides the IR that affects
+  /// the emitted object (triple, CPU, features, opt level).
+  DiskCache(const std::string& dir, uint64_t max_bytes, const std::string& target_key);
+
+  void notifyObjectCompiled(const llvm::Module* mod, llvm::MemoryBufferRef obj) override;
+
+  Box<llvm::MemoryBuffer> getObject(const llvm::Module* mod) override;
+
+  uint64_t hits() const {
+    return hits_;
+  }
+
+  uint64_t misses() const {
+    return misses_;
+  }
+
+  uint64_t evictions() const {
+    return evictions_;
+  }
+
+private:
+  std::string dir_;
+  uint64_t max_bytes_;
+  std::string target_key_;
+  std::atomic<uint64_t> hits_;
+  std::atomic<uint64_t> misses_;
+  std::atomic<uint64_t> evictions_;
+
+  std::mutex mutex_;  // Guards members below.
+  uint64_t total_bytes_;
+  llvm::DenseMap<const llvm::Module*, std::string> pending_keys_;
+
+  /// Hash the module together with the target key.
+  std::string compute_key(const llvm::Module* mod) const;
+  std::string object_path(llvm::StringRef key) const;
+  uint64_t scan_size() const;
+  /// Remove least recently used objects until under the size cap.
+  void evict();
+};
+
+} // namespace kscope
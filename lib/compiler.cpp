@@ -0,0 +1,121 @@
+#include "compiler.h"
+#include "timing.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+#include <iostream>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+namespace kscope {
+
+Box<Compiler> Compiler::create(OptLevel level) {
+  auto jtmb = cantFail(JITTargetMachineBuilder::detectHost());
+  jtmb.setCodeGenOptLevel(codegen_opt_level(level));
+  // Position independent so the same object can go into a shared library.
+  jtmb.setRelocationModel(Reloc::PIC_);
+  auto tm = jtmb.createTargetMachine();
+  if (!tm) {
+    logAllUnhandledErrors(tm.takeError(), errs(), "[error] ");
+    return nullptr;
+  }
+  return std::make_unique<Compiler>(std::move(*tm));
+}
+
+Compiler::Compiler(Box<TargetMachine> tm)
+    : tm_(std::move(tm)), layout_(tm_->createDataLayout()) {}
+
+void Compiler::add_main(Module& mod, const std::vector<std::string>& thunks) {
+  auto& ctx = mod.getContext();
+  IRBuilder<> builder(ctx);
+  auto* double_ty = Type::getDoubleTy(ctx);
+  auto* int_ty = Type::getInt32Ty(ctx);
+
+  auto* show_ty = FunctionType::get(Type::getVoidTy(ctx), {double_ty}, false);
+  auto show = mod.getOrInsertFunction("kscope_show", show_ty);
+
+  auto* main_ty = FunctionType::get(int_ty, false);
+  auto* main_fn = Function::Create(main_ty, Function::ExternalLinkage,
+                                   "main", mod);
+  builder.SetInsertPoint(BasicBlock::Create(ctx, "entry", main_fn));
+  for (auto& name : thunks) {
+    auto* thunk = mod.getFunction(name);
+    if (!thunk) {
+      continue;
+    }
+    // Thunks are only reachable through main.
+    thunk->setLinkage(Function::InternalLinkage);
+    auto* res = builder.CreateCall(thunk);
+    builder.CreateCall(show, {res});
+  }
+  builder.CreateRet(ConstantInt::get(int_ty, 0));
+}
+
+bool Compiler::write_object(Module& mod, StringRef path) {
+  mod.setTargetTriple(tm_->getTargetTriple().str());
+  mod.setDataLayout(layout_);
+
+  std::string buf;
+  raw_string_ostream stream(buf);
+  if (verifyModule(mod, &stream)) {
+    return log_err("incorrect llvm module: " + stream.str());
+  }
+
+  std::error_code ec;
+  raw_fd_ostream dest(path, ec, sys::fs::OF_None);
+  if (ec) {
+    return log_err("cannot open output file: " + ec.message());
+  }
+
+  PhaseScope scope(PH_CODEGEN, path);
+  legacy::PassManager pm;
+  if (tm_->addPassesToEmitFile(pm, dest, nullptr, CGFT_ObjectFile)) {
+    return log_err("target cannot emit object files");
+  }
+  pm.run(mod);
+  dest.flush();
+  return true;
+}
+
+bool Compiler::link(StringRef obj_path, StringRef out_path,
+                    OutputKind kind, StringRef runtime_path) {
+  if (kind == OK_OBJECT) {
+    return true;
+  }
+
+  // The runtime is C++, so let the C++ driver pull in its support libraries.
+  auto driver = sys::findProgramByName("c++");
+  if (!driver) {
+    return log_err("cannot find c++ compiler driver for linking");
+  }
+
+  std::vector<StringRef> args = {*driver};
+  if (kind == OK_SHARED) {
+    args.push_back("-shared");
+  }
+  args.push_back(obj_path);
+  args.push_back(runtime_path);
+  // The runtime runs parallel loops on threads.
+  args.push_back("-pthread");
+  args.push_back("-o");
+  args.push_back(out_path);
+
+  std::string err_msg;
+  int rc = sys::ExecuteAndWait(*driver, args, None, {}, 0, 0, &err_msg);
+  if (rc != 0) {
+    return log_err("link failed: " + (err_msg.empty() ? std::to_string(rc) : err_msg));
+  }
+  return true;
+}
+
+bool Compiler::log_err(StringRef msg) {
+  std::cerr << "[error] " << msg.str() << std::endl;
+  return false;
+}
+
+} // namespace kscope
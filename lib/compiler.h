@@ -0,0 +1,49 @@
+#pragma once
+
+#include "common.h"
+#include "optimizer.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Target/TargetMachine.h"
+
+namespace kscope {
+
+/// Ahead-of-time backend that turns emitted modules into native artifacts.
+class Compiler {
+public:
+  enum OutputKind {
+    OK_OBJECT,
+    OK_SHARED,
+    OK_EXECUTABLE,
+  };
+
+  /// Create a compiler targeting the host machine, generating code at the
+  /// given optimization level.
+  static Box<Compiler> create(OptLevel level = OL_O2);
+
+  Compiler(Box<llvm::TargetMachine> tm);
+
+  const llvm::DataLayout& data_layout() const {
+    return layout_;
+  }
+
+  /// Add a C `main` that calls each thunk in order and prints its result.
+  void add_main(llvm::Module& mod, const std::vector<std::string>& thunks);
+
+  /// Write the module as a native object file.
+  bool write_object(llvm::Module& mod, llvm::StringRef path);
+
+  /// Link an object file with the kscope runtime into a shared library or
+  /// executable using the system compiler driver.
+  bool link(llvm::StringRef obj_path, llvm::StringRef out_path,
+            OutputKind kind, llvm::StringRef runtime_path);
+
+private:
+  Box<llvm::TargetMachine> tm_;
+  llvm::DataLayout layout_;
+
+  /// Helper for error handling.
+  bool log_err(llvm::StringRef msg);
+};
+
+} // namespace kscope
@@ -1,60 +1,184 @@
 #include "emitter.h"
+#include "timing.h"
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Type.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Support/raw_ostream.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
+#include <cmath>
 #include <iostream>
 
 using namespace llvm;
 
 namespace kscope {
 
-Optimizer::Optimizer(Module* mod) {
-  fpm_ = std::make_unique<legacy::FunctionPassManager>(mod);
-  // Simple peephole and bit-twiddling optimizations.
-  fpm_->add(createInstructionCombiningPass());
-  // Reassociate expressions into a more canonical form.
-  fpm_->add(createReassociatePass());
-  // Eliminate redundant expressions.
-  fpm_->add(createGVNPass());
-  // Simplify control flow graph.
-  fpm_->add(createCFGSimplificationPass());
-  fpm_->doInitialization();
+namespace {
+
+constexpr const char* TIER_COUNTER_ATTR = "kscope-tier-counter";
+
+/// Largest magnitude up to which doubles hold every integer.
+constexpr double MAX_EXACT_INT = 9007199254740992.0;  // 2^53
+
+/// Number of kscope arguments taken by a function; arrays take two
+/// parameters, starting with a pointer.
+size_t num_args(FunctionType* fn_ty) {
+  size_t count = 0;
+  for (unsigned i = 0; i < fn_ty->getNumParams(); i++) {
+    count++;
+    i += fn_ty->getParamType(i)->isPointerTy();
+  }
+  return count;
+}
+
+/// Bounds on the magnitude of products and sums of `Emitter::emit_int`.
+/// Products are saturated to leave room for adding to them.
+constexpr double MAX_INT_PRODUCT = 4611686018427387904.0;  // 2^62
+constexpr double MAX_INT_SUM = 9223372036854775808.0;      // 2^63
+
+/// Returns whether the expression calls `self` in tail position.
+bool has_self_tail_call(const ExprAST* expr, Symbol self,
+                        SmallPtrSetImpl<const ExprAST*>& visited) {
+  // Subexpressions are shared, so visit each once.
+  if (!visited.insert(expr).second) {
+    return false;
+  }
+  if (auto* call = dyn_cast<CallExprAST>(expr)) {
+    return call->callee_symbol() == self;
+  } else if (auto* ifexpr = dyn_cast<IfExprAST>(expr)) {
+    return has_self_tail_call(ifexpr->then_expr(), self, visited) ||
+           has_self_tail_call(ifexpr->else_expr(), self, visited);
+  } else if (auto* let = dyn_cast<LetExprAST>(expr)) {
+    return has_self_tail_call(let->body_expr(), self, visited);
+  }
+  return false;
 }
 
-void Optimizer::run(Function* fn) {
-  fpm_->run(*fn);
+/// Locals an expression uses, in order, and those it assigns, leaving out
+/// the ones it binds itself.
+struct FreeLocals {
+  SetVector<Symbol> used;
+  DenseSet<Symbol> assigned;
+};
+
+using FreeLocalsCache = DenseMap<const ExprAST*, Box<FreeLocals>>;
+
+/// Collects the free locals of the expression. Subexpressions are shared
+/// between scopes, so their own free locals are kept in `cache`.
+const FreeLocals& collect_locals(const ExprAST* expr, FreeLocalsCache& cache) {
+  auto iter = cache.find(expr);
+  if (iter != cache.end()) {
+    return *iter->second;
+  }
+  auto locals = std::make_unique<FreeLocals>();
+  Symbol bound;
+  if (auto* var = dyn_cast<VarExprAST>(expr)) {
+    locals->used.insert(var->symbol());
+  } else if (auto* index = dyn_cast<IndexExprAST>(expr)) {
+    locals->used.insert(index->array_symbol());
+  } else if (auto* store = dyn_cast<StoreExprAST>(expr)) {
+    locals->used.insert(store->array_symbol());
+  } else if (auto* len = dyn_cast<LenExprAST>(expr)) {
+    locals->used.insert(len->array_symbol());
+  } else if (auto* assign = dyn_cast<AssignExprAST>(expr)) {
+    locals->used.insert(assign->var_symbol());
+    locals->assigned.insert(assign->var_symbol());
+  } else if (auto* let = dyn_cast<LetExprAST>(expr)) {
+    bound = let->var_symbol();
+  } else if (auto* forexpr = dyn_cast<ForExprAST>(expr)) {
+    bound = forexpr->itervar_symbol();
+  }
+
+  // What a `var` or loop binds is only visible in its body, the last child.
+  SmallVector<const ExprAST*, 4> children;
+  for_each_child(expr, [&](const ExprAST* child) { children.push_back(child); });
+  for (size_t i = 0; i < children.size(); i++) {
+    bool in_scope = bound && i + 1 == children.size();
+    const auto& inner = collect_locals(children[i], cache);
+    for (auto name : inner.used) {
+      if (!in_scope || name != bound) {
+        locals->used.insert(name);
+      }
+    }
+    for (auto name : inner.assigned) {
+      if (!in_scope || name != bound) {
+        locals->assigned.insert(name);
+      }
+    }
+  }
+  auto& res = *locals;
+  cache[expr] = std::move(locals);
+  return res;
 }
 
-Emitter::Emitter(const std::string& mod_name, const DataLayout& layout) {
+} // namespace
+
+Emitter::Emitter(const std::string& mod_name, const DataLayout& layout, Optimizer* opt)
+    : opt_(opt) {
   ctx_ = std::make_unique<LLVMContext>();
   builder_ = std::make_unique<IRBuilder<>>(*ctx_);
   module_ = std::make_unique<Module>(mod_name, *ctx_);
   module_->setDataLayout(layout);
-  opt_ = std::make_unique<Optimizer>(module_.get());
   errored_ = false;
 }
 
-Box<llvm::Module> Emitter::take_mod() {
-  auto curr_mod = std::move(module_);
-  module_ = std::make_unique<Module>(curr_mod->getName(), *ctx_);
-  module_->setDataLayout(curr_mod->getDataLayout());
-  opt_ = std::make_unique<Optimizer>(module_.get());
+orc::ThreadSafeModule Emitter::take_mod() {
+  // Optimize the code.
+  if (opt_) {
+    opt_->run(*module_);
+  }
+
+  std::string mod_name = module_->getName().str();
+  DataLayout layout = module_->getDataLayout();
+  orc::ThreadSafeModule curr_mod(std::move(module_), std::move(ctx_));
+
+  ctx_ = std::make_unique<LLVMContext>();
+  builder_ = std::make_unique<IRBuilder<>>(*ctx_);
+  module_ = std::make_unique<Module>(mod_name, *ctx_);
+  module_->setDataLayout(layout);
   errored_ = false;
   return curr_mod;
 }
 
-void Emitter::register_proto(Box<PrototypeAST> proto) {
-  protos_[proto->name()] = std::move(proto);
+bool Emitter::has_tier_counter(const Function& fn) {
+  return fn.hasFnAttribute(TIER_COUNTER_ATTR);
+}
+
+void Emitter::strip_tier_counter(Function& fn) {
+  if (!has_tier_counter(fn)) {
+    return;
+  }
+  fn.removeFnAttr(TIER_COUNTER_ATTR);
+
+  // The counter block only falls through to the body; its values are not
+  // used anywhere else, so delete it back to front.
+  auto& bb_count = fn.getEntryBlock();
+  auto* bb_body = bb_count.getTerminator()->getSuccessor(1);
+  while (!bb_count.empty()) {
+    bb_count.back().eraseFromParent();
+  }
+  BranchInst::Create(bb_body, &bb_count);
+  EliminateUnreachableBlocks(fn);
+}
+
+void Emitter::register_proto(const PrototypeAST* proto) {
+  protos_[proto->symbol()] = proto;
+}
+
+const PrototypeAST* Emitter::lookup_proto(Symbol name) const {
+  return protos_.lookup(name);
 }
 
 Function* Emitter::codegen(const FunctionAST* ast) {
+  PhaseScope scope(PH_EMIT, ast->proto()->name());
   errored_ = false;
   return emit_def(ast);
 }
@@ -64,28 +188,50 @@ Function* Emitter::codegen(const PrototypeAST* ast) {
   return emit_proto(ast);
 }
 
-Function* Emitter::lookup_fn(const std::string& name) {
-  if (auto* fn = module_->getFunction(name)) {
+Function* Emitter::lookup_fn(Symbol name) {
+  if (auto* fn = module_->getFunction(name.str())) {
     return fn;
   }
-  auto iter = protos_.find(name);
-  if (iter != protos_.end()) {
-    return emit_proto(iter->second.get());
+  if (auto* proto = protos_.lookup(name)) {
+    return emit_proto(proto);
   }
   return nullptr;
 }
 
-Function* Emitter::emit_proto(const PrototypeAST* proto) {
+StructType* Emitter::array_type() {
+  auto* elems_ty = PointerType::getUnqual(Type::getDoubleTy(*ctx_));
+  return StructType::get(*ctx_, {elems_ty, Type::getInt64Ty(*ctx_)});
+}
+
+bool Emitter::is_array(Value* val) {
+  return val->getType() == array_type();
+}
+
+FunctionType* Emitter::fn_type(const PrototypeAST* proto) {
   auto* double_ty = Type::getDoubleTy(*ctx_);
-  std::vector<Type*> param_tys(proto->num_args(), double_ty);
-  auto* fn_ty = FunctionType::get(double_ty, param_tys, false);
-  auto* fn = Function::Create(fn_ty, Function::ExternalLinkage,
+  std::vector<Type*> param_tys;
+  for (auto type : proto->arg_types()) {
+    if (type == VT_ARRAY) {
+      param_tys.push_back(array_type()->getElementType(0));
+      param_tys.push_back(array_type()->getElementType(1));
+    } else {
+      param_tys.push_back(double_ty);
+    }
+  }
+  return FunctionType::get(double_ty, param_tys, false);
+}
+
+Function* Emitter::emit_proto(const PrototypeAST* proto) {
+  auto* fn = Function::Create(fn_type(proto), Function::ExternalLinkage,
                               proto->name(), module_.get());
 
-  size_t idx = 0;
-  for (auto& arg : fn->args()) {
-    arg.setName(proto->args()[idx]);
-    idx++;
+  unsigned idx = 0;
+  for (size_t i = 0; i < proto->num_args(); i++) {
+    auto name = proto->args()[i].str();
+    fn->getArg(idx++)->setName(name);
+    if (proto->arg_types()[i] == VT_ARRAY) {
+      fn->getArg(idx++)->setName(name + ".len");
+    }
   }
 
   return fn;
@@ -93,60 +239,378 @@ Function* Emitter::emit_proto(const PrototypeAST* proto) {
 
 Function* Emitter::emit_def(const FunctionAST* def) {
   auto* proto = def->proto();
-  protos_[proto->name()] = def->clone_proto();
-  auto* fn = lookup_fn(proto->name());
+  protos_[proto->symbol()] = proto;
+  auto* fn = lookup_fn(proto->symbol());
   if (!fn) {
     return nullptr;
   }
 
-  if (fn->empty()) {
+  if (!fn->empty()) {
+    // Redefinition within the same module replaces the previous body.
+    if (num_args(fn->getFunctionType()) != proto->num_args()) {
+      return log_err_fn("function arity mismatch: " + proto->name().str());
+    }
+    if (fn->getFunctionType() != fn_type(proto)) {
+      return log_err_fn("function argument types mismatch: " + proto->name().str());
+    }
+    fn->deleteBody();
+    erase_memo(*fn);
+    unsigned idx = 0;
+    for (size_t i = 0; i < proto->num_args(); i++) {
+      auto name = proto->args()[i].str();
+      fn->getArg(idx++)->setName(name);
+      if (proto->arg_types()[i] == VT_ARRAY) {
+        fn->getArg(idx++)->setName(name + ".len");
+      }
+    }
+  } else {
     // Validate existing declaration matches prototype.
     if (fn->getName() != proto->name()) {
-      return log_err_fn("function name mismatch: " + proto->name());
+      return log_err_fn("function name mismatch: " + proto->name().str());
+    }
+    if (num_args(fn->getFunctionType()) != proto->num_args()) {
+      return log_err_fn("function arity mismatch: " + proto->name().str());
     }
-    if (fn->arg_size() != proto->num_args()) {
-      return log_err_fn("function arity mismatch: " + proto->name());
+    if (fn->getFunctionType() != fn_type(proto)) {
+      return log_err_fn("function argument types mismatch: " + proto->name().str());
     }
-    for(size_t i = 0; i < fn->arg_size(); i++) {
-      auto fn_arg_name = fn->getArg(i)->getName();
-      auto proto_arg_name = proto->args()[i];
+    unsigned idx = 0;
+    for (size_t i = 0; i < proto->num_args(); i++) {
+      auto fn_arg_name = fn->getArg(idx)->getName();
+      auto proto_arg_name = proto->args()[i].str();
       if (fn_arg_name != proto_arg_name) {
-        return log_err_fn("function arg unknown: " + proto_arg_name);
+        return log_err_fn("function arg unknown: " + proto_arg_name.str());
       }
+      idx += proto->arg_types()[i] == VT_ARRAY ? 2 : 1;
+    }
+  }
+
+  // The body of a `memo` function goes into a function of its own, which
+  // the function itself calls on cache misses.
+  auto* body_fn = fn;
+  if (def->is_memo()) {
+    body_fn = Function::Create(fn->getFunctionType(), Function::ExternalLinkage,
+                               fn->getName() + MEMO_BODY_SUFFIX, module_.get());
+    for (auto& arg : fn->args()) {
+      body_fn->getArg(arg.getArgNo())->setName(arg.getName());
     }
   }
 
-  auto* bb = BasicBlock::Create(*ctx_, "entry", fn);
+  auto* bb = BasicBlock::Create(*ctx_, "entry");
+  if (tier_threshold_ > 0 && !proto->name().startswith(FunctionAST::ANON_NAME) &&
+      body_fn == fn) {
+    emit_tier_counter(fn, bb);
+  }
+  body_fn->getBasicBlockList().push_back(bb);
   builder_->SetInsertPoint(bb);
+  bb_entry_ = bb;
 
-  locals_.clear();
-  for (auto& arg : fn->args()) {
-    locals_[arg.getName().str()] = &arg;
+  // Self tail calls pass their arguments to the start of the body and jump
+  // there, so self recursion runs as a loop. Functions with a call counter
+  // keep calling themselves, so that the counter sees the iterations and the
+  // function gets recompiled. Arrays taken as arguments may have been
+  // allocated by the previous iteration, which can only free them once the
+  // call returns, so functions taking arrays keep calling themselves too.
+  SmallVector<Value*, 4> params;
+  for (auto& arg : body_fn->args()) {
+    params.push_back(&arg);
+  }
+  bb_self_loop_ = nullptr;
+  self_params_.clear();
+  SmallPtrSet<const ExprAST*, 16> visited;
+  self_edges_.clear();
+  if (body_fn == fn && !has_tier_counter(*fn) && !is_contained(proto->arg_types(), VT_ARRAY) &&
+      has_self_tail_call(def->body(), proto->symbol(), visited)) {
+    bb_self_loop_ = BasicBlock::Create(*ctx_, "self.loop", fn);
+    builder_->CreateBr(bb_self_loop_);
+    builder_->SetInsertPoint(bb_self_loop_);
+    for (auto*& param : params) {
+      auto* phi = builder_->CreatePHI(param->getType(), 2, param->getName());
+      phi->addIncoming(param, bb);
+      self_params_.push_back(phi);
+      param = phi;
+    }
   }
 
-  if (auto* val = emit_expr(def->body())) {
-    // Finish the function.
-    builder_->CreateRet(val);
+  ScopedHashTableScope<Symbol, Value*> scope(locals_);
+  unsigned idx = 0;
+  for (size_t i = 0; i < proto->num_args(); i++) {
+    Value* val = params[idx++];
+    if (proto->arg_types()[i] == VT_ARRAY) {
+      Value* array = PoisonValue::get(array_type());
+      array = builder_->CreateInsertValue(array, val, 0);
+      val = builder_->CreateInsertValue(array, params[idx++], 1);
+    }
+    locals_.insert(proto->args()[i], val);
+  }
+
+  arrays_ = nullptr;
+  rets_.clear();
+  tasks_.clear();
+  if (auto* val = emit_num(def->body(), true)) {
+    rets_.push_back(builder_->CreateRet(val));
+    emit_array_frees();
+    if (body_fn != fn) {
+      emit_memo(fn, body_fn);
+    }
 
     // Validate generated IR.
     std::string buf;
     raw_string_ostream stream(buf);
-    if (verifyFunction(*fn, &stream)) {
+    if (verifyFunction(*body_fn, &stream) || verifyFunction(*fn, &stream)) {
       return log_err_fn("incorrect llvm function: " + stream.str());
     }
 
-    // Optimize the code.
-    opt_->run(fn);
-
     return fn;
   }
 
-  // There was an error so remove the function.
+  // There was an error so remove the function, and the loop bodies
+  // outlined from it.
+  if (body_fn != fn) {
+    body_fn->eraseFromParent();
+  }
   fn->eraseFromParent();
+  for (auto* task : tasks_) {
+    task->eraseFromParent();
+  }
   return nullptr;
 }
 
-Value* Emitter::emit_expr(const ExprAST* expr) {
+void Emitter::emit_array_frees() {
+  if (!arrays_) {
+    return;
+  }
+  // Calls in tail position are followed by the free, so they stay plain
+  // calls.
+  auto* ptr_ty = builder_->getInt8PtrTy();
+  auto array_free = module_->getOrInsertFunction(
+      ARRAY_FREE_NAME, builder_->getVoidTy(), ptr_ty);
+  for (auto* ret : rets_) {
+    if (auto* call = dyn_cast_or_null<CallInst>(ret->getPrevNode())) {
+      call->setTailCallKind(CallInst::TCK_None);
+    }
+    builder_->SetInsertPoint(ret);
+    builder_->CreateCall(array_free, {builder_->CreateLoad(ptr_ty, arrays_)});
+  }
+  // Nothing the next iteration of a self tail call sees is an array, so
+  // each iteration frees its own.
+  for (auto* edge : self_edges_) {
+    builder_->SetInsertPoint(edge);
+    builder_->CreateCall(array_free, {builder_->CreateLoad(ptr_ty, arrays_)});
+    builder_->CreateStore(ConstantPointerNull::get(ptr_ty), arrays_);
+  }
+}
+
+void Emitter::emit_memo(Function* fn, Function* body_fn) {
+  auto* i64_ty = builder_->getInt64Ty();
+  auto* double_ty = builder_->getDoubleTy();
+  auto name = fn->getName().str();
+
+  // Each entry of the table holds the bit patterns of the arguments and the
+  // result, and a sequence number that is odd while the entry is written
+  // and zero while it is empty. The counters are read by the driver.
+  unsigned num_keys = fn->arg_size();
+  auto* entry_ty = StructType::get(*ctx_, {i64_ty, ArrayType::get(i64_ty, num_keys), i64_ty});
+  auto* table_ty = ArrayType::get(entry_ty, memo_size_);
+  auto* table = new GlobalVariable(*module_, table_ty, false, GlobalValue::ExternalLinkage,
+                                   ConstantAggregateZero::get(table_ty),
+                                   name + MEMO_TABLE_SUFFIX);
+  auto* hits = new GlobalVariable(*module_, i64_ty, false, GlobalValue::ExternalLinkage,
+                                  ConstantInt::get(i64_ty, 0), name + MEMO_HITS_SUFFIX);
+  auto* misses = new GlobalVariable(*module_, i64_ty, false, GlobalValue::ExternalLinkage,
+                                    ConstantInt::get(i64_ty, 0), name + MEMO_MISSES_SUFFIX);
+
+  auto* bb = BasicBlock::Create(*ctx_, "entry");
+  if (tier_threshold_ > 0) {
+    emit_tier_counter(fn, bb);
+  }
+  fn->getBasicBlockList().push_back(bb);
+  builder_->SetInsertPoint(bb);
+
+  // Hash the arguments, mixing the high bits of doubles into the low bits
+  // that pick the entry.
+  SmallVector<Value*, 4> keys;
+  Value* hash = ConstantInt::get(i64_ty, 0);
+  for (auto& arg : fn->args()) {
+    auto* key = builder_->CreateBitCast(&arg, i64_ty, arg.getName() + ".key");
+    keys.push_back(key);
+    hash = builder_->CreateMul(builder_->CreateXor(hash, key),
+                               ConstantInt::get(i64_ty, 0x9e3779b97f4a7c15));
+  }
+  for (uint64_t mul : {0xff51afd7ed558ccdull, 0xc4ceb9fe1a85ec53ull}) {
+    hash = builder_->CreateXor(hash, builder_->CreateLShr(hash, 33));
+    hash = builder_->CreateMul(hash, ConstantInt::get(i64_ty, mul));
+  }
+  hash = builder_->CreateXor(hash, builder_->CreateLShr(hash, 33), "hash");
+  auto* mask = ConstantInt::get(i64_ty, memo_size_ - 1);
+
+  auto* bb_probe = BasicBlock::Create(*ctx_, "memo.probe", fn);
+  auto* bb_check = BasicBlock::Create(*ctx_, "memo.check", fn);
+  auto* bb_next = BasicBlock::Create(*ctx_, "memo.next", fn);
+  auto* bb_full = BasicBlock::Create(*ctx_, "memo.full", fn);
+  auto* bb_hit = BasicBlock::Create(*ctx_, "memo.hit", fn);
+  auto* bb_miss = BasicBlock::Create(*ctx_, "memo.miss", fn);
+  auto* bb_store = BasicBlock::Create(*ctx_, "memo.store", fn);
+  auto* bb_write = BasicBlock::Create(*ctx_, "memo.write", fn);
+  auto* bb_ret = BasicBlock::Create(*ctx_, "memo.ret", fn);
+  auto* bb_entry = builder_->GetInsertBlock();
+  builder_->CreateBr(bb_probe);
+
+  // Probe the entries following the hashed one until the arguments match or
+  // an entry is empty. Readers check that the sequence number did not change
+  // while they read the entry.
+  auto entry_ptr = [&](Value* slot, unsigned field) {
+    return builder_->CreateInBoundsGEP(
+        table_ty, table, {builder_->getInt64(0), slot, builder_->getInt32(field)});
+  };
+  auto atomic_load = [&](Value* ptr, AtomicOrdering order) {
+    auto* load = builder_->CreateAlignedLoad(i64_ty, ptr, Align(8));
+    load->setAtomic(order);
+    return load;
+  };
+  auto atomic_store = [&](Value* val, Value* ptr, AtomicOrdering order) {
+    builder_->CreateAlignedStore(val, ptr, Align(8))->setAtomic(order);
+  };
+  builder_->SetInsertPoint(bb_probe);
+  auto* probe = builder_->CreatePHI(i64_ty, 2, "probe");
+  probe->addIncoming(builder_->getInt64(0), bb_entry);
+  auto* slot = builder_->CreateAnd(builder_->CreateAdd(hash, probe), mask, "slot");
+  auto* seq = atomic_load(entry_ptr(slot, 0), AtomicOrdering::Acquire);
+  auto* bb_nonempty = BasicBlock::Create(*ctx_, "memo.nonempty", fn);
+  builder_->CreateCondBr(builder_->CreateICmpEQ(seq, builder_->getInt64(0)), bb_miss,
+                         bb_nonempty);
+  builder_->SetInsertPoint(bb_nonempty);
+  auto* writing = builder_->CreateTrunc(seq, builder_->getInt1Ty());
+  builder_->CreateCondBr(writing, bb_next, bb_check);
+
+  builder_->SetInsertPoint(bb_check);
+  Value* match = builder_->getTrue();
+  for (unsigned i = 0; i < num_keys; i++) {
+    auto* key_ptr = builder_->CreateInBoundsGEP(
+        table_ty, table,
+        {builder_->getInt64(0), slot, builder_->getInt32(1), builder_->getInt64(i)});
+    auto* key = atomic_load(key_ptr, AtomicOrdering::Monotonic);
+    match = builder_->CreateAnd(match, builder_->CreateICmpEQ(key, keys[i]));
+  }
+  auto* cached = atomic_load(entry_ptr(slot, 2), AtomicOrdering::Monotonic);
+  builder_->CreateFence(AtomicOrdering::Acquire);
+  auto* seq_after = atomic_load(entry_ptr(slot, 0), AtomicOrdering::Monotonic);
+  match = builder_->CreateAnd(match, builder_->CreateICmpEQ(seq, seq_after));
+  builder_->CreateCondBr(match, bb_hit, bb_next);
+
+  builder_->SetInsertPoint(bb_next);
+  auto* next = builder_->CreateAdd(probe, builder_->getInt64(1), "next");
+  probe->addIncoming(next, bb_next);
+  builder_->CreateCondBr(builder_->CreateICmpULT(next, builder_->getInt64(MEMO_PROBES)),
+                         bb_probe, bb_full);
+
+  // With all probed entries taken, one of them picked by the hash is
+  // evicted.
+  builder_->SetInsertPoint(bb_full);
+  auto* evict = builder_->CreateLShr(hash, 64 - Log2_64(MEMO_PROBES));
+  auto* victim = builder_->CreateAnd(builder_->CreateAdd(hash, evict), mask, "victim");
+  builder_->CreateBr(bb_miss);
+
+  // Counters are only updated by plain loads and stores, so racing threads
+  // may lose counts but never slow each other down.
+  auto count = [&](GlobalVariable* counter) {
+    auto* val = atomic_load(counter, AtomicOrdering::Monotonic);
+    atomic_store(builder_->CreateAdd(val, builder_->getInt64(1)), counter,
+                 AtomicOrdering::Monotonic);
+  };
+  builder_->SetInsertPoint(bb_hit);
+  count(hits);
+  auto* hit_val = builder_->CreateBitCast(cached, double_ty);
+  builder_->CreateBr(bb_ret);
+
+  builder_->SetInsertPoint(bb_miss);
+  auto* store_slot = builder_->CreatePHI(i64_ty, 2, "store.slot");
+  store_slot->addIncoming(slot, bb_probe);
+  store_slot->addIncoming(victim, bb_full);
+  count(misses);
+  SmallVector<Value*, 4> args;
+  for (auto& arg : fn->args()) {
+    args.push_back(&arg);
+  }
+  auto* val = builder_->CreateCall(body_fn, args, "val");
+
+  // Claim the entry by making its sequence number odd, or leave the result
+  // uncached if another thread is writing it.
+  auto* store_seq = atomic_load(entry_ptr(store_slot, 0), AtomicOrdering::Monotonic);
+  auto* store_busy = builder_->CreateTrunc(store_seq, builder_->getInt1Ty());
+  builder_->CreateCondBr(store_busy, bb_ret, bb_store);
+  builder_->SetInsertPoint(bb_store);
+  auto* claim = builder_->CreateAtomicCmpXchg(
+      entry_ptr(store_slot, 0), store_seq, builder_->CreateAdd(store_seq, builder_->getInt64(1)),
+      Align(8), AtomicOrdering::Monotonic, AtomicOrdering::Monotonic);
+  builder_->CreateCondBr(builder_->CreateExtractValue(claim, 1), bb_write, bb_ret);
+  builder_->SetInsertPoint(bb_write);
+  builder_->CreateFence(AtomicOrdering::Release);
+  for (unsigned i = 0; i < num_keys; i++) {
+    auto* key_ptr = builder_->CreateInBoundsGEP(
+        table_ty, table,
+        {builder_->getInt64(0), store_slot, builder_->getInt32(1), builder_->getInt64(i)});
+    atomic_store(keys[i], key_ptr, AtomicOrdering::Monotonic);
+  }
+  atomic_store(builder_->CreateBitCast(val, i64_ty), entry_ptr(store_slot, 2),
+               AtomicOrdering::Monotonic);
+  atomic_store(builder_->CreateAdd(store_seq, builder_->getInt64(2)), entry_ptr(store_slot, 0),
+               AtomicOrdering::Release);
+  builder_->CreateBr(bb_ret);
+
+  builder_->SetInsertPoint(bb_ret);
+  auto* res = builder_->CreatePHI(double_ty, 4, "res");
+  res->addIncoming(hit_val, bb_hit);
+  res->addIncoming(val, bb_miss);
+  res->addIncoming(val, bb_store);
+  res->addIncoming(val, bb_write);
+  builder_->CreateRet(res);
+}
+
+void Emitter::erase_memo(Function& fn) {
+  auto name = fn.getName().str();
+  if (auto* body_fn = module_->getFunction(name + MEMO_BODY_SUFFIX)) {
+    body_fn->eraseFromParent();
+  }
+  for (auto* suffix : {&MEMO_TABLE_SUFFIX, &MEMO_HITS_SUFFIX, &MEMO_MISSES_SUFFIX}) {
+    if (auto* global = module_->getNamedGlobal(name + *suffix)) {
+      global->eraseFromParent();
+    }
+  }
+}
+
+void Emitter::emit_tier_counter(Function* fn, BasicBlock* bb_body) {
+  auto* count_ty = builder_->getInt64Ty();
+  auto counter_name = fn->getName().str() + ".tier.count";
+  auto* counter = module_->getNamedGlobal(counter_name);
+  if (!counter) {
+    counter = new GlobalVariable(*module_, count_ty, false, GlobalValue::InternalLinkage,
+                                 ConstantInt::get(count_ty, 0), counter_name);
+  }
+  fn->addFnAttr(TIER_COUNTER_ATTR);
+
+  auto* bb_count = BasicBlock::Create(*ctx_, "tier.count", fn);
+  auto* bb_up = BasicBlock::Create(*ctx_, "tier.up", fn);
+
+  // A plain increment is enough, racing callers only delay the tier-up.
+  builder_->SetInsertPoint(bb_count);
+  Value* count = builder_->CreateLoad(count_ty, counter);
+  count = builder_->CreateAdd(count, ConstantInt::get(count_ty, 1));
+  builder_->CreateStore(count, counter);
+  auto* hot = builder_->CreateICmpEQ(count, ConstantInt::get(count_ty, tier_threshold_));
+  builder_->CreateCondBr(hot, bb_up, bb_body);
+
+  // Request recompilation once, when the count hits the threshold.
+  builder_->SetInsertPoint(bb_up);
+  auto* ptr_ty = builder_->getInt8PtrTy();
+  auto* tier_ctx = module_->getOrInsertGlobal(TIER_CTX_NAME, builder_->getInt8Ty());
+  auto tier_up = module_->getOrInsertFunction(
+      TIER_UP_NAME, builder_->getVoidTy(), ptr_ty, ptr_ty);
+  builder_->CreateCall(tier_up, {tier_ctx, builder_->CreateGlobalStringPtr(fn->getName())});
+  builder_->CreateBr(bb_body);
+}
+
+Value* Emitter::emit_expr(const ExprAST* expr, bool tail) {
   if (auto* num = dyn_cast<NumExprAST>(expr)) {
     return emit_num_expr(num);
   } else if (auto* var = dyn_cast<VarExprAST>(expr)) {
@@ -154,36 +618,76 @@ Value* Emitter::emit_expr(const ExprAST* expr) {
   } else if (auto* bin = dyn_cast<BinExprAST>(expr)) {
     return emit_bin_expr(bin);
   } else if (auto* call = dyn_cast<CallExprAST>(expr)) {
-    return emit_call_expr(call);
+    return emit_call_expr(call, tail);
   } else if (auto* ifexpr = dyn_cast<IfExprAST>(expr)) {
-    return emit_if_expr(ifexpr);
+    return emit_if_expr(ifexpr, tail);
   } else if (auto* forexpr = dyn_cast<ForExprAST>(expr)) {
     return emit_for_expr(forexpr);
+  } else if (auto* index = dyn_cast<IndexExprAST>(expr)) {
+    return emit_index_expr(index);
+  } else if (auto* store = dyn_cast<StoreExprAST>(expr)) {
+    return emit_store_expr(store);
+  } else if (auto* len = dyn_cast<LenExprAST>(expr)) {
+    return emit_len_expr(len);
+  } else if (auto* array = dyn_cast<ArrayExprAST>(expr)) {
+    return emit_array_expr(array);
+  } else if (auto* let = dyn_cast<LetExprAST>(expr)) {
+    return emit_let_expr(let, tail);
+  } else if (auto* assign = dyn_cast<AssignExprAST>(expr)) {
+    return emit_assign_expr(assign);
+  } else if (auto* reduce = dyn_cast<ReduceExprAST>(expr)) {
+    return emit_reduce_expr(reduce);
+  } else if (auto* par = dyn_cast<ParExprAST>(expr)) {
+    return emit_par_expr(par);
   } else {
     return nullptr;
   }
 }
 
+Value* Emitter::emit_num(const ExprAST* expr, bool tail) {
+  auto* val = emit_expr(expr, tail);
+  if (val && is_array(val)) {
+    return log_err("expected a number, found an array");
+  }
+  return val;
+}
+
 Value* Emitter::emit_num_expr(const NumExprAST* num) {
   return ConstantFP::get(*ctx_, APFloat(num->value()));
 }
 
 Value* Emitter::emit_var_expr(const VarExprAST* var) {
-  Value* val = locals_[var->name()];
+  Value* val = emit_local(var->symbol());
   if (!val) {
-    return log_err("unknown variable name: " + var->name());
+    return log_err("unknown variable name: " + var->name().str());
+  }
+  return val;
+}
+
+Value* Emitter::emit_local(Symbol name) {
+  Value* val = locals_.lookup(name);
+  if (auto* slot = dyn_cast_or_null<AllocaInst>(val)) {
+    return builder_->CreateLoad(slot->getAllocatedType(), slot, name.str());
   }
   return val;
 }
 
+AllocaInst* Emitter::emit_slot(Type* ty, const Twine& name) {
+  IRBuilder<> entry(bb_entry_, bb_entry_->begin());
+  return entry.CreateAlloca(ty, nullptr, name);
+}
+
 Value* Emitter::emit_bin_expr(const BinExprAST* bin) {
-  auto* lval = emit_expr(bin->lhs());
-  auto* rval = emit_expr(bin->rhs());
+  auto* lval = emit_num(bin->lhs());
+  auto* rval = emit_num(bin->rhs());
   if (!lval || !rval) {
     return nullptr;
   }
+  return emit_bin_op(bin->op(), lval, rval);
+}
 
-  switch (bin->op()) {
+Value* Emitter::emit_bin_op(char op, Value* lval, Value* rval) {
+  switch (op) {
   case '+':
     return builder_->CreateFAdd(lval, rval);
   case '-':
@@ -195,35 +699,159 @@ Value* Emitter::emit_bin_expr(const BinExprAST* bin) {
     return builder_->CreateUIToFP(res, Type::getDoubleTy(*ctx_));
   }
   default:
-    return log_err("invalid binary operator: " + std::string(1, bin->op()));
+    return log_err("invalid binary operator: " + std::string(1, op));
+  }
+}
+
+Value* Emitter::emit_par_expr(const ParExprAST* par) {
+  auto* bin = par->bin();
+  auto* double_ty = Type::getDoubleTy(*ctx_);
+  auto* int_ty = Type::getInt32Ty(*ctx_);
+  auto* ptr_ty = builder_->getInt8PtrTy();
+
+  // The operands may run in any order, so neither may assign a variable the
+  // other one sees.
+  SmallVector<Symbol, 8> captures;
+  SmallVector<Type*, 8> env_tys;
+  SmallVector<Value*, 8> env_vals;
+  if (!emit_captures(bin, Symbol(), "par", captures, env_tys, env_vals)) {
+    return nullptr;
+  }
+
+  // Forking only pays off while some thread of the pool has nothing to do,
+  // which the runtime keeps in a counter that is cheap to check. Otherwise
+  // the operands run one after the other, like a plain binary operator.
+  auto* fn = builder_->GetInsertBlock()->getParent();
+  auto* idle_var = module_->getOrInsertGlobal(PAR_IDLE_NAME, int_ty);
+  auto* idle = builder_->CreateAlignedLoad(int_ty, idle_var, Align(4), "idle");
+  idle->setAtomic(AtomicOrdering::Monotonic);
+  auto* bb_fork = BasicBlock::Create(*ctx_, "par.fork", fn);
+  auto* bb_seq = BasicBlock::Create(*ctx_, "par.seq");
+  auto* bb_end = BasicBlock::Create(*ctx_, "par.end");
+  builder_->CreateCondBr(builder_->CreateICmpEQ(idle, ConstantInt::get(int_ty, 0)), bb_seq,
+                         bb_fork);
+
+  // Outline the right operand into `double task(env)`, which the runtime
+  // may hand to an idle thread while this one evaluates the left operand.
+  builder_->SetInsertPoint(bb_fork);
+  auto* env_ty = StructType::get(*ctx_, env_tys);
+  auto* env = emit_slot(env_ty, "par.env");
+  for (size_t i = 0; i < env_vals.size(); i++) {
+    builder_->CreateStore(env_vals[i], builder_->CreateStructGEP(env_ty, env, i));
+  }
+  auto* task_ty = FunctionType::get(double_ty, {ptr_ty}, false);
+  auto* task = emit_task(task_ty, fn->getName() + ".par", [&](Function* task) -> Value* {
+    task->getArg(0)->setName("env");
+    auto* env_arg = builder_->CreatePointerCast(task->getArg(0), env_ty->getPointerTo());
+    for (size_t i = 0; i < captures.size(); i++) {
+      auto* ptr = builder_->CreateStructGEP(env_ty, env_arg, i);
+      locals_.insert(captures[i], builder_->CreateLoad(env_tys[i], ptr, captures[i].str()));
+    }
+    return emit_num(bin->rhs());
+  });
+  if (!task) {
+    return nullptr;
+  }
+  auto* task_ptr = builder_->CreatePointerCast(task, ptr_ty);
+  auto* env_ptr = builder_->CreatePointerCast(env, ptr_ty);
+  auto spawn = module_->getOrInsertFunction(SPAWN_NAME, ptr_ty, ptr_ty, ptr_ty);
+  auto* handle = builder_->CreateCall(spawn, {task_ptr, env_ptr}, "handle");
+  auto* fork_lval = emit_num(bin->lhs());
+  if (!fork_lval) {
+    return nullptr;
+  }
+  auto sync = module_->getOrInsertFunction(SYNC_NAME, double_ty, ptr_ty, ptr_ty, ptr_ty);
+  auto* fork_rval = builder_->CreateCall(sync, {handle, task_ptr, env_ptr});
+  auto* fork_val = emit_bin_op(bin->op(), fork_lval, fork_rval);
+  if (!fork_val) {
+    return nullptr;
+  }
+  auto* bb_fork_end = builder_->GetInsertBlock();
+  builder_->CreateBr(bb_end);
+
+  fn->getBasicBlockList().push_back(bb_seq);
+  builder_->SetInsertPoint(bb_seq);
+  auto* seq_val = emit_bin_expr(bin);
+  if (!seq_val) {
+    return nullptr;
   }
+  auto* bb_seq_end = builder_->GetInsertBlock();
+  builder_->CreateBr(bb_end);
+
+  fn->getBasicBlockList().push_back(bb_end);
+  builder_->SetInsertPoint(bb_end);
+  auto* phi = builder_->CreatePHI(double_ty, 2, "par");
+  phi->addIncoming(fork_val, bb_fork_end);
+  phi->addIncoming(seq_val, bb_seq_end);
+  return phi;
 }
 
-Value* Emitter::emit_call_expr(const CallExprAST* call) {
+Value* Emitter::emit_call_expr(const CallExprAST* call, bool tail) {
   // Lookup name in module's global symbol table.
-  Function* callee = lookup_fn(call->callee());
+  Function* callee = lookup_fn(call->callee_symbol());
   if (!callee) {
-    return log_err("unknown function: " + call->callee());
+    return log_err("unknown function: " + call->callee().str());
   }
 
   // Check function argument arity.
-  if (callee->arg_size() != call->num_args()) {
+  auto* fn_ty = callee->getFunctionType();
+  if (num_args(fn_ty) != call->num_args()) {
     return log_err("incorrect number of arguments passed");
   }
 
   std::vector<Value*> arg_vals;
-  for (auto& arg : call->args()) {
-    auto* val = emit_expr(arg.get());
+  for (size_t i = 0; i < call->num_args(); i++) {
+    auto* val = emit_expr(call->args()[i]);
     if (!val) {
       return nullptr;
     }
-    arg_vals.push_back(val);
+    bool array_param = fn_ty->getParamType(arg_vals.size())->isPointerTy();
+    if (array_param != is_array(val)) {
+      return log_err(std::string(array_param ? "expected an array" : "expected a number") +
+                     " as argument " + std::to_string(i + 1) + " of " +
+                     call->callee().str());
+    }
+    if (array_param) {
+      arg_vals.push_back(builder_->CreateExtractValue(val, 0));
+      arg_vals.push_back(builder_->CreateExtractValue(val, 1));
+    } else {
+      arg_vals.push_back(val);
+    }
   }
 
-  return builder_->CreateCall(callee, arg_vals);
+  if (!tail) {
+    return builder_->CreateCall(callee, arg_vals);
+  }
+  auto* fn = builder_->GetInsertBlock()->getParent();
+  if (callee != fn || !bb_self_loop_) {
+    return emit_tail_ret(builder_->CreateCall(callee, arg_vals));
+  }
+
+  // Jump back to the start of the body with the new arguments.
+  for (size_t i = 0; i < arg_vals.size(); i++) {
+    self_params_[i]->addIncoming(arg_vals[i], builder_->GetInsertBlock());
+  }
+  self_edges_.push_back(builder_->CreateBr(bb_self_loop_));
+  builder_->SetInsertPoint(BasicBlock::Create(*ctx_, "tail.dead", fn));
+  return PoisonValue::get(Type::getDoubleTy(*ctx_));
 }
 
-Value* Emitter::emit_if_expr(const IfExprAST* ifexpr) {
+Value* Emitter::emit_tail_ret(CallInst* call) {
+  // Calls to functions of the same type are guaranteed to reuse the frame.
+  // Others are left to the code generator, which does the same as long as
+  // the arguments fit in registers.
+  auto* fn = builder_->GetInsertBlock()->getParent();
+  call->setTailCallKind(call->getFunctionType() == fn->getFunctionType()
+                            ? CallInst::TCK_MustTail
+                            : CallInst::TCK_Tail);
+  rets_.push_back(builder_->CreateRet(call));
+
+  // Whatever follows the call, like the end of an 'if', is unreachable.
+  builder_->SetInsertPoint(BasicBlock::Create(*ctx_, "tail.dead", fn));
+  return PoisonValue::get(Type::getDoubleTy(*ctx_));
+}
+
+Value* Emitter::emit_if_expr(const IfExprAST* ifexpr, bool tail) {
   // Create blocks for 'then' and 'else' cases.
   auto* fn = builder_->GetInsertBlock()->getParent();
   auto* bb_then = BasicBlock::Create(*ctx_, "then");
@@ -231,7 +859,7 @@ Value* Emitter::emit_if_expr(const IfExprAST* ifexpr) {
   auto* bb_merge = BasicBlock::Create(*ctx_, "ifend");
 
   // Emit the if condition.
-  auto* cond_val = emit_expr(ifexpr->cond_expr());
+  auto* cond_val = emit_num(ifexpr->cond_expr());
   if (!cond_val) {
     return nullptr;
   }
@@ -242,7 +870,7 @@ Value* Emitter::emit_if_expr(const IfExprAST* ifexpr) {
   // Emit the 'then' branch.
   fn->getBasicBlockList().push_back(bb_then);
   builder_->SetInsertPoint(bb_then);
-  auto* then_val = emit_expr(ifexpr->then_expr());
+  auto* then_val = emit_expr(ifexpr->then_expr(), tail);
   if (!then_val) {
     return nullptr;
   }
@@ -252,61 +880,418 @@ Value* Emitter::emit_if_expr(const IfExprAST* ifexpr) {
   // Emit the 'else' branch.
   fn->getBasicBlockList().push_back(bb_else);
   builder_->SetInsertPoint(bb_else);
-  auto* else_val = emit_expr(ifexpr->else_expr());
+  auto* else_val = emit_expr(ifexpr->else_expr(), tail);
   if (!else_val) {
     return nullptr;
   }
   builder_->CreateBr(bb_merge);
   bb_else = builder_->GetInsertBlock();
+  if (then_val->getType() != else_val->getType()) {
+    return log_err("both branches of 'if' have to be numbers or arrays");
+  }
 
   // Emit the merge block.
   fn->getBasicBlockList().push_back(bb_merge);
   builder_->SetInsertPoint(bb_merge);
-  auto* phi = builder_->CreatePHI(Type::getDoubleTy(*ctx_), 2, "ifphi");
+  auto* phi = builder_->CreatePHI(then_val->getType(), 2, "ifphi");
   phi->addIncoming(then_val, bb_then);
   phi->addIncoming(else_val, bb_else);
 
   return phi;
 }
 
-Value* Emitter::emit_for_expr(const ForExprAST* forexpr) {
-  auto& var_name = forexpr->itervar();
-  auto* zero_val = ConstantFP::get(*ctx_, APFloat(0.0));
-
-  // Create blocks for the loop.
+Value* Emitter::emit_for_expr(const ForExprAST* forexpr, const Reduction* reduce) {
+  // Start the loop preheader.
   auto* fn = builder_->GetInsertBlock()->getParent();
   auto* bb_preheader = BasicBlock::Create(*ctx_, "loop.pre");
-  auto* bb_loop_cond = BasicBlock::Create(*ctx_, "loop.cond");
-  auto* bb_cond_less = BasicBlock::Create(*ctx_, "loop.cond.less");
-  auto* bb_cond_else = BasicBlock::Create(*ctx_, "loop.cond.else");
-  auto* bb_loop_body = BasicBlock::Create(*ctx_, "loop.body");
-  auto* bb_loop_post = BasicBlock::Create(*ctx_, "loop.post");
-  auto* bb_loop_end = BasicBlock::Create(*ctx_, "loop.end");
-
-  // Start the loop preheader.
   fn->getBasicBlockList().push_back(bb_preheader);
   builder_->CreateBr(bb_preheader);
   builder_->SetInsertPoint(bb_preheader);
 
   // Emit the range bounds (these are evaluated once).
-  auto* init_val = emit_expr(forexpr->init_expr());
+  auto* init_val = emit_num(forexpr->init_expr());
   if (!init_val) {
     return nullptr;
   }
-  auto* stop_val = emit_expr(forexpr->stop_expr());
+  auto* stop_val = emit_num(forexpr->stop_expr());
   if (!stop_val) {
     return nullptr;
   }
   Value* step_val;
   if (forexpr->has_step()) {
-    step_val = emit_expr(forexpr->step_expr());
+    step_val = emit_num(forexpr->step_expr());
     if (!step_val) {
       return nullptr;
     }
   } else {
     step_val = ConstantFP::get(*ctx_, APFloat(ForExprAST::DEFAULT_STEP));
   }
-  bb_preheader = builder_->GetInsertBlock();
+  Value* grain_val = nullptr;
+  if (forexpr->has_grain()) {
+    grain_val = emit_num(forexpr->grain_expr());
+    if (!grain_val) {
+      return nullptr;
+    }
+  }
+
+  // Loops starting at an integer and stepping by a constant integer count
+  // with an integer. Only those can run in parallel, other `pfor` loops and
+  // reductions run serially.
+  auto* step_const = dyn_cast<ConstantFP>(step_val);
+  if (step_const && step_const->getValueAPF().isInteger() && !step_const->isZero() &&
+      std::abs(step_const->getValueAPF().convertToDouble()) <= MAX_EXACT_INT) {
+    double init_bound;
+    if (auto* init_int = emit_int(init_val, init_bound)) {
+      int64_t step = step_const->getValueAPF().convertToDouble();
+      if (forexpr->is_parallel() && (!reduce || can_run_in_parallel(*reduce))) {
+        return emit_parallel_for_expr(forexpr, init_int, init_bound, stop_val, step, grain_val,
+                                      reduce);
+      }
+      return emit_counted_for_expr(forexpr, init_int, init_bound, stop_val, step, reduce);
+    }
+  }
+  return emit_float_for_expr(forexpr, init_val, stop_val, step_val, reduce);
+}
+
+bool Emitter::emit_loop_body(const ForExprAST* forexpr, const Reduction* reduce) {
+  if (!reduce) {
+    return emit_expr(forexpr->body_expr()) != nullptr;
+  }
+  auto* val = emit_num(forexpr->body_expr());
+  if (!val) {
+    return false;
+  }
+  auto* acc = builder_->CreateLoad(Type::getDoubleTy(*ctx_), reduce->acc, "acc");
+  builder_->CreateStore(emit_combine(*reduce, acc, val), reduce->acc);
+  return true;
+}
+
+Value* Emitter::emit_counted_bound(Value*& init_val, double init_bound, Value* stop_val,
+                                   int64_t step) {
+  // Counting with an integer makes array indexes derived from the counter
+  // affine and the trip count computable. The start and bounds are clamped
+  // to 2^53, within which doubles count exactly, so this runs the same
+  // iterations as counting with doubles.
+  auto* double_ty = Type::getDoubleTy(*ctx_);
+  auto* int_ty = Type::getInt64Ty(*ctx_);
+  auto clamp = [&](Value* val) {
+    val = builder_->CreateBinaryIntrinsic(Intrinsic::smin, val,
+                                          ConstantInt::get(int_ty, int64_t(MAX_EXACT_INT)));
+    return builder_->CreateBinaryIntrinsic(Intrinsic::smax, val,
+                                           ConstantInt::get(int_ty, -int64_t(MAX_EXACT_INT)));
+  };
+  if (init_bound > MAX_EXACT_INT) {
+    init_val = clamp(init_val);
+  }
+
+  // An integer counter stays below a bound exactly when it stays below its
+  // ceiling (or above its floor when counting down). A NaN bound runs no
+  // iterations.
+  double stop_bound;
+  Value* bound = emit_int(stop_val, stop_bound);
+  if (bound) {
+    if (stop_bound > MAX_EXACT_INT) {
+      bound = clamp(bound);
+    }
+  } else {
+    auto* is_nan = builder_->CreateFCmpUNO(stop_val, stop_val);
+    auto round = step > 0 ? Intrinsic::ceil : Intrinsic::floor;
+    stop_val = builder_->CreateUnaryIntrinsic(round, stop_val);
+    stop_val = builder_->CreateMinNum(stop_val, ConstantFP::get(double_ty, MAX_EXACT_INT));
+    stop_val = builder_->CreateMaxNum(stop_val, ConstantFP::get(double_ty, -MAX_EXACT_INT));
+    bound = builder_->CreateFPToSI(stop_val, int_ty);
+    bound = builder_->CreateSelect(is_nan, init_val, bound);
+  }
+  bound->setName("bound");
+  return bound;
+}
+
+Value* Emitter::emit_counted_for_expr(const ForExprAST* forexpr, Value* init_val,
+                                      double init_bound, Value* stop_val, int64_t step,
+                                      const Reduction* reduce) {
+  auto* double_ty = Type::getDoubleTy(*ctx_);
+  auto* int_ty = Type::getInt64Ty(*ctx_);
+  auto* zero_val = ConstantFP::get(*ctx_, APFloat(0.0));
+  auto* bound = emit_counted_bound(init_val, init_bound, stop_val, step);
+  auto* bb_preheader = builder_->GetInsertBlock();
+
+  auto* fn = bb_preheader->getParent();
+  auto* bb_loop_cond = BasicBlock::Create(*ctx_, "loop.cond");
+  auto* bb_loop_body = BasicBlock::Create(*ctx_, "loop.body");
+  auto* bb_loop_post = BasicBlock::Create(*ctx_, "loop.post");
+  auto* bb_loop_end = BasicBlock::Create(*ctx_, "loop.end");
+
+  fn->getBasicBlockList().push_back(bb_loop_cond);
+  builder_->CreateBr(bb_loop_cond);
+  builder_->SetInsertPoint(bb_loop_cond);
+  auto* iter = builder_->CreatePHI(int_ty, 2, forexpr->itervar() + ".int");
+  iter->addIncoming(init_val, bb_preheader);
+  auto* cmp = step > 0 ? builder_->CreateICmpSLT(iter, bound)
+                       : builder_->CreateICmpSGT(iter, bound);
+  builder_->CreateCondBr(cmp, bb_loop_body, bb_loop_end);
+
+  // The itervar shadows any outer variable until the scope ends.
+  fn->getBasicBlockList().push_back(bb_loop_body);
+  builder_->SetInsertPoint(bb_loop_body);
+  ScopedHashTableScope<Symbol, Value*> scope(locals_);
+  locals_.insert(forexpr->itervar_symbol(),
+                 builder_->CreateSIToFP(iter, double_ty, forexpr->itervar()));
+  if (!emit_loop_body(forexpr, reduce)) {
+    return nullptr;
+  }
+  builder_->CreateBr(bb_loop_post);
+
+  // Both the counter and the bound stay within 2^53 plus one step.
+  fn->getBasicBlockList().push_back(bb_loop_post);
+  builder_->SetInsertPoint(bb_loop_post);
+  auto* next = builder_->CreateNSWAdd(iter, ConstantInt::get(int_ty, step), "next");
+  iter->addIncoming(next, bb_loop_post);
+  builder_->CreateBr(bb_loop_cond);
+
+  fn->getBasicBlockList().push_back(bb_loop_end);
+  builder_->SetInsertPoint(bb_loop_end);
+  return zero_val;
+}
+
+Value* Emitter::emit_parallel_for_expr(const ForExprAST* forexpr, Value* init_val,
+                                       double init_bound, Value* stop_val, int64_t step,
+                                       Value* grain_val, const Reduction* reduce) {
+  auto* double_ty = Type::getDoubleTy(*ctx_);
+  auto* int_ty = Type::getInt64Ty(*ctx_);
+  auto* ptr_ty = builder_->getInt8PtrTy();
+  auto* bound = emit_counted_bound(init_val, init_bound, stop_val, step);
+
+  // The runtime splits the iterations [0, count) into ranges, and iteration
+  // k runs the body for init + k*step.
+  int64_t abs_step = step > 0 ? step : -step;
+  auto* dist = step > 0 ? builder_->CreateNSWSub(bound, init_val)
+                        : builder_->CreateNSWSub(init_val, bound);
+  Value* count = builder_->CreateNSWAdd(dist, ConstantInt::get(int_ty, abs_step - 1));
+  count = builder_->CreateSDiv(count, ConstantInt::get(int_ty, abs_step));
+  count = builder_->CreateBinaryIntrinsic(Intrinsic::smax, count, ConstantInt::get(int_ty, 0),
+                                          nullptr, "count");
+  Value* grain = ConstantInt::get(int_ty, 0);
+  if (grain_val) {
+    grain = builder_->CreateIntrinsic(Intrinsic::fptosi_sat, {int_ty, double_ty}, {grain_val});
+  }
+
+  // The body gets the start and the identity of a reduction along with its
+  // captures.
+  SmallVector<Symbol, 8> captures;
+  SmallVector<Type*, 8> env_tys{int_ty};
+  SmallVector<Value*, 8> env_vals{init_val};
+  if (reduce) {
+    env_tys.push_back(double_ty);
+    env_vals.push_back(reduce->identity);
+  }
+  size_t first_capture = env_vals.size();
+  if (!emit_captures(forexpr->body_expr(), forexpr->itervar_symbol(), "pfor", captures, env_tys,
+                     env_vals)) {
+    return nullptr;
+  }
+  auto* env_ty = StructType::get(*ctx_, env_tys);
+  auto* env = emit_slot(env_ty, "pfor.env");
+  for (size_t i = 0; i < env_vals.size(); i++) {
+    builder_->CreateStore(env_vals[i], builder_->CreateStructGEP(env_ty, env, i));
+  }
+
+  // Outline the body into `void task(env, lo, hi)`, which runs the
+  // iterations [lo, hi), or `double task(env, lo, hi)` for a reduction,
+  // which returns their combined values.
+  auto* fn = builder_->GetInsertBlock()->getParent();
+  auto* ret_ty = reduce ? double_ty : builder_->getVoidTy();
+  auto* task_ty = FunctionType::get(ret_ty, {ptr_ty, int_ty, int_ty}, false);
+  auto* task = emit_task(
+      task_ty, fn->getName() + (reduce ? ".reduce" : ".pfor"), [&](Function* task) -> Value* {
+        task->getArg(0)->setName("env");
+        task->getArg(1)->setName("lo");
+        task->getArg(2)->setName("hi");
+        auto* env_arg = builder_->CreatePointerCast(task->getArg(0), env_ty->getPointerTo());
+        auto* task_init = builder_->CreateLoad(
+            int_ty, builder_->CreateStructGEP(env_ty, env_arg, 0), "init");
+        for (size_t i = 0; i < captures.size(); i++) {
+          auto* ptr = builder_->CreateStructGEP(env_ty, env_arg, first_capture + i);
+          locals_.insert(captures[i], builder_->CreateLoad(env_tys[first_capture + i], ptr,
+                                                           captures[i].str()));
+        }
+
+        // Each range starts a reduction of its own.
+        Reduction task_reduce{};
+        if (reduce) {
+          auto* identity = builder_->CreateLoad(
+              double_ty, builder_->CreateStructGEP(env_ty, env_arg, 1), "identity");
+          task_reduce = {reduce->expr, emit_slot(double_ty, "acc"), identity, reduce->fold_fn};
+          builder_->CreateStore(identity, task_reduce.acc);
+        }
+
+        auto* bb_entry = builder_->GetInsertBlock();
+        auto* bb_loop_cond = BasicBlock::Create(*ctx_, "loop.cond", task);
+        builder_->CreateBr(bb_loop_cond);
+        builder_->SetInsertPoint(bb_loop_cond);
+        auto* k = builder_->CreatePHI(int_ty, 2, "k");
+        k->addIncoming(task->getArg(1), bb_entry);
+        auto* bb_loop_body = BasicBlock::Create(*ctx_, "loop.body", task);
+        auto* bb_loop_end = BasicBlock::Create(*ctx_, "loop.end");
+        builder_->CreateCondBr(builder_->CreateICmpSLT(k, task->getArg(2)), bb_loop_body,
+                               bb_loop_end);
+
+        builder_->SetInsertPoint(bb_loop_body);
+        auto* iter = builder_->CreateNSWAdd(
+            task_init, builder_->CreateNSWMul(k, ConstantInt::get(int_ty, step)),
+            forexpr->itervar() + ".int");
+        locals_.insert(forexpr->itervar_symbol(),
+                       builder_->CreateSIToFP(iter, double_ty, forexpr->itervar()));
+        if (!emit_loop_body(forexpr, reduce ? &task_reduce : nullptr)) {
+          task->getBasicBlockList().push_back(bb_loop_end);
+          return nullptr;
+        }
+        auto* bb_loop_post = BasicBlock::Create(*ctx_, "loop.post", task);
+        builder_->CreateBr(bb_loop_post);
+        builder_->SetInsertPoint(bb_loop_post);
+        auto* next = builder_->CreateNSWAdd(k, ConstantInt::get(int_ty, 1), "next");
+        k->addIncoming(next, bb_loop_post);
+        builder_->CreateBr(bb_loop_cond);
+
+        task->getBasicBlockList().push_back(bb_loop_end);
+        builder_->SetInsertPoint(bb_loop_end);
+        if (!reduce) {
+          return task;
+        }
+        return builder_->CreateLoad(double_ty, task_reduce.acc);
+      });
+  if (!task) {
+    return nullptr;
+  }
+
+  if (!reduce) {
+    auto pfor = module_->getOrInsertFunction(PFOR_NAME, builder_->getVoidTy(), ptr_ty, ptr_ty,
+                                             int_ty, int_ty);
+    builder_->CreateCall(pfor, {builder_->CreatePointerCast(task, ptr_ty),
+                                builder_->CreatePointerCast(env, ptr_ty), count, grain});
+    return ConstantFP::get(*ctx_, APFloat(0.0));
+  }
+
+  // The runtime combines the results of the ranges with the same operator.
+  Value* combine = reduce->fold_fn;
+  if (!combine) {
+    auto& name = reduce->expr->op() == ReduceExprAST::RO_SUM   ? REDUCE_ADD_NAME
+                 : reduce->expr->op() == ReduceExprAST::RO_MIN ? REDUCE_MIN_NAME
+                                                               : REDUCE_MAX_NAME;
+    combine = module_->getOrInsertFunction(name, double_ty, double_ty, double_ty).getCallee();
+  }
+  auto preduce = module_->getOrInsertFunction(PREDUCE_NAME, double_ty, ptr_ty, ptr_ty, int_ty,
+                                              int_ty, ptr_ty, double_ty);
+  auto* res = builder_->CreateCall(
+      preduce, {builder_->CreatePointerCast(task, ptr_ty), builder_->CreatePointerCast(env, ptr_ty),
+                count, grain, builder_->CreatePointerCast(combine, ptr_ty), reduce->identity});
+  builder_->CreateStore(res, reduce->acc);
+  return ConstantFP::get(*ctx_, APFloat(0.0));
+}
+
+bool Emitter::emit_captures(const ExprAST* expr, Symbol skip, StringRef construct,
+                            SmallVectorImpl<Symbol>& captures, SmallVectorImpl<Type*>& env_tys,
+                            SmallVectorImpl<Value*>& env_vals) {
+  // Tasks run on other threads, so they get copies of the locals they use
+  // and cannot assign to them.
+  FreeLocalsCache cache;
+  const auto& locals = collect_locals(expr, cache);
+  for (auto name : locals.used) {
+    auto* local = locals_.lookup(name);
+    if (!local || name == skip) {
+      continue;
+    }
+    if (isa<AllocaInst>(local) && locals.assigned.count(name)) {
+      log_err("cannot assign " + name.str().str() + " inside " + construct.str());
+      return false;
+    }
+    auto* val = emit_local(name);
+    captures.push_back(name);
+    env_tys.push_back(val->getType());
+    env_vals.push_back(val);
+  }
+  return true;
+}
+
+Function* Emitter::emit_task(FunctionType* task_ty, const Twine& name,
+                             function_ref<Value*(Function*)> emit_body) {
+  auto* task = Function::Create(task_ty, Function::ExternalLinkage, name, module_.get());
+
+  // Set aside the state of the current function.
+  auto saved_ip = builder_->saveIP();
+  auto* saved_entry = bb_entry_;
+  auto* saved_arrays = arrays_;
+  auto* saved_self_loop = bb_self_loop_;
+  auto saved_self_params = std::move(self_params_);
+  auto saved_rets = std::move(rets_);
+  auto saved_self_edges = std::move(self_edges_);
+  bb_entry_ = BasicBlock::Create(*ctx_, "entry", task);
+  arrays_ = nullptr;
+  bb_self_loop_ = nullptr;
+  self_params_.clear();
+  rets_.clear();
+  self_edges_.clear();
+  bool ok;
+  {
+    builder_->SetInsertPoint(bb_entry_);
+    ScopedHashTableScope<Symbol, Value*> scope(locals_);
+    auto* res = emit_body(task);
+    ok = res != nullptr;
+    if (ok) {
+      rets_.push_back(task_ty->getReturnType()->isVoidTy() ? builder_->CreateRetVoid()
+                                                           : builder_->CreateRet(res));
+      emit_array_frees();
+    }
+  }
+  builder_->restoreIP(saved_ip);
+  bb_entry_ = saved_entry;
+  arrays_ = saved_arrays;
+  bb_self_loop_ = saved_self_loop;
+  self_params_ = std::move(saved_self_params);
+  rets_ = std::move(saved_rets);
+  self_edges_ = std::move(saved_self_edges);
+
+  if (!ok) {
+    task->eraseFromParent();
+    return nullptr;
+  }
+  std::string buf;
+  raw_string_ostream stream(buf);
+  if (verifyFunction(*task, &stream)) {
+    task->eraseFromParent();
+    return log_err_fn("incorrect llvm function: " + stream.str());
+  }
+  tasks_.push_back(task);
+  return task;
+}
+
+Value* Emitter::emit_float_for_expr(const ForExprAST* forexpr, Value* init_val,
+                                    Value* stop_val, Value* step_val,
+                                    const Reduction* reduce) {
+  // A negative step counts down while iter > stop, any other step counts up
+  // while iter < stop. The direction is decided here rather than on every
+  // iteration: with a constant step by picking the compare, otherwise by
+  // flipping the signs of both sides of iter < stop, which is exact. The
+  // compares are ordered, so a NaN ends the loop.
+  auto* double_ty = Type::getDoubleTy(*ctx_);
+  auto* zero_val = ConstantFP::get(*ctx_, APFloat(0.0));
+  Value* dir_val = nullptr;
+  bool down = false;
+  if (auto* step_const = dyn_cast<ConstantFP>(step_val)) {
+    down = step_const->getValueAPF().compare(APFloat(0.0)) == APFloat::cmpLessThan;
+  } else {
+    auto* is_down = builder_->CreateFCmpOLT(step_val, zero_val);
+    dir_val = builder_->CreateSelect(is_down, ConstantFP::get(double_ty, -1.0),
+                                     ConstantFP::get(double_ty, 1.0), "dir");
+    stop_val = builder_->CreateFMul(stop_val, dir_val, "limit");
+  }
+  auto* bb_preheader = builder_->GetInsertBlock();
+
+  // Create blocks for the loop.
+  auto* fn = bb_preheader->getParent();
+  auto* bb_loop_cond = BasicBlock::Create(*ctx_, "loop.cond");
+  auto* bb_loop_body = BasicBlock::Create(*ctx_, "loop.body");
+  auto* bb_loop_post = BasicBlock::Create(*ctx_, "loop.post");
+  auto* bb_loop_end = BasicBlock::Create(*ctx_, "loop.end");
 
   // Start loop condition block.
   fn->getBasicBlockList().push_back(bb_loop_cond);
@@ -314,33 +1299,27 @@ Value* Emitter::emit_for_expr(const ForExprAST* forexpr) {
   builder_->SetInsertPoint(bb_loop_cond);
 
   // Emit the phi node for the itervar.
-  auto* iter_phi = builder_->CreatePHI(Type::getDoubleTy(*ctx_), 2, var_name);
+  auto* iter_phi = builder_->CreatePHI(double_ty, 2, forexpr->itervar());
   iter_phi->addIncoming(init_val, bb_preheader);
 
-  // Save variable in case it is shadowed by the itervar.
-  auto* old_val = locals_[var_name];
-  locals_[var_name] = iter_phi;
+  // The itervar shadows any outer variable until the scope ends.
+  ScopedHashTableScope<Symbol, Value*> scope(locals_);
+  locals_.insert(forexpr->itervar_symbol(), iter_phi);
 
-  // Check range condition based on step direction.
-  auto* cmp = builder_->CreateFCmpULT(step_val, zero_val);
-  builder_->CreateCondBr(cmp, bb_cond_less, bb_cond_else);
-
-  // if step < 0 then execute loop if iter > stop
-  fn->getBasicBlockList().push_back(bb_cond_less);
-  builder_->SetInsertPoint(bb_cond_less);
-  cmp = builder_->CreateFCmpUGT(iter_phi, stop_val);
-  builder_->CreateCondBr(cmp, bb_loop_body, bb_loop_end);
-
-  // if step >= 0 then execute loop if iter < stop
-  fn->getBasicBlockList().push_back(bb_cond_else);
-  builder_->SetInsertPoint(bb_cond_else);
-  cmp = builder_->CreateFCmpULT(iter_phi, stop_val);
+  Value* cmp;
+  if (dir_val) {
+    cmp = builder_->CreateFCmpOLT(builder_->CreateFMul(iter_phi, dir_val), stop_val);
+  } else if (down) {
+    cmp = builder_->CreateFCmpOGT(iter_phi, stop_val);
+  } else {
+    cmp = builder_->CreateFCmpOLT(iter_phi, stop_val);
+  }
   builder_->CreateCondBr(cmp, bb_loop_body, bb_loop_end);
 
-  // Emit the loop body. Its value is ignored.
+  // Emit the loop body. Its value is ignored, unless it is reduced.
   fn->getBasicBlockList().push_back(bb_loop_body);
   builder_->SetInsertPoint(bb_loop_body);
-  if (!emit_expr(forexpr->body_expr())) {
+  if (!emit_loop_body(forexpr, reduce)) {
     return nullptr;
   }
   builder_->CreateBr(bb_loop_post);
@@ -356,17 +1335,296 @@ Value* Emitter::emit_for_expr(const ForExprAST* forexpr) {
   fn->getBasicBlockList().push_back(bb_loop_end);
   builder_->SetInsertPoint(bb_loop_end);
 
-  // Restore the shadowed variable, if any.
-  if (old_val) {
-    locals_[var_name] = old_val;
-  } else {
-    locals_.erase(var_name);
-  }
-
   // For now, for/in expression always returns zero.
   return zero_val;
 }
 
+Value* Emitter::emit_reduce_expr(const ReduceExprAST* reduce) {
+  auto* double_ty = Type::getDoubleTy(*ctx_);
+  Value* identity = nullptr;
+  Function* fold_fn = nullptr;
+  switch (reduce->op()) {
+  case ReduceExprAST::RO_SUM:
+    identity = ConstantFP::get(double_ty, 0.0);
+    break;
+  case ReduceExprAST::RO_MIN:
+    identity = ConstantFP::getInfinity(double_ty);
+    break;
+  case ReduceExprAST::RO_MAX:
+    identity = ConstantFP::getInfinity(double_ty, true);
+    break;
+  case ReduceExprAST::RO_FOLD:
+    fold_fn = lookup_fn(reduce->fold_symbol());
+    if (!fold_fn) {
+      return log_err("unknown function: " + reduce->fold_name().str());
+    }
+    if (fold_fn->getFunctionType() != FunctionType::get(double_ty, {double_ty, double_ty}, false)) {
+      return log_err("fold needs a function of two numbers: " + reduce->fold_name().str());
+    }
+    identity = emit_num(reduce->init_expr());
+    if (!identity) {
+      return nullptr;
+    }
+    break;
+  }
+
+  // The accumulator lives in a stack slot, which mem2reg turns into a phi of
+  // the loop.
+  auto* acc = emit_slot(double_ty, "acc");
+  builder_->CreateStore(identity, acc);
+  Reduction state{reduce, acc, identity, fold_fn};
+  if (!emit_for_expr(reduce->loop(), &state)) {
+    return nullptr;
+  }
+  return builder_->CreateLoad(double_ty, acc, "reduce");
+}
+
+bool Emitter::can_run_in_parallel(const Reduction& reduce) {
+  // Minimums and maximums ignore NaNs, so they come out the same in any
+  // order. Sums and folds only get reassociated when allowed.
+  auto op = reduce.expr->op();
+  if (op != ReduceExprAST::RO_MIN && op != ReduceExprAST::RO_MAX && !fp_reassoc_) {
+    return false;
+  }
+  auto* loop = reduce.expr->loop();
+  FreeLocalsCache cache;
+  return none_of(collect_locals(loop->body_expr(), cache).assigned, [&](Symbol name) {
+    return name != loop->itervar_symbol() && isa_and_nonnull<AllocaInst>(locals_.lookup(name));
+  });
+}
+
+Value* Emitter::emit_combine(const Reduction& reduce, Value* lhs, Value* rhs) {
+  switch (reduce.expr->op()) {
+  case ReduceExprAST::RO_SUM: {
+    // Reassociation lets the loop vectorizer keep a partial sum per lane.
+    IRBuilder<>::FastMathFlagGuard guard(*builder_);
+    if (fp_reassoc_) {
+      FastMathFlags flags;
+      flags.setAllowReassoc();
+      builder_->setFastMathFlags(flags);
+    }
+    return builder_->CreateFAdd(lhs, rhs, "sum");
+  }
+  case ReduceExprAST::RO_MIN:
+    return builder_->CreateMinNum(lhs, rhs, "min");
+  case ReduceExprAST::RO_MAX:
+    return builder_->CreateMaxNum(lhs, rhs, "max");
+  case ReduceExprAST::RO_FOLD:
+    return builder_->CreateCall(reduce.fold_fn, {lhs, rhs});
+  }
+  llvm_unreachable("unknown reduction");
+}
+
+Value* Emitter::emit_index_expr(const IndexExprAST* index) {
+  auto* ptr = emit_element_ptr(index->array_symbol(), index->index_expr());
+  if (!ptr) {
+    return nullptr;
+  }
+  return builder_->CreateLoad(Type::getDoubleTy(*ctx_), ptr);
+}
+
+Value* Emitter::emit_store_expr(const StoreExprAST* store) {
+  auto* ptr = emit_element_ptr(store->array_symbol(), store->index_expr());
+  if (!ptr) {
+    return nullptr;
+  }
+  auto* val = emit_num(store->value_expr());
+  if (!val) {
+    return nullptr;
+  }
+  builder_->CreateStore(val, ptr);
+  return val;
+}
+
+Value* Emitter::emit_len_expr(const LenExprAST* len) {
+  auto* array = emit_array_var(len->array_symbol());
+  if (!array) {
+    return nullptr;
+  }
+  auto* len_val = builder_->CreateExtractValue(array, 1);
+  return builder_->CreateSIToFP(len_val, Type::getDoubleTy(*ctx_));
+}
+
+Value* Emitter::emit_array_expr(const ArrayExprAST* array) {
+  auto* size_val = emit_num(array->size_expr());
+  if (!size_val) {
+    return nullptr;
+  }
+  auto* int_ty = Type::getInt64Ty(*ctx_);
+  auto* ptr_ty = builder_->getInt8PtrTy();
+  size_val = builder_->CreateIntrinsic(Intrinsic::fptosi_sat, {int_ty, size_val->getType()},
+                                       {size_val});
+
+  // Arrays are freed when the function returns, see `emit_def`.
+  if (!arrays_) {
+    arrays_ = emit_slot(ptr_ty, "arrays");
+    new StoreInst(ConstantPointerNull::get(ptr_ty), arrays_, arrays_->getNextNode());
+  }
+  auto array_new = module_->getOrInsertFunction(
+      ARRAY_NEW_NAME, array_type()->getElementType(0), arrays_->getType(), int_ty);
+  auto* elems = builder_->CreateCall(array_new, {arrays_, size_val});
+
+  Value* res = PoisonValue::get(array_type());
+  res = builder_->CreateInsertValue(res, elems, 0);
+  return builder_->CreateInsertValue(res, size_val, 1);
+}
+
+Value* Emitter::emit_array_var(Symbol name) {
+  Value* val = emit_local(name);
+  if (!val) {
+    return log_err("unknown variable name: " + name.str().str());
+  }
+  if (!is_array(val)) {
+    return log_err("not an array: " + name.str().str());
+  }
+  return val;
+}
+
+Value* Emitter::emit_let_expr(const LetExprAST* let, bool tail) {
+  auto* init_val = emit_expr(let->init_expr());
+  if (!init_val) {
+    return nullptr;
+  }
+
+  // Variables live in stack slots, which mem2reg turns back into registers.
+  auto* slot = emit_slot(init_val->getType(), let->var_name());
+  builder_->CreateStore(init_val, slot);
+
+  // The variable shadows any outer variable until the scope ends.
+  ScopedHashTableScope<Symbol, Value*> scope(locals_);
+  locals_.insert(let->var_symbol(), slot);
+  return emit_expr(let->body_expr(), tail);
+}
+
+Value* Emitter::emit_assign_expr(const AssignExprAST* assign) {
+  auto* slot = locals_.lookup(assign->var_symbol());
+  if (!slot) {
+    return log_err("unknown variable name: " + assign->var_name().str());
+  }
+  if (!isa<AllocaInst>(slot)) {
+    return log_err("not a var: " + assign->var_name().str());
+  }
+  auto* val = emit_expr(assign->value_expr());
+  if (!val) {
+    return nullptr;
+  }
+  if (val->getType() != cast<AllocaInst>(slot)->getAllocatedType()) {
+    return log_err("assigned value has a different type than " + assign->var_name().str());
+  }
+  builder_->CreateStore(val, slot);
+  return val;
+}
+
+Value* Emitter::emit_index(const ExprAST* expr) {
+  auto* val = emit_num(expr);
+  if (!val) {
+    return nullptr;
+  }
+
+  // Index with integer arithmetic on loop counters and lengths, so that the
+  // index stays an affine function of the loop.
+  auto* int_ty = Type::getInt64Ty(*ctx_);
+  double bound;
+  if (auto* index_val = emit_int(val, bound)) {
+    return index_val;
+  }
+
+  // Large values saturate, so they fail the bounds check. Negative ones and
+  // NaN, which would truncate or saturate to 0, become -1 and fail it too.
+  auto* int_val = builder_->CreateIntrinsic(Intrinsic::fptosi_sat, {int_ty, val->getType()}, {val});
+  auto* is_neg = builder_->CreateFCmpULT(val, ConstantFP::get(val->getType(), 0.0), "index.neg");
+  return builder_->CreateSelect(is_neg, ConstantInt::get(int_ty, -1, true), int_val);
+}
+
+Value* Emitter::emit_int(Value* val, double& bound) {
+  auto* int_ty = Type::getInt64Ty(*ctx_);
+  if (auto* num = dyn_cast<ConstantFP>(val)) {
+    double num_val = num->getValueAPF().convertToDouble();
+    if (num_val != std::trunc(num_val) || std::abs(num_val) > MAX_EXACT_INT) {
+      return nullptr;
+    }
+    bound = std::abs(num_val);
+    return ConstantInt::get(int_ty, int64_t(num_val), true);
+  }
+
+  // Loop counters and array lengths, which stay within 2^53.
+  if (auto* conv = dyn_cast<SIToFPInst>(val)) {
+    if (conv->getSrcTy() != int_ty) {
+      return nullptr;
+    }
+    bound = MAX_EXACT_INT;
+    return conv->getOperand(0);
+  }
+
+  auto* op = dyn_cast<BinaryOperator>(val);
+  if (!op || (op->getOpcode() != Instruction::FAdd && op->getOpcode() != Instruction::FSub &&
+              op->getOpcode() != Instruction::FMul)) {
+    return nullptr;
+  }
+  double lhs_bound, rhs_bound;
+  auto* lhs = emit_int(op->getOperand(0), lhs_bound);
+  auto* rhs = lhs ? emit_int(op->getOperand(1), rhs_bound) : nullptr;
+  if (!rhs) {
+    return nullptr;
+  }
+  if (op->getOpcode() != Instruction::FMul) {
+    bound = lhs_bound + rhs_bound;
+    if (bound >= MAX_INT_SUM) {
+      return nullptr;
+    }
+    return op->getOpcode() == Instruction::FAdd ? builder_->CreateNSWAdd(lhs, rhs)
+                                                : builder_->CreateNSWSub(lhs, rhs);
+  }
+  bound = lhs_bound * rhs_bound;
+  if (bound <= MAX_INT_PRODUCT) {
+    return builder_->CreateNSWMul(lhs, rhs);
+  }
+
+  // Larger products saturate. They are past 2^53 either way, which makes
+  // them out of bounds as indexes and clamps them as loop bounds.
+  auto* max_val = ConstantInt::get(int_ty, int64_t(MAX_INT_PRODUCT));
+  Value* res = builder_->CreateIntrinsic(Intrinsic::smul_fix_sat, {int_ty},
+                                         {lhs, rhs, builder_->getInt32(0)});
+  res = builder_->CreateBinaryIntrinsic(Intrinsic::smin, res, max_val);
+  res = builder_->CreateBinaryIntrinsic(Intrinsic::smax, res, builder_->CreateNeg(max_val));
+  bound = MAX_INT_PRODUCT;
+  return res;
+}
+
+Value* Emitter::emit_element_ptr(Symbol array, const ExprAST* index) {
+  auto* array_val = emit_array_var(array);
+  if (!array_val) {
+    return nullptr;
+  }
+  auto* index_val = emit_index(index);
+  if (!index_val) {
+    return nullptr;
+  }
+  auto* elems = builder_->CreateExtractValue(array_val, 0, array.str() + ".elems");
+  auto* len = builder_->CreateExtractValue(array_val, 1, array.str() + ".len");
+
+  // A single unsigned compare on a likely branch, which is the range check
+  // form that IRCE removes from counted loops.
+  auto* fn = builder_->GetInsertBlock()->getParent();
+  auto* bb_fail = BasicBlock::Create(*ctx_, "index.fail", fn);
+  auto* bb_ok = BasicBlock::Create(*ctx_, "index.ok", fn);
+  auto* in_bounds = builder_->CreateICmpULT(index_val, len);
+  builder_->CreateCondBr(in_bounds, bb_ok, bb_fail,
+                         MDBuilder(*ctx_).createBranchWeights(1 << 20, 1));
+
+  builder_->SetInsertPoint(bb_fail);
+  auto* int_ty = Type::getInt64Ty(*ctx_);
+  auto bounds_error = module_->getOrInsertFunction(
+      BOUNDS_ERROR_NAME, builder_->getVoidTy(), int_ty, int_ty);
+  auto* call = builder_->CreateCall(bounds_error, {index_val, len});
+  call->setDoesNotReturn();
+  call->addFnAttr(Attribute::Cold);
+  builder_->CreateUnreachable();
+
+  builder_->SetInsertPoint(bb_ok);
+  return builder_->CreateInBoundsGEP(Type::getDoubleTy(*ctx_), elems, index_val);
+}
+
 Value* Emitter::log_err(StringRef msg) {
   std::cerr << "[error] " << msg.str() << std::endl;
   errored_ = true;
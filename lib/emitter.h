@@ -1,37 +1,98 @@
 #pragma once
 
 #include "ast.h"
+#include "optimizer.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/ScopedHashTable.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
-#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Value.h"
-#include <map>
+#include "llvm/Support/MathExtras.h"
+#include <algorithm>
 
 namespace kscope {
 
-class Optimizer {
+class Emitter {
 public:
-  Optimizer(llvm::Module* mod);
+  /// Runtime hook called by a counted function once it becomes hot, with the
+  /// address of `TIER_CTX_NAME` and the function name.
+  inline static std::string TIER_UP_NAME = "__ks_tier_up";
+  inline static std::string TIER_CTX_NAME = "__ks_tier_ctx";
+
+  /// Runtime functions behind arrays, see lib/std.cpp.
+  inline static std::string ARRAY_NEW_NAME = "__ks_array_new";
+  inline static std::string ARRAY_FREE_NAME = "__ks_array_free";
+  inline static std::string BOUNDS_ERROR_NAME = "__ks_bounds_error";
+  /// Runtime functions running `pfor` loops and parallel reductions, and
+  /// combining partial sums, minimums and maximums, see lib/parallel.cpp.
+  inline static std::string PFOR_NAME = "__ks_pfor";
+  inline static std::string PREDUCE_NAME = "__ks_preduce";
+  inline static std::string REDUCE_ADD_NAME = "__ks_reduce_add";
+  inline static std::string REDUCE_MIN_NAME = "__ks_reduce_min";
+  inline static std::string REDUCE_MAX_NAME = "__ks_reduce_max";
+  /// Runtime functions forking and joining the operands of `par`, and the
+  /// number of idle threads in the pool, see lib/parallel.cpp.
+  inline static std::string SPAWN_NAME = "__ks_spawn";
+  inline static std::string SYNC_NAME = "__ks_sync";
+  inline static std::string PAR_IDLE_NAME = "__ks_par_idle";
+
+  /// Suffixes of the body of a `memo` function, which the function calls on
+  /// cache misses, and of its cache and hit and miss counters.
+  inline static std::string MEMO_BODY_SUFFIX = ".memo";
+  inline static std::string MEMO_TABLE_SUFFIX = ".memo.table";
+  inline static std::string MEMO_HITS_SUFFIX = ".memo.hits";
+  inline static std::string MEMO_MISSES_SUFFIX = ".memo.misses";
+  /// Default number of entries in the cache of a `memo` function.
+  static constexpr uint64_t MEMO_SIZE = 1 << 16;
+  /// Entries probed for the arguments of a `memo` function, starting at the
+  /// one they hash to.
+  static constexpr uint64_t MEMO_PROBES = 8;
+
+  /// Taken modules are optimized with `opt`, if given. Otherwise they are
+  /// left for whoever consumes them (e.g. the JIT's compile threads).
+  Emitter(const std::string& mod_name, const llvm::DataLayout& layout,
+          Optimizer* opt = nullptr);
+
+  /// Returns the current module together with its context, and initializes
+  /// a fresh module in a new context. Every taken module can thus be compiled
+  /// independently of the others.
+  llvm::orc::ThreadSafeModule take_mod();
+
+  /// Prefix every named function with a call counter that calls the tier-up
+  /// hook when it reaches `threshold`. Zero disables counters.
+  void set_tier_threshold(uint64_t threshold) {
+    tier_threshold_ = threshold;
+  }
 
-  /// Optimize the given function.
-  void run(llvm::Function* fn);
+  /// Allow sums and folds to be reassociated, which lets them vectorize and
+  /// run in parallel, but makes floating-point results depend on how the
+  /// iterations are split. Otherwise they combine values in loop order.
+  void set_fp_reassoc(bool reassoc) {
+    fp_reassoc_ = reassoc;
+  }
 
-private:
-  Box<llvm::legacy::FunctionPassManager> fpm_;
-};
+  /// Cache up to `entries` results of each `memo` function, rounded up to a
+  /// power of two.
+  void set_memo_size(uint64_t entries) {
+    memo_size_ = std::max<uint64_t>(llvm::PowerOf2Ceil(entries), MEMO_PROBES);
+  }
 
-class Emitter {
-public:
-  Emitter(const std::string& mod_name, const llvm::DataLayout& layout);
+  /// Whether the function starts with a call counter.
+  static bool has_tier_counter(const llvm::Function& fn);
 
-  /// Returns the current module and initializes a fresh new module.
-  Box<llvm::Module> take_mod();
+  /// Remove the call counter from the function, if it has one.
+  static void strip_tier_counter(llvm::Function& fn);
 
-  /// Track the given prototype in the mapping.
-  void register_proto(Box<PrototypeAST> proto);
+  /// Track the given prototype in the mapping. It has to outlive the emitter.
+  void register_proto(const PrototypeAST* proto);
+
+  /// Returns the prototype of a known extern or definition, or null.
+  const PrototypeAST* lookup_proto(Symbol name) const;
 
   /// Generate LLVM IR for function definition.
   llvm::Function* codegen(const FunctionAST* ast);
@@ -45,24 +106,139 @@ public:
 
 private:
   bool errored_;
+  Optimizer* opt_;
+  uint64_t tier_threshold_ = 0;
+  bool fp_reassoc_ = false;
+  uint64_t memo_size_ = MEMO_SIZE;
   Box<llvm::LLVMContext> ctx_;
   Box<llvm::Module> module_;
   Box<llvm::IRBuilder<>> builder_;
-  Box<Optimizer> opt_;
-  std::map<std::string, llvm::Value*> locals_;
-  std::map<std::string, Box<PrototypeAST>> protos_;
-
-  llvm::Function* lookup_fn(const std::string& name);
+  /// Values of arguments and loop variables, and stack slots of `var`
+  /// bindings, with one scope per function, loop and binding.
+  llvm::ScopedHashTable<Symbol, llvm::Value*> locals_;
+  llvm::DenseMap<Symbol, const PrototypeAST*> protos_;
+  /// First block of the current function's body, which holds its stack
+  /// slots. Comes after the call counter of tiered functions.
+  llvm::BasicBlock* bb_entry_ = nullptr;
+  /// Head of the list of arrays allocated by the current function, created
+  /// by its first `array(n)`.
+  llvm::AllocaInst* arrays_ = nullptr;
+  /// Start of the current function's body when it has self tail calls,
+  /// which jump there, and the parameters they pass.
+  llvm::BasicBlock* bb_self_loop_ = nullptr;
+  llvm::SmallVector<llvm::PHINode*, 4> self_params_;
+  /// Jumps of self tail calls back to the start of the body.
+  llvm::SmallVector<llvm::BranchInst*, 4> self_edges_;
+  /// Returns of the current function, including those after tail calls.
+  llvm::SmallVector<llvm::ReturnInst*, 4> rets_;
+  /// Bodies of `pfor` loops, reductions and `par` operands outlined from the
+  /// current definition.
+  llvm::SmallVector<llvm::Function*, 2> tasks_;
+
+  /// A reduction whose loop is being emitted. Each iteration combines the
+  /// value of the body into the stack slot `acc`, which starts at `identity`.
+  struct Reduction {
+    const ReduceExprAST* expr;
+    llvm::AllocaInst* acc;
+    llvm::Value* identity;
+    llvm::Function* fold_fn;  // `fold` only.
+  };
+
+  llvm::Function* lookup_fn(Symbol name);
+
+  /// Arrays are lowered to a `{double*, i64}` pair of elements and length.
+  llvm::StructType* array_type();
+  bool is_array(llvm::Value* val);
+  /// Array arguments take two parameters, the elements and the length.
+  llvm::FunctionType* fn_type(const PrototypeAST* proto);
 
   llvm::Function* emit_proto(const PrototypeAST* proto);
   llvm::Function* emit_def(const FunctionAST* def);
-  llvm::Value* emit_expr(const ExprAST* expr);
+  /// Free the arrays the current function allocated before each of its
+  /// returns.
+  void emit_array_frees();
+  void emit_tier_counter(llvm::Function* fn, llvm::BasicBlock* bb_body);
+  /// Emit a `memo` function as a lookup of its arguments in a hash table,
+  /// which calls its body and caches the result on misses.
+  void emit_memo(llvm::Function* fn, llvm::Function* body_fn);
+  /// Remove the body and cache of a `memo` function that is redefined.
+  void erase_memo(llvm::Function& fn);
+  /// Set `tail` for expressions in tail position, whose value the function
+  /// returns. Calls there return directly and leave the builder in an
+  /// unreachable block.
+  llvm::Value* emit_expr(const ExprAST* expr, bool tail = false);
+  /// Emit an expression that has to evaluate to a number.
+  llvm::Value* emit_num(const ExprAST* expr, bool tail = false);
   llvm::Value* emit_num_expr(const NumExprAST* num);
   llvm::Value* emit_var_expr(const VarExprAST* var);
+  /// Returns the value of a local, loading it if it is a `var`, or null.
+  llvm::Value* emit_local(Symbol name);
+  /// Create a stack slot in the entry block, where mem2reg promotes it.
+  llvm::AllocaInst* emit_slot(llvm::Type* ty, const llvm::Twine& name);
   llvm::Value* emit_bin_expr(const BinExprAST* bin);
-  llvm::Value* emit_call_expr(const CallExprAST* call);
-  llvm::Value* emit_if_expr(const IfExprAST* ifexpr);
-  llvm::Value* emit_for_expr(const ForExprAST* forexpr);
+  /// Apply a binary operator to two numbers.
+  llvm::Value* emit_bin_op(char op, llvm::Value* lval, llvm::Value* rval);
+  /// Emit `par`, which evaluates the right operand on another thread when
+  /// the pool has one idle, and the binary operator serially otherwise.
+  llvm::Value* emit_par_expr(const ParExprAST* par);
+  llvm::Value* emit_call_expr(const CallExprAST* call, bool tail);
+  /// Return the result of a call in tail position.
+  llvm::Value* emit_tail_ret(llvm::CallInst* call);
+  llvm::Value* emit_if_expr(const IfExprAST* ifexpr, bool tail);
+  /// Emit a loop, which combines the values of its body into `reduce` if
+  /// given.
+  llvm::Value* emit_for_expr(const ForExprAST* forexpr, const Reduction* reduce = nullptr);
+  /// Emit the body of a loop for one iteration.
+  bool emit_loop_body(const ForExprAST* forexpr, const Reduction* reduce);
+  /// Returns the integer bound of a loop counting with an integer, clamping
+  /// its integer start if needed.
+  llvm::Value* emit_counted_bound(llvm::Value*& init_val, double init_bound,
+                                  llvm::Value* stop_val, int64_t step);
+  /// Emit a loop counting with an integer, given its start as an integer.
+  llvm::Value* emit_counted_for_expr(const ForExprAST* forexpr, llvm::Value* init_val,
+                                     double init_bound, llvm::Value* stop_val, int64_t step,
+                                     const Reduction* reduce);
+  /// Emit a counted `pfor` loop or reduction as a call to the runtime, with
+  /// its body outlined into a task over a range of iterations.
+  llvm::Value* emit_parallel_for_expr(const ForExprAST* forexpr, llvm::Value* init_val,
+                                      double init_bound, llvm::Value* stop_val, int64_t step,
+                                      llvm::Value* grain_val, const Reduction* reduce);
+  /// Copy the locals `expr` uses, except for `skip`, into the environment
+  /// of a task running on another thread. Fails if `expr` assigns one of
+  /// them, naming `construct` in the error.
+  bool emit_captures(const ExprAST* expr, Symbol skip, llvm::StringRef construct,
+                     llvm::SmallVectorImpl<Symbol>& captures,
+                     llvm::SmallVectorImpl<llvm::Type*>& env_tys,
+                     llvm::SmallVectorImpl<llvm::Value*>& env_vals);
+  /// Outline a task of the current definition into a function of its own.
+  /// `emit_body` emits its body and returns the value to return, which is
+  /// ignored for void tasks, or null on errors.
+  llvm::Function* emit_task(llvm::FunctionType* task_ty, const llvm::Twine& name,
+                            llvm::function_ref<llvm::Value*(llvm::Function*)> emit_body);
+  llvm::Value* emit_float_for_expr(const ForExprAST* forexpr, llvm::Value* init_val,
+                                   llvm::Value* stop_val, llvm::Value* step_val,
+                                   const Reduction* reduce);
+  llvm::Value* emit_reduce_expr(const ReduceExprAST* reduce);
+  /// Whether the reduction may run in parallel, which takes combining its
+  /// values in any order and a body that assigns no outer variables.
+  bool can_run_in_parallel(const Reduction& reduce);
+  /// Combine two values of the reduction.
+  llvm::Value* emit_combine(const Reduction& reduce, llvm::Value* lhs, llvm::Value* rhs);
+  llvm::Value* emit_index_expr(const IndexExprAST* index);
+  llvm::Value* emit_store_expr(const StoreExprAST* store);
+  llvm::Value* emit_len_expr(const LenExprAST* len);
+  llvm::Value* emit_array_expr(const ArrayExprAST* array);
+  llvm::Value* emit_array_var(Symbol name);
+  llvm::Value* emit_let_expr(const LetExprAST* let, bool tail);
+  llvm::Value* emit_assign_expr(const AssignExprAST* assign);
+  /// Emit an array index as an integer.
+  llvm::Value* emit_index(const ExprAST* expr);
+  /// Emit a number known to hold an integer as an i64, redoing the
+  /// arithmetic that computed it with integers; `bound` receives a bound on
+  /// its magnitude. Returns null if the number is not known to be integral.
+  llvm::Value* emit_int(llvm::Value* val, double& bound);
+  /// Emit the address of an array element, trapping if it is out of bounds.
+  llvm::Value* emit_element_ptr(Symbol array, const ExprAST* index);
 
   /// Helper for error handling.
   llvm::Value* log_err(llvm::StringRef msg);
@@ -0,0 +1,464 @@
+#include "evaluator.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/MathExtras.h"
+#include <cmath>
+
+using namespace llvm;
+
+namespace kscope {
+
+namespace {
+
+/// Apply a binary operator like the emitter does. Unordered operands compare
+/// as less, like `fcmp ult`.
+std::optional<double> apply(char op, double lhs, double rhs) {
+  switch (op) {
+  case '+':
+    return lhs + rhs;
+  case '-':
+    return lhs - rhs;
+  case '*':
+    return lhs * rhs;
+  case '<':
+    return !(lhs >= rhs) ? 1.0 : 0.0;
+  default:
+    return std::nullopt;
+  }
+}
+
+/// Whether an `if` takes its `then` branch, on values that are neither zero
+/// nor NaN, like `fcmp one`.
+bool is_true(double val) {
+  return val != 0.0 && !std::isnan(val);
+}
+
+/// Whether the expression assigns a variable of the name, in any scope.
+bool assigns(const ExprAST* expr, Symbol name) {
+  if (auto* assign = dyn_cast<AssignExprAST>(expr)) {
+    if (assign->var_symbol() == name) {
+      return true;
+    }
+  }
+  bool found = false;
+  for_each_child(expr, [&](const ExprAST* child) { found = found || assigns(child, name); });
+  return found;
+}
+
+} // namespace
+
+void Evaluator::define(const FunctionAST* def) {
+  defs_[def->proto()->symbol()] = def;
+  // Specializations are copies of the definitions they were made from.
+  clear_specializations();
+}
+
+void Evaluator::forget(Symbol name) {
+  defs_.erase(name);
+  clear_specializations();
+}
+
+const ExprAST* Evaluator::fold(const ExprAST* expr, bool specialize) {
+  if (!enabled()) {
+    return expr;
+  }
+  fuel_ = fuel_limit_;
+  top_level_ = true;
+  if (auto val = eval(expr)) {
+    return ast_.num(*val);
+  }
+
+  // Evaluating the expression as a whole also covers variables it assigns,
+  // which folding leaves alone.
+  specialize_ = specialize;
+  specs_left_ = MAX_SPECIALIZATIONS;
+  return fold_expr(expr);
+}
+
+std::vector<const FunctionAST*> Evaluator::specializations(const ExprAST* expr) const {
+  std::vector<const FunctionAST*> specs;
+  if (spec_defs_.empty()) {
+    return specs;
+  }
+  SmallPtrSet<const ExprAST*, 32> visited;
+  SmallPtrSet<const FunctionAST*, 8> found;
+  std::vector<const ExprAST*> worklist{expr};
+  while (!worklist.empty()) {
+    auto* cur = worklist.back();
+    worklist.pop_back();
+    if (!visited.insert(cur).second) {
+      continue;
+    }
+    if (auto* call = dyn_cast<CallExprAST>(cur)) {
+      auto* spec = spec_defs_.lookup(call->callee_symbol());
+      if (spec && found.insert(spec).second) {
+        specs.push_back(spec);
+        worklist.push_back(spec->body());
+      }
+    }
+    for_each_child(cur, [&](const ExprAST* child) { worklist.push_back(child); });
+  }
+  return specs;
+}
+
+std::optional<double> Evaluator::eval(const ExprAST* expr) {
+  if (!burn()) {
+    return std::nullopt;
+  }
+  if (auto* num = dyn_cast<NumExprAST>(expr)) {
+    return num->value();
+  } else if (auto* var = dyn_cast<VarExprAST>(expr)) {
+    if (auto* binding = lookup_binding(var->symbol())) {
+      return binding->val;
+    }
+  } else if (auto* bin = dyn_cast<BinExprAST>(expr)) {
+    return eval_bin(bin);
+  } else if (auto* par = dyn_cast<ParExprAST>(expr)) {
+    // At the top level, operands sharing a variable may still be an error.
+    if (!top_level_) {
+      return eval_bin(par->bin());
+    }
+  } else if (auto* ifexpr = dyn_cast<IfExprAST>(expr)) {
+    return eval_if(ifexpr);
+  } else if (auto* call = dyn_cast<CallExprAST>(expr)) {
+    auto* def = lookup_def(call->callee_symbol(), call->num_args());
+    if (!def || def->proto()->has_array_args()) {
+      return std::nullopt;
+    }
+    SmallVector<double, 8> args;
+    for (auto* arg : call->args()) {
+      auto val = eval(arg);
+      if (!val) {
+        return std::nullopt;
+      }
+      args.push_back(*val);
+    }
+    return eval_call(def, args);
+  } else if (auto* let = dyn_cast<LetExprAST>(expr)) {
+    auto init = eval(let->init_expr());
+    if (!init) {
+      return std::nullopt;
+    }
+    bindings_.push_back({let->var_symbol(), *init, true});
+    auto res = eval(let->body_expr());
+    bindings_.pop_back();
+    return res;
+  } else if (auto* assign = dyn_cast<AssignExprAST>(expr)) {
+    auto val = eval(assign->value_expr());
+    auto* binding = val ? lookup_binding(assign->var_symbol()) : nullptr;
+    if (binding && binding->is_var) {
+      binding->val = *val;
+      return val;
+    }
+  }
+  // Loops and arrays, or an error the emitter reports.
+  return std::nullopt;
+}
+
+std::optional<double> Evaluator::eval_bin(const BinExprAST* bin) {
+  auto lhs = eval(bin->lhs());
+  if (!lhs) {
+    return std::nullopt;
+  }
+  auto rhs = eval(bin->rhs());
+  if (!rhs) {
+    return std::nullopt;
+  }
+  return apply(bin->op(), *lhs, *rhs);
+}
+
+std::optional<double> Evaluator::eval_if(const IfExprAST* ifexpr) {
+  auto cond = eval(ifexpr->cond_expr());
+  if (!cond) {
+    return std::nullopt;
+  }
+  auto* taken = is_true(*cond) ? ifexpr->then_expr() : ifexpr->else_expr();
+  auto* untaken = is_true(*cond) ? ifexpr->else_expr() : ifexpr->then_expr();
+  if (top_level_) {
+    // The untaken branch has not been checked for errors, which evaluating
+    // it does, without keeping its assignments.
+    auto saved = bindings_;
+    bool ok = eval(untaken).has_value();
+    bindings_ = std::move(saved);
+    if (!ok) {
+      return std::nullopt;
+    }
+  }
+  return eval(taken);
+}
+
+std::optional<double> Evaluator::eval_call(const FunctionAST* def, ArrayRef<double> args) {
+  if (depth_ == MAX_DEPTH) {
+    return std::nullopt;
+  }
+  auto* proto = def->proto();
+  size_t saved_frame = frame_;
+  bool saved_top_level = top_level_;
+  frame_ = bindings_.size();
+  top_level_ = false;
+  depth_++;
+  for (size_t i = 0; i < args.size(); i++) {
+    bindings_.push_back({proto->args()[i], args[i], false});
+  }
+
+  auto res = eval(def->body());
+
+  depth_--;
+  bindings_.erase(bindings_.begin() + frame_, bindings_.end());
+  frame_ = saved_frame;
+  top_level_ = saved_top_level;
+  return res;
+}
+
+Evaluator::Binding* Evaluator::lookup_binding(Symbol name) {
+  for (size_t i = bindings_.size(); i > frame_; i--) {
+    if (bindings_[i - 1].name == name) {
+      return &bindings_[i - 1];
+    }
+  }
+  return nullptr;
+}
+
+const ExprAST* Evaluator::fold_expr(const ExprAST* expr) {
+  // Out of fuel, the rest of the expression stays as it is.
+  if (!burn()) {
+    return expr;
+  }
+  if (auto* var = dyn_cast<VarExprAST>(expr)) {
+    return fold_var(var);
+  } else if (auto* bin = dyn_cast<BinExprAST>(expr)) {
+    auto* lhs = fold_expr(bin->lhs());
+    auto* rhs = fold_expr(bin->rhs());
+    auto* lhs_num = dyn_cast<NumExprAST>(lhs);
+    auto* rhs_num = dyn_cast<NumExprAST>(rhs);
+    if (lhs_num && rhs_num) {
+      if (auto val = apply(bin->op(), lhs_num->value(), rhs_num->value())) {
+        return ast_.num(*val);
+      }
+    }
+    return ast_.bin(bin->op(), lhs, rhs);
+  } else if (auto* par = dyn_cast<ParExprAST>(expr)) {
+    auto* folded = fold_expr(par->bin());
+    if (auto* bin = dyn_cast<BinExprAST>(folded)) {
+      return ast_.par(bin);
+    }
+    return folded;
+  } else if (auto* ifexpr = dyn_cast<IfExprAST>(expr)) {
+    return fold_if(ifexpr);
+  } else if (auto* call = dyn_cast<CallExprAST>(expr)) {
+    return fold_call(call);
+  } else if (auto* let = dyn_cast<LetExprAST>(expr)) {
+    return fold_let(let);
+  } else if (auto* assign = dyn_cast<AssignExprAST>(expr)) {
+    return ast_.assign(assign->var_symbol(), fold_expr(assign->value_expr()));
+  } else if (auto* forexpr = dyn_cast<ForExprAST>(expr)) {
+    return fold_for(forexpr);
+  } else if (auto* reduce = dyn_cast<ReduceExprAST>(expr)) {
+    return fold_reduce(reduce);
+  } else if (auto* index = dyn_cast<IndexExprAST>(expr)) {
+    return ast_.index(index->array_symbol(), fold_expr(index->index_expr()));
+  } else if (auto* store = dyn_cast<StoreExprAST>(expr)) {
+    auto* index = fold_expr(store->index_expr());
+    return ast_.store(store->array_symbol(), index, fold_expr(store->value_expr()));
+  } else if (auto* array = dyn_cast<ArrayExprAST>(expr)) {
+    return ast_.array(fold_expr(array->size_expr()));
+  }
+  return expr;
+}
+
+const ExprAST* Evaluator::fold_var(const VarExprAST* var) {
+  for (size_t i = known_.size(); i > known_frame_; i--) {
+    if (known_[i - 1].name == var->symbol()) {
+      if (known_[i - 1].val) {
+        return known_[i - 1].val;
+      }
+      break;
+    }
+  }
+  return var;
+}
+
+const ExprAST* Evaluator::fold_if(const IfExprAST* ifexpr) {
+  auto* cond = fold_expr(ifexpr->cond_expr());
+  auto* num = dyn_cast<NumExprAST>(cond);
+  if (!num) {
+    auto* then_expr = fold_expr(ifexpr->then_expr());
+    return ast_.if_expr(cond, then_expr, fold_expr(ifexpr->else_expr()));
+  }
+
+  bool is_then = is_true(num->value());
+  auto* taken = fold_expr(is_then ? ifexpr->then_expr() : ifexpr->else_expr());
+  if (!top_level_) {
+    return taken;
+  }
+  // At the top level, the untaken branch is only dropped once it folds to a
+  // number, which shows that it has no errors.
+  auto* untaken = fold_expr(is_then ? ifexpr->else_expr() : ifexpr->then_expr());
+  if (isa<NumExprAST>(untaken)) {
+    return taken;
+  }
+  return is_then ? ast_.if_expr(cond, taken, untaken) : ast_.if_expr(cond, untaken, taken);
+}
+
+const ExprAST* Evaluator::fold_call(const CallExprAST* call) {
+  SmallVector<const ExprAST*, 8> args;
+  bool all_nums = true;
+  for (auto* arg : call->args()) {
+    args.push_back(fold_expr(arg));
+    all_nums = all_nums && isa<NumExprAST>(args.back());
+  }
+  auto* def = lookup_def(call->callee_symbol(), args.size());
+  if (!def) {
+    return ast_.call(call->callee_symbol(), args);
+  }
+
+  if (all_nums && !def->proto()->has_array_args()) {
+    SmallVector<double, 8> vals;
+    for (auto* arg : args) {
+      vals.push_back(cast<NumExprAST>(arg)->value());
+    }
+    if (auto val = eval_call(def, vals)) {
+      return ast_.num(*val);
+    }
+  }
+
+  if (auto* spec = specialize(def, args)) {
+    SmallVector<const ExprAST*, 8> spec_args;
+    for (size_t i = 0; i < args.size(); i++) {
+      if (def->proto()->arg_types()[i] != VT_NUM || !isa<NumExprAST>(args[i])) {
+        spec_args.push_back(args[i]);
+      }
+    }
+    return ast_.call(spec->symbol(), spec_args);
+  }
+  return ast_.call(call->callee_symbol(), args);
+}
+
+const ExprAST* Evaluator::fold_let(const LetExprAST* let) {
+  auto* init = fold_expr(let->init_expr());
+  auto* num = dyn_cast<NumExprAST>(init);
+  // An assigned variable changes its value, so only others are known.
+  bool is_known = num && !assigns(let->body_expr(), let->var_symbol());
+  known_.push_back({let->var_symbol(), is_known ? num : nullptr});
+  auto* body = fold_expr(let->body_expr());
+  known_.pop_back();
+  if (num && isa<NumExprAST>(body)) {
+    return body;
+  }
+  return ast_.let(let->var_symbol(), init, body);
+}
+
+const ForExprAST* Evaluator::fold_for(const ForExprAST* forexpr) {
+  auto* init = fold_expr(forexpr->init_expr());
+  // Everything else may see the loop variable.
+  known_.push_back({forexpr->itervar_symbol(), nullptr});
+  auto* stop = fold_expr(forexpr->stop_expr());
+  auto* step = forexpr->has_step() ? fold_expr(forexpr->step_expr()) : nullptr;
+  auto* grain = forexpr->has_grain() ? fold_expr(forexpr->grain_expr()) : nullptr;
+  auto* body = fold_expr(forexpr->body_expr());
+  known_.pop_back();
+  return ast_.for_expr(forexpr->itervar_symbol(), init, stop, body, step,
+                       forexpr->is_parallel(), grain);
+}
+
+const ExprAST* Evaluator::fold_reduce(const ReduceExprAST* reduce) {
+  const ExprAST* init = nullptr;
+  if (reduce->op() == ReduceExprAST::RO_FOLD) {
+    init = fold_shadowed(reduce->init_expr(), reduce->loop()->itervar_symbol());
+  }
+  auto* loop = fold_for(reduce->loop());
+  return ast_.reduce(reduce->op(), loop, reduce->fold_symbol(), init);
+}
+
+const ExprAST* Evaluator::fold_shadowed(const ExprAST* expr, Symbol name) {
+  known_.push_back({name, nullptr});
+  auto* folded = fold_expr(expr);
+  known_.pop_back();
+  return folded;
+}
+
+const PrototypeAST* Evaluator::specialize(const FunctionAST* def, ArrayRef<const ExprAST*> args) {
+  // A copy of a `memo` function would not share its cache.
+  if (!specialize_ || def->is_memo()) {
+    return nullptr;
+  }
+  auto* proto = def->proto();
+  SpecKey key{def, {}};
+  SmallVector<Symbol, 8> spec_args;
+  SmallVector<ValueType, 8> spec_types;
+  for (size_t i = 0; i < args.size(); i++) {
+    auto* num = proto->arg_types()[i] == VT_NUM ? dyn_cast<NumExprAST>(args[i]) : nullptr;
+    if (num) {
+      key.second.push_back(DoubleToBits(num->value()));
+    } else {
+      key.second.push_back(std::nullopt);
+      spec_args.push_back(proto->args()[i]);
+      spec_types.push_back(proto->arg_types()[i]);
+    }
+  }
+  if (spec_args.size() == args.size()) {
+    return nullptr;
+  }
+  auto iter = specs_.find(key);
+  if (iter != specs_.end()) {
+    return iter->second;
+  }
+  // Recursion with changing constants would otherwise make a copy per level
+  // until the limit, so it calls the definition instead.
+  if (specs_left_ == 0 || fuel_ == 0 || is_contained(specializing_, def)) {
+    return nullptr;
+  }
+  specs_left_--;
+
+  // Specializations are compiled and dropped along with the expressions that
+  // call them, so they are named like those, which also keeps them from
+  // being tiered. Recursive calls find the prototype while the body is
+  // folded.
+  auto name = FunctionAST::ANON_NAME + "." + proto->name().str() + "." +
+              std::to_string(specs_made_++);
+  auto* spec_proto = ast_.proto(Symbol::get(name), spec_args, spec_types);
+  specs_.emplace(std::move(key), spec_proto);
+
+  size_t saved_frame = known_frame_;
+  bool saved_top_level = top_level_;
+  known_frame_ = known_.size();
+  top_level_ = false;
+  for (size_t i = 0; i < args.size(); i++) {
+    auto* num = proto->arg_types()[i] == VT_NUM ? dyn_cast<NumExprAST>(args[i]) : nullptr;
+    known_.push_back({proto->args()[i], num});
+  }
+  specializing_.push_back(def);
+  auto* body = fold_expr(def->body());
+  specializing_.pop_back();
+  known_.erase(known_.begin() + known_frame_, known_.end());
+  known_frame_ = saved_frame;
+  top_level_ = saved_top_level;
+
+  // The arguments that are fixed stay bound, for whatever was not folded.
+  for (size_t i = args.size(); i > 0; i--) {
+    auto* num = proto->arg_types()[i - 1] == VT_NUM ? dyn_cast<NumExprAST>(args[i - 1]) : nullptr;
+    if (num) {
+      body = ast_.let(proto->args()[i - 1], num, body);
+    }
+  }
+  spec_defs_[spec_proto->symbol()] = ast_.function(spec_proto, body);
+  return spec_proto;
+}
+
+const FunctionAST* Evaluator::lookup_def(Symbol name, size_t num_args) const {
+  auto* def = defs_.lookup(name);
+  if (!def || def->proto()->num_args() != num_args) {
+    return nullptr;
+  }
+  return def;
+}
+
+bool Evaluator::burn() {
+  if (fuel_ == 0) {
+    return false;
+  }
+  fuel_--;
+  return true;
+}
+
+} // namespace kscope
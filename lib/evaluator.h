@@ -0,0 +1,138 @@
+#pragma once
+
+#include "ast.h"
+#include "common.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include <map>
+#include <optional>
+
+namespace kscope {
+
+/// Partially evaluates top-level expressions on the AST before they are
+/// compiled. Calls to definitions with constant arguments are evaluated as
+/// long as they only compute with numbers, constant subexpressions are
+/// folded, and calls with some constant arguments are redirected to copies
+/// of the callee specialized on them. Work is bounded by a fuel of nodes
+/// per expression; whatever is left is compiled as usual.
+class Evaluator {
+public:
+  /// Nodes evaluated per top-level expression by default.
+  static constexpr uint64_t FUEL = 10000;
+  /// Depth of calls evaluated, which keeps the evaluator's own stack small.
+  static constexpr unsigned MAX_DEPTH = 1000;
+  /// Specializations made per top-level expression.
+  static constexpr unsigned MAX_SPECIALIZATIONS = 16;
+
+  explicit Evaluator(AstContext& ast) : ast_(ast) {}
+
+  /// Sets the fuel of each expression; zero turns evaluation off.
+  void set_fuel(uint64_t fuel) {
+    fuel_limit_ = fuel;
+  }
+
+  bool enabled() const {
+    return fuel_limit_ > 0;
+  }
+
+  /// Make the definition the one calls to its name evaluate, after it has
+  /// been compiled without errors.
+  void define(const FunctionAST* def);
+
+  /// Stop evaluating calls to the function, whose definition failed.
+  void forget(Symbol name);
+
+  /// Returns the expression with everything known folded, which is a
+  /// `NumExprAST` if its value is. Specializations are only made with
+  /// `specialize` set, and then called from the result; see
+  /// `specializations`.
+  const ExprAST* fold(const ExprAST* expr, bool specialize);
+
+  /// Returns the specializations the expression calls, directly or through
+  /// other specializations. Their prototypes have to be registered before
+  /// they are emitted, since they may call each other.
+  std::vector<const FunctionAST*> specializations(const ExprAST* expr) const;
+
+  /// Drop the specializations made so far, once the expressions calling
+  /// them have been compiled.
+  void clear_specializations() {
+    specs_.clear();
+    spec_defs_.clear();
+  }
+
+  /// Number of specializations made so far.
+  uint64_t specializations_made() const {
+    return specs_made_;
+  }
+
+private:
+  /// A variable visible to evaluated code. Arguments are fixed, `var`s can
+  /// be assigned.
+  struct Binding {
+    Symbol name;
+    double val;
+    bool is_var;
+  };
+
+  /// A variable of folded code, with its value if it is known.
+  struct Known {
+    Symbol name;
+    const NumExprAST* val;
+  };
+
+  /// A definition called with some of its numbers fixed to constants, given
+  /// by their bits.
+  using SpecKey = std::pair<const FunctionAST*, std::vector<std::optional<uint64_t>>>;
+
+  AstContext& ast_;
+  uint64_t fuel_limit_ = FUEL;
+  uint64_t fuel_ = 0;
+  unsigned depth_ = 0;
+  llvm::DenseMap<Symbol, const FunctionAST*> defs_;
+
+  std::vector<Binding> bindings_;
+  size_t frame_ = 0;  // First binding of the innermost call.
+  /// Whether the code being evaluated or folded was written at the top
+  /// level. Only definitions have been checked by the emitter, so there
+  /// untaken branches must not be dropped before they are.
+  bool top_level_ = true;
+
+  std::vector<Known> known_;
+  size_t known_frame_ = 0;
+  bool specialize_ = false;
+  unsigned specs_left_ = 0;
+  std::map<SpecKey, const PrototypeAST*> specs_;
+  llvm::DenseMap<Symbol, const FunctionAST*> spec_defs_;
+  /// Definitions whose specializations are being folded.
+  llvm::SmallVector<const FunctionAST*, 4> specializing_;
+  uint64_t specs_made_ = 0;
+
+  /// Evaluation, which fails on anything but numbers and on running out of
+  /// fuel.
+  std::optional<double> eval(const ExprAST* expr);
+  std::optional<double> eval_bin(const BinExprAST* bin);
+  std::optional<double> eval_if(const IfExprAST* ifexpr);
+  std::optional<double> eval_call(const FunctionAST* def, llvm::ArrayRef<double> args);
+  Binding* lookup_binding(Symbol name);
+
+  /// Folding, which rebuilds the expression with the values it knows.
+  const ExprAST* fold_expr(const ExprAST* expr);
+  const ExprAST* fold_var(const VarExprAST* var);
+  const ExprAST* fold_if(const IfExprAST* ifexpr);
+  const ExprAST* fold_call(const CallExprAST* call);
+  const ExprAST* fold_let(const LetExprAST* let);
+  const ForExprAST* fold_for(const ForExprAST* forexpr);
+  const ExprAST* fold_reduce(const ReduceExprAST* reduce);
+  /// Fold the expression with `name` bound to an unknown value.
+  const ExprAST* fold_shadowed(const ExprAST* expr, Symbol name);
+  /// Returns the prototype of the definition specialized on the arguments
+  /// that are numbers, or null if it should not be.
+  const PrototypeAST* specialize(const FunctionAST* def, llvm::ArrayRef<const ExprAST*> args);
+
+  /// Returns the definition a call with `num_args` arguments runs, if any.
+  const FunctionAST* lookup_def(Symbol name, size_t num_args) const;
+  /// Take one node's worth of fuel, or return false if there is none left.
+  bool burn();
+};
+
+} // namespace kscope
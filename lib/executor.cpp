@@ -1,11 +1,10 @@
 #include "executor.h"
-#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "ast.h"
+#include "timing.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
-#include "llvm/IR/LLVMContext.h"
 #include "llvm/Support/TargetSelect.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Support/raw_ostream.h"
 #include <iostream>
 
 using namespace llvm;
@@ -13,16 +12,162 @@ using namespace llvm::orc;
 
 namespace kscope {
 
-Executor::Executor(Box<LLJIT> lljit)
-    : lljit_(std::move(lljit)), dylib_(lljit_->getMainJITDylib()) {
+namespace {
+
+/// Compiler that times code generation, which otherwise disappears into
+/// the lookup triggering it.
+class TimedCompiler : public TMOwningSimpleCompiler {
+public:
+  using TMOwningSimpleCompiler::TMOwningSimpleCompiler;
+
+  Expected<CompileResult> operator()(Module& mod) override {
+    PhaseScope scope(PH_CODEGEN, mod.getName());
+    return TMOwningSimpleCompiler::operator()(mod);
+  }
+};
+
+/// Use a compiler that is timed and consults the object cache, if any.
+void set_compiler(LLJITBuilder& builder, DiskCache* cache) {
+  builder.setCompileFunctionCreator(
+      [cache](JITTargetMachineBuilder jtmb)
+          -> Expected<Box<IRCompileLayer::IRCompiler>> {
+        auto tm = jtmb.createTargetMachine();
+        if (!tm) {
+          return tm.takeError();
+        }
+        return std::make_unique<TimedCompiler>(std::move(*tm), cache);
+      });
+}
+
+/// Count the definitions in the module, leaving out the thunks of
+/// top-level expressions, which are always compiled.
+size_t count_defined_fns(const Module& mod) {
+  size_t count = 0;
+  for (auto& fn : mod) {
+    if (!fn.isDeclaration() && !fn.getName().startswith(FunctionAST::ANON_NAME)) {
+      count++;
+    }
+  }
+  return count;
+}
+
+/// Optimize the module on the calling thread. Pipelines hold per-module
+/// analysis state, so each thread keeps its own.
+void optimize_on_thread(OptLevel level, Module& mod) {
+  thread_local Box<Optimizer> opt;
+  if (!opt || opt->level() != level) {
+    opt = std::make_unique<Optimizer>(level);
+  }
+  opt->run(mod);
+}
+
+/// Compile the module to an object on the calling thread. Target machines
+/// are not thread safe, so each thread keeps its own.
+Expected<Box<MemoryBuffer>> compile_on_thread(const JITTargetMachineBuilder& jtmb,
+                                              Module& mod, ObjectCache* cache) {
+  thread_local Box<TargetMachine> tm;
+  if (!tm) {
+    auto res = JITTargetMachineBuilder(jtmb).createTargetMachine();
+    if (!res) {
+      return res.takeError();
+    }
+    tm = std::move(*res);
+  }
+  PhaseScope scope(PH_CODEGEN, mod.getName());
+  SimpleCompiler compiler(*tm, cache);
+  return compiler(mod);
+}
+
+} // namespace
+
+Executor::Executor(Box<LLJIT> lljit, Box<DiskCache> cache, Optional<OptLevel> opt_level)
+    : cache_(std::move(cache)),
+      lljit_(std::move(lljit)),
+      dylib_(lljit_->getMainJITDylib()),
+      opt_level_(opt_level) {
+  if (opt_level_) {
+    opt_ = std::make_unique<Optimizer>(*opt_level_);
+  }
+  fns_defined_ = 0;
+  fns_compiled_ = 0;
   dylib_.addGenerator(cantFail(
     DynamicLibrarySearchGenerator::GetForCurrentProcess(
       lljit_->getDataLayout().getGlobalPrefix())));
+
+  // Everything that reaches the IR transform layer is about to be compiled.
+  // In lazy mode this only happens on the first call through a stub.
+  lljit_->getIRTransformLayer().setTransform(
+      [this](ThreadSafeModule tsm, MaterializationResponsibility&) {
+        tsm.withModuleDo([this](Module& mod) {
+          fns_compiled_ += count_defined_fns(mod);
+          if (opt_) {
+            opt_->run(mod);
+          }
+        });
+        return tsm;
+      });
 }
 
-Box<Executor> Executor::create() {
-  auto lljit = cantFail(LLJITBuilder().create());
-  return std::make_unique<Executor>(std::move(lljit));
+Executor::~Executor() {
+  wait_compiles();
+}
+
+Box<Executor> Executor::create(const ExecutorOptions& opts) {
+  auto jtmb = cantFail(JITTargetMachineBuilder::detectHost());
+  // Tiered mode starts from quickly generated code.
+  bool tiered = opts.tier_threshold > 0 && !opts.lazy;
+  auto codegen_level = tiered ? CodeGenOpt::None : codegen_opt_level(opts.opt_level);
+  jtmb.setCodeGenOptLevel(codegen_level);
+
+  Box<DiskCache> cache;
+  if (!opts.cache_dir.empty()) {
+    // Everything besides the IR that influences the emitted object.
+    std::string target_key = jtmb.getTargetTriple().str() + ";" +
+                             jtmb.getCPU() + ";" +
+                             jtmb.getFeatures().getString() + ";" +
+                             std::to_string(codegen_level);
+    // The IR is hashed after optimization, so its level needs no key.
+    cache = std::make_unique<DiskCache>(opts.cache_dir, opts.cache_max_bytes, target_key);
+  }
+
+  LLJITBuilder builder;
+  builder.setJITTargetMachineBuilder(jtmb);
+  set_compiler(builder, cache.get());
+  auto lljit = cantFail(builder.create());
+  Optional<OptLevel> opt_level;
+  if (opts.optimize) {
+    opt_level = opts.opt_level;
+  }
+  auto exec = std::make_unique<Executor>(std::move(lljit), std::move(cache), opt_level);
+  if (opts.lazy) {
+    exec->init_lazy();
+  } else if (tiered) {
+    exec->tiers_ = cantFail(TierManager::create(*exec->lljit_, std::move(jtmb)));
+  } else if (opts.compile_threads > 0) {
+    exec->init_pool(opts.compile_threads, std::move(jtmb));
+  }
+  return exec;
+}
+
+void Executor::init_lazy() {
+  auto& es = lljit_->getExecutionSession();
+  auto& triple = lljit_->getTargetTriple();
+  lctm_ = cantFail(createLocalLazyCallThroughManager(triple, es, {}));
+  ism_ = createLocalIndirectStubsManagerBuilder(triple)();
+
+  // Function bodies live in the implementation dylib and are only reachable
+  // through the lazy reexports in the main dylib. Bodies resolve their own
+  // calls through the main dylib too, so compiling one function never drags
+  // in its callees.
+  impl_dylib_ = &es.createBareJITDylib("<main>.impl");
+  impl_dylib_->setLinkOrder(
+      {{&dylib_, JITDylibLookupFlags::MatchExportedSymbolsOnly}},
+      /*LinkAgainstThisJITDylibFirst=*/false);
+}
+
+void Executor::init_pool(unsigned threads, JITTargetMachineBuilder jtmb) {
+  jtmb_ = std::make_unique<JITTargetMachineBuilder>(std::move(jtmb));
+  pool_ = std::make_unique<ThreadPool>(hardware_concurrency(threads));
 }
 
 void Executor::init_native_target() {
@@ -31,22 +176,140 @@ void Executor::init_native_target() {
   InitializeNativeTargetAsmPrinter();
 }
 
-ResourceTrackerSP Executor::add_module(Box<Module> mod, ResourceTrackerSP tracker) {
+ResourceTrackerSP Executor::add_module(ThreadSafeModule tsm, ResourceTrackerSP tracker) {
+  PhaseScope scope(PH_ADD_MODULE);
   if (!tracker) {
     tracker = dylib_.createResourceTracker();
   }
-  auto ctx = std::make_unique<LLVMContext>();
-  ThreadSafeModule tsm(std::move(mod), std::move(ctx));
+  auto* mod = tsm.getModuleUnlocked();
+  fns_defined_ += count_defined_fns(*mod);
+
+  if (impl_dylib_) {
+    SymbolAliasMap aliases;
+    SymbolMap stubs;
+    for (auto& fn : *mod) {
+      if (fn.isDeclaration()) {
+        continue;
+      }
+      auto name = lljit_->mangleAndIntern(fn.getName());
+      auto flags = JITSymbolFlags::fromGlobalValue(fn);
+      // A redefined function keeps the stub code compiled earlier calls,
+      // which goes through the lazy call-through again to reach the new body.
+      if (auto stub = ism_->findStub(*name, /*ExportedStubsOnly=*/false)) {
+        auto trampoline = cantFail(lctm_->getCallThroughTrampoline(
+            *impl_dylib_, name, [this, name](JITTargetAddress addr) {
+              return ism_->updatePointer(*name, addr);
+            }));
+        cantFail(ism_->updatePointer(*name, trampoline));
+        stubs[name] = JITEvaluatedSymbol(stub.getAddress(), flags);
+      } else {
+        aliases[name] = SymbolAliasMapEntry(name, flags);
+      }
+    }
+    // Variables, like the caches of `memo` functions, are reexported as they
+    // are.
+    SymbolAliasMap vars;
+    for (auto& var : mod->globals()) {
+      if (!var.isDeclaration() && !var.hasLocalLinkage()) {
+        auto name = lljit_->mangleAndIntern(var.getName());
+        vars[name] = SymbolAliasMapEntry(name, JITSymbolFlags::fromGlobalValue(var));
+      }
+    }
+    auto impl_tracker = impl_dylib_->createResourceTracker();
+    cantFail(lljit_->addIRModule(impl_tracker, std::move(tsm)));
+    if (!aliases.empty()) {
+      cantFail(dylib_.define(
+          lazyReexports(*lctm_, *ism_, *impl_dylib_, std::move(aliases)), tracker));
+    }
+    if (!stubs.empty()) {
+      cantFail(dylib_.define(absoluteSymbols(std::move(stubs)), tracker));
+    }
+    if (!vars.empty()) {
+      cantFail(dylib_.define(reexports(*impl_dylib_, std::move(vars)), tracker));
+    }
+    impl_trackers_[tracker.get()] = impl_tracker;
+    return tracker;
+  }
+
+  if (tiers_) {
+    cantFail(tiers_->add_module(std::move(tsm), tracker));
+    return tracker;
+  }
+
+  if (pool_) {
+    // Optimize and generate machine code in the background; only the
+    // resulting object goes through the JIT. Every module owns its context,
+    // so modules can be compiled concurrently.
+    auto shared_tsm = std::make_shared<ThreadSafeModule>(std::move(tsm));
+    pool_->async([this, tracker, shared_tsm] {
+      shared_tsm->withModuleDo([&](Module& mod) {
+        fns_compiled_ += count_defined_fns(mod);
+        if (opt_level_) {
+          optimize_on_thread(*opt_level_, mod);
+        }
+        auto obj = compile_on_thread(*jtmb_, mod, cache_.get());
+        if (!obj) {
+          logAllUnhandledErrors(obj.takeError(), errs(), "[error] ");
+          return;
+        }
+        if (auto err = lljit_->addObjectFile(tracker, std::move(*obj))) {
+          logAllUnhandledErrors(std::move(err), errs(), "[error] ");
+        }
+      });
+    });
+    return tracker;
+  }
+
   cantFail(lljit_->addIRModule(tracker, std::move(tsm)));
   return tracker;
 }
 
 void Executor::remove_module(ResourceTrackerSP tracker) {
+  wait_compiles();
+  auto iter = impl_trackers_.find(tracker.get());
+  if (iter != impl_trackers_.end()) {
+    cantFail(iter->second->remove());
+    impl_trackers_.erase(iter);
+  }
+  if (tiers_) {
+    tiers_->remove_module(*tracker);
+  }
   cantFail(tracker->remove());
 }
 
 Expected<ExecutorAddr> Executor::lookup(StringRef name) {
+  PhaseScope scope(PH_LOOKUP, name);
+  wait_compiles();
   return lljit_->lookup(name);
 }
 
+Expected<std::vector<ExecutorAddr>> Executor::lookup(ArrayRef<std::string> names) {
+  PhaseScope scope(PH_LOOKUP, names.empty() ? "" : names.front());
+  wait_compiles();
+  auto& es = lljit_->getExecutionSession();
+  std::vector<SymbolStringPtr> symbols;
+  SymbolLookupSet lookup_set;
+  for (auto& name : names) {
+    symbols.push_back(lljit_->mangleAndIntern(name));
+    lookup_set.add(symbols.back());
+  }
+  auto found = es.lookup(makeJITDylibSearchOrder(&dylib_, JITDylibLookupFlags::MatchAllSymbols),
+                         std::move(lookup_set));
+  if (!found) {
+    return found.takeError();
+  }
+  std::vector<ExecutorAddr> addrs;
+  addrs.reserve(symbols.size());
+  for (auto& symbol : symbols) {
+    addrs.push_back(ExecutorAddr((*found)[symbol].getAddress()));
+  }
+  return addrs;
+}
+
+void Executor::wait_compiles() {
+  if (pool_) {
+    pool_->wait();
+  }
+}
+
 } // namespace kscope
@@ -1,26 +1,66 @@
 #pragma once
 
+#include "cache.h"
 #include "common.h"
+#include "optimizer.h"
+#include "tiering.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
 #include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/Error.h"
+#include "llvm/Support/ThreadPool.h"
+#include <atomic>
 
 namespace kscope {
 
+/// Options for constructing an executor.
+struct ExecutorOptions {
+  /// Directory of the persistent object cache, disabled if empty.
+  std::string cache_dir;
+  /// Size cap of the object cache directory in bytes.
+  uint64_t cache_max_bytes = 256 << 20;
+  /// Compile each function on its first call instead of when its module is
+  /// first looked up.
+  bool lazy = false;
+  /// Number of threads compiling added modules in the background. Zero
+  /// compiles a module on the thread that first looks up one of its symbols.
+  /// Ignored in lazy and tiered mode.
+  unsigned compile_threads = 0;
+  /// Run functions at -O0 first and recompile them at -O3 in the background
+  /// once they have been called this many times, see `TierManager`. Zero
+  /// disables tiering. Ignored in lazy mode.
+  uint64_t tier_threshold = 0;
+  /// Optimization level used for code generation, and for the IR as well if
+  /// `optimize` is set.
+  OptLevel opt_level = OL_O2;
+  /// Run the optimizer on modules as part of compilation, rather than
+  /// expecting them to be optimized already.
+  bool optimize = false;
+};
+
 class Executor {
 public:
   static void init_native_target();
-  static Box<Executor> create();
+  static Box<Executor> create(const ExecutorOptions& opts = ExecutorOptions());
 
-  Executor(Box<llvm::orc::LLJIT> lljit);
+  /// Modules are optimized at `opt_level` before compilation, if given.
+  Executor(Box<llvm::orc::LLJIT> lljit, Box<DiskCache> cache = nullptr,
+           llvm::Optional<OptLevel> opt_level = llvm::None);
+  ~Executor();
 
-  llvm::orc::ResourceTrackerSP add_module(Box<llvm::Module> mod,
+  llvm::orc::ResourceTrackerSP add_module(llvm::orc::ThreadSafeModule tsm,
                                           llvm::orc::ResourceTrackerSP tracker = nullptr);
   void remove_module(llvm::orc::ResourceTrackerSP tracker);
   llvm::Expected<llvm::orc::ExecutorAddr> lookup(llvm::StringRef name);
+  /// Look up several symbols at once, which materializes their modules in a
+  /// single step. Addresses are returned in the order of `names`.
+  llvm::Expected<std::vector<llvm::orc::ExecutorAddr>> lookup(
+      llvm::ArrayRef<std::string> names);
 
   const llvm::DataLayout& data_layout() const {
     return lljit_->getDataLayout();
@@ -30,9 +70,60 @@ public:
     return dylib_;
   }
 
+  /// Returns the object cache, or null if caching is disabled.
+  const DiskCache* cache() const {
+    return cache_.get();
+  }
+
+  bool is_lazy() const {
+    return impl_dylib_ != nullptr;
+  }
+
+  bool is_concurrent() const {
+    return pool_ != nullptr;
+  }
+
+  /// Returns the tier manager, or null if tiering is disabled.
+  const TierManager* tiers() const {
+    return tiers_.get();
+  }
+
+  /// Number of function bodies handed to the JIT.
+  uint64_t functions_defined() const {
+    return fns_defined_;
+  }
+
+  /// Number of function bodies actually compiled to machine code.
+  uint64_t functions_compiled() const {
+    return fns_compiled_;
+  }
+
 private:
+  /// Route definitions through lazy reexports, see `ExecutorOptions::lazy`.
+  void init_lazy();
+  /// Compile modules on a thread pool, see `ExecutorOptions::compile_threads`.
+  void init_pool(unsigned threads, llvm::orc::JITTargetMachineBuilder jtmb);
+  /// Block until all background compiles have been added to the JIT.
+  void wait_compiles();
+
+  // Must outlive the JIT.
+  Box<DiskCache> cache_;
+  Box<llvm::orc::LazyCallThroughManager> lctm_;  // Lazy mode only.
+  Box<llvm::orc::IndirectStubsManager> ism_;  // Lazy mode only.
+
   Box<llvm::orc::LLJIT> lljit_;
   llvm::orc::JITDylib& dylib_;
+  llvm::orc::JITDylib* impl_dylib_ = nullptr;  // Lazy mode only.
+  llvm::DenseMap<llvm::orc::ResourceTracker*, llvm::orc::ResourceTrackerSP> impl_trackers_;
+
+  llvm::Optional<OptLevel> opt_level_;
+  Box<Optimizer> opt_;  // Compiles on the JIT's own thread only.
+  Box<llvm::orc::JITTargetMachineBuilder> jtmb_;  // Concurrent mode only.
+  Box<llvm::ThreadPool> pool_;  // Concurrent mode only.
+  Box<TierManager> tiers_;  // Tiered mode only.
+
+  std::atomic<uint64_t> fns_defined_;
+  std::atomic<uint64_t> fns_compiled_;
 };
 
 } // namespace kscope
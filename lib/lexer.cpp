@@ -1,133 +1,174 @@
 #include "lexer.h"
-#include <cctype>
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include <cstdlib>
 
-namespace kscope {
+using namespace llvm;
 
-Lexer::Lexer(std::istream& src)
-    : src_(src) {
-  last_char_ = ' ';
-}
-
-int Lexer::scan_token() {
-  if (is_eof()) {
-    return TK_EOF;
-  }
+namespace kscope {
 
-  // Skip whitespace (space, tab, etc).
-  while (!is_eof() && std::isblank(last_char_)) {
-    last_char_ = next_char();
-  }
+namespace {
 
-  // Operators.
-  if (last_char_ == '.') {
-    // Look for .. (range, dot-dot).
-    if (peek_char() == '.') {
-      next_char(); // Consume '..'.
-      last_char_ = next_char();
-      return TK_DOT2;
+/// Returns the keyword token of the identifier, or TK_IDENT.
+int keyword_kind(StringRef ident) {
+  switch (ident.size()) {
+  case 2:
+    if (ident == "if") {
+      return TK_IF;
+    } else if (ident == "in") {
+      return TK_IN;
     }
-  }
-
-  // Identifier: [a-zA-Z][a-zA-Z0-9_]*
-  if (std::isalpha(last_char_)) {
-    ident_str_ = "";
-    do {
-      ident_str_ += last_char_;
-      last_char_ = next_char();
-    } while (!is_eof() && (std::isalnum(last_char_) || last_char_ == '_'));
-    if (ident_str_ == "def") {
+    break;
+  case 3:
+    if (ident == "def") {
       return TK_DEF;
-    } else if (ident_str_ == "extern") {
-      return TK_EXTERN;
-    } else if (ident_str_ == "if") {
-      return TK_IF;
-    } else if (ident_str_ == "else") {
-      return TK_ELSE;
-    } else if (ident_str_ == "for") {
+    } else if (ident == "for") {
       return TK_FOR;
-    } else if (ident_str_ == "in") {
-      return TK_IN;
-    } else {
-      return TK_IDENT;
+    } else if (ident == "len") {
+      return TK_LEN;
+    } else if (ident == "var") {
+      return TK_VAR;
+    } else if (ident == "par") {
+      return TK_PAR;
     }
-  }
-
-  // Number: [0-9]+ ('.' [0-9]+)?
-  if (std::isdigit(last_char_)) {
-    std::string num_str;
-    do {
-      num_str += last_char_;
-      last_char_ = next_char();
-    } while (!is_eof() && std::isdigit(last_char_));
-    // Optional fraction part.
-    if (last_char_ == '.' && std::isdigit(peek_char())) {
-       do {
-         num_str += last_char_;
-         last_char_ = next_char();
-       } while (!is_eof() && std::isdigit(last_char_));
+    break;
+  case 4:
+    if (ident == "else") {
+      return TK_ELSE;
+    } else if (ident == "pfor") {
+      return TK_PFOR;
     }
-    num_val_ = std::stod(num_str);
-    return TK_NUM;
-  }
-
-  // Comment: goes until end of line.
-  if (last_char_ == '#') {
-    do {
-      last_char_ = next_char();
-    } while (!is_eof() && last_char_ != '\n' && last_char_ != '\r');
-    if (!is_eof()) {
-      return scan_token();
+    break;
+  case 5:
+    if (ident == "array") {
+      return TK_ARRAY;
     }
+    break;
+  case 6:
+    if (ident == "extern") {
+      return TK_EXTERN;
+    }
+    break;
   }
+  return TK_IDENT;
+}
 
-  // Check for end-of-file.
-  if (is_eof()) {
-    return TK_EOF;
-  }
-
-  // Otherwise, return ascii char as-is.
-  int prev_char = last_char_;
-  last_char_ = next_char();
-  return prev_char;
+bool is_space(char c) {
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
 }
 
-bool Lexer::is_eof() {
-  if (lookahead_.has_value()) {
-    return false;
-  } else {
-    return src_.eof();
+} // namespace
+
+Lexer::Lexer(StringRef src)
+    : src_(src) {
+  lines_ = 0;
+  tokenize();
+  // A last line without a newline still counts.
+  if (!src_.empty() && src_.back() != '\n') {
+    lines_++;
   }
 }
 
-int Lexer::next_char() {
-  if (lookahead_.has_value()) {
-    int taken = lookahead_.value();
-    lookahead_.reset();
-    return taken;
-  } else {
-    return src_.get();
+void Lexer::tokenize() {
+  // Roughly one token per four bytes of typical source.
+  tokens_.reserve(src_.size() / 4 + 1);
+  const char* begin = src_.begin();
+  const char* cur = begin;
+  const char* end = src_.end();
+
+  while (true) {
+    // Skip whitespace (space, tab, newline, etc).
+    while (cur != end && is_space(*cur)) {
+      lines_ += *cur == '\n';
+      cur++;
+    }
+    if (cur == end) {
+      break;
+    }
+
+    const char* start = cur;
+    Token tok;
+    if (isAlpha(*cur)) {
+      // Identifier: [a-zA-Z][a-zA-Z0-9_]*
+      do {
+        cur++;
+      } while (cur != end && (isAlnum(*cur) || *cur == '_'));
+      StringRef ident(start, cur - start);
+      tok.kind = keyword_kind(ident);
+      if (tok.kind == TK_IDENT) {
+        tok.ident = Symbol::get(ident);
+      }
+    } else if (isDigit(*cur)) {
+      // Number: [0-9]+ ('.' [0-9]+)?
+      do {
+        cur++;
+      } while (cur != end && isDigit(*cur));
+      if (cur + 1 < end && *cur == '.' && isDigit(cur[1])) {
+        do {
+          cur++;
+        } while (cur != end && isDigit(*cur));
+      }
+      tok.kind = TK_NUM;
+      tok.num_index = numbers_.size();
+      numbers_.push_back(parse_number(StringRef(start, cur - start)));
+    } else if (*cur == '#') {
+      // Comment: goes until end of line.
+      while (cur != end && *cur != '\n' && *cur != '\r') {
+        cur++;
+      }
+      continue;
+    } else if (*cur == '.' && cur + 1 < end && cur[1] == '.') {
+      cur += 2;
+      tok.kind = TK_DOT2;
+    } else {
+      // Otherwise, return ascii char as-is.
+      tok.kind = (unsigned char) *cur;
+      cur++;
+    }
+    tok.offset = start - begin;
+    tok.length = cur - start;
+    tokens_.push_back(tok);
   }
+
+  Token eof;
+  eof.kind = TK_EOF;
+  eof.offset = src_.size();
+  eof.length = 0;
+  tokens_.push_back(eof);
 }
 
-int Lexer::peek_char() {
-  if (lookahead_.has_value()) {
-    return lookahead_.value();
+double Lexer::parse_number(StringRef text) {
+  // Clinger's fast path: with at most 15 significant digits, the digits form
+  // an exact double, as does any power of ten up to 1e22, so a single
+  // division is correctly rounded.
+  static const double POW10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+  };
+  uint64_t digits = 0;
+  int num_digits = 0;
+  int frac_digits = 0;
+  bool in_frac = false;
+  for (char c : text) {
+    if (c == '.') {
+      in_frac = true;
+      continue;
+    }
+    if (digits == 0 && c == '0') {
+      frac_digits += in_frac;  // Leading zeros are not significant.
+      continue;
+    }
+    digits = digits * 10 + (c - '0');
+    num_digits++;
+    frac_digits += in_frac;
   }
-  char peek = src_.get();
-  if (!src_.eof()) {
-    lookahead_ = peek;
-    return peek;
-  } else {
-    return TK_EOF;
+  if (num_digits <= 15 && frac_digits <= 22) {
+    return double(digits) / POW10[frac_digits];
   }
-}
-
-const std::string& Lexer::get_ident_str() const {
-  return ident_str_;
-}
 
-double Lexer::get_num_value() const {
-  return num_val_;
+  // Slow path for long literals.
+  SmallString<32> buf(text);
+  return std::strtod(buf.c_str(), nullptr);
 }
 
 } // namespace kscope
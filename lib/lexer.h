@@ -1,14 +1,13 @@
 #pragma once
 
 #include "common.h"
-#include <iostream>
-#include <optional>
+#include "symbol.h"
 
 namespace kscope {
 
 /// Represents the known lexical tokens in language. Lexer returns [0-255] if
 /// it is not one of these specified tokens.
-enum Token {
+enum TokenKind {
   TK_EOF = -1,
 
   // Commands
@@ -21,35 +20,63 @@ enum Token {
   TK_FOR = -23,
   TK_IN = -24,
   TK_DOT2 = -25,
+  TK_ARRAY = -26,
+  TK_LEN = -27,
+  TK_VAR = -28,
+  TK_PFOR = -29,
+  TK_PAR = -30,
 
   // Primary
   TK_IDENT = -51,
   TK_NUM = -52,
 };
 
+/// A scanned token. The lexeme is the span [offset, offset + length) of the
+/// source.
+struct Token {
+  int kind;
+  uint32_t offset;
+  uint32_t length;
+  Symbol ident;            // TK_IDENT
+  uint32_t num_index = 0;  // TK_NUM, see `Lexer::num_value`
+};
+
+/// Splits a source buffer into tokens up front. The buffer is not copied and
+/// has to outlive the lexer.
 class Lexer {
 public:
-  Lexer(std::istream& src);
+  Lexer(llvm::StringRef src);
 
-  /// Returns next token from standard input.
-  int scan_token();
-
-  /// Returns lexeme if token is identifier.
-  const std::string& get_ident_str() const;
+  /// Returns all tokens of the source, ending with a TK_EOF token.
+  const std::vector<Token>& tokens() const {
+    return tokens_;
+  }
 
   /// Returns numeric value if token is number.
-  double get_num_value() const;
+  double num_value(const Token& tok) const {
+    return numbers_[tok.num_index];
+  }
+
+  /// Returns the lexeme of the token.
+  llvm::StringRef text(const Token& tok) const {
+    return src_.substr(tok.offset, tok.length);
+  }
+
+  /// Returns the number of lines in the source.
+  int lines() const {
+    return lines_;
+  }
+
+  /// Parse a numeric literal of the form [0-9]+ ('.' [0-9]+)?.
+  static double parse_number(llvm::StringRef text);
 
 private:
-  std::istream& src_;
-  int last_char_;
-  std::string ident_str_;
-  double num_val_;
-  std::optional<int> lookahead_;
-
-  bool is_eof();
-  int next_char();
-  int peek_char();
+  llvm::StringRef src_;
+  std::vector<Token> tokens_;
+  std::vector<double> numbers_;
+  int lines_;
+
+  void tokenize();
 };
 
 } // namespace kscope
@@ -0,0 +1,119 @@
+#include "optimizer.h"
+#include "timing.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO/Internalize.h"
+#include "llvm/Transforms/Scalar/InductiveRangeCheckElimination.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+
+using namespace llvm;
+
+namespace kscope {
+
+namespace {
+
+OptimizationLevel pipeline_level(OptLevel level) {
+  switch (level) {
+  case OL_O0: return OptimizationLevel::O0;
+  case OL_O1: return OptimizationLevel::O1;
+  case OL_O2: return OptimizationLevel::O2;
+  case OL_O3: return OptimizationLevel::O3;
+  case OL_OS: return OptimizationLevel::Os;
+  }
+  return OptimizationLevel::O2;
+}
+
+} // namespace
+
+bool parse_opt_level(StringRef str, OptLevel& level) {
+  if (str == "0") {
+    level = OL_O0;
+  } else if (str == "1") {
+    level = OL_O1;
+  } else if (str == "2") {
+    level = OL_O2;
+  } else if (str == "3") {
+    level = OL_O3;
+  } else if (str == "s") {
+    level = OL_OS;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+CodeGenOpt::Level codegen_opt_level(OptLevel level) {
+  switch (level) {
+  case OL_O0: return CodeGenOpt::None;
+  case OL_O1: return CodeGenOpt::Less;
+  case OL_O2: return CodeGenOpt::Default;
+  case OL_O3: return CodeGenOpt::Aggressive;
+  case OL_OS: return CodeGenOpt::Default;
+  }
+  return CodeGenOpt::Default;
+}
+
+void internalize_except(Module& mod, ArrayRef<std::string> entries) {
+  internalizeModule(mod, [entries](const GlobalValue& val) {
+    return is_contained(entries, val.getName());
+  });
+}
+
+Optimizer::Optimizer(OptLevel level) : level_(level) {
+  // Without target information the vectorizers see no vector registers.
+  if (auto jtmb = orc::JITTargetMachineBuilder::detectHost()) {
+    if (auto tm = jtmb->createTargetMachine()) {
+      tm_ = std::move(*tm);
+    } else {
+      consumeError(tm.takeError());
+    }
+  } else {
+    consumeError(jtmb.takeError());
+  }
+
+  PipelineTuningOptions tuning;
+  tuning.LoopUnrolling = level_ != OL_O0 && level_ != OL_OS;
+  tuning.LoopVectorization = level_ == OL_O2 || level_ == OL_O3;
+  tuning.SLPVectorization = level_ == OL_O2 || level_ == OL_O3;
+  tuning.LoopInterleaving = tuning.LoopVectorization;
+  pb_ = std::make_unique<PassBuilder>(tm_.get(), tuning);
+
+  pb_->registerModuleAnalyses(mam_);
+  pb_->registerCGSCCAnalyses(cgam_);
+  pb_->registerFunctionAnalyses(fam_);
+  pb_->registerLoopAnalyses(lam_);
+  pb_->crossRegisterProxies(lam_, fam_, cgam_, mam_);
+
+  // Array bounds checks in counted loops are split off into pre- and
+  // post-loops, leaving a main loop without checks that can be vectorized.
+  pb_->registerScalarOptimizerLateEPCallback(
+      [](FunctionPassManager& fpm, OptimizationLevel) { fpm.addPass(IRCEPass()); });
+
+  if (level_ == OL_O0) {
+    mpm_ = pb_->buildO0DefaultPipeline(OptimizationLevel::O0);
+    // Keep `var` bindings in registers, the other levels run SROA for that.
+    mpm_.addPass(createModuleToFunctionPassAdaptor(PromotePass()));
+  } else {
+    // Includes the inliner, LICM, loop unrolling and the loop and SLP
+    // vectorizers at the levels that enable them.
+    mpm_ = pb_->buildPerModuleDefaultPipeline(pipeline_level(level_));
+  }
+}
+
+void Optimizer::run(Module& mod) {
+  PhaseScope scope(PH_OPTIMIZE, mod.getName());
+  if (tm_) {
+    if (mod.getTargetTriple().empty()) {
+      mod.setTargetTriple(tm_->getTargetTriple().str());
+    }
+  }
+  mpm_.run(mod, mam_);
+
+  // Cached analyses refer to this module's IR, so drop them before reuse.
+  lam_.clear();
+  fam_.clear();
+  cgam_.clear();
+  mam_.clear();
+}
+
+} // namespace kscope
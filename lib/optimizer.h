@@ -0,0 +1,55 @@
+#pragma once
+
+#include "common.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Target/TargetMachine.h"
+
+namespace kscope {
+
+/// Optimization levels, mirroring the usual -O flags.
+enum OptLevel {
+  OL_O0,
+  OL_O1,
+  OL_O2,
+  OL_O3,
+  OL_OS,
+};
+
+/// Parse the suffix of an -O flag ("0".."3" or "s").
+bool parse_opt_level(llvm::StringRef str, OptLevel& level);
+
+/// Returns the code generation level matching an optimization level.
+llvm::CodeGenOpt::Level codegen_opt_level(OptLevel level);
+
+/// Give every definition but `entries` internal linkage, so that
+/// interprocedural passes see all of their callers and drop unused ones.
+void internalize_except(llvm::Module& mod, llvm::ArrayRef<std::string> entries);
+
+/// Module optimization pipeline built on the new pass manager. The pipeline
+/// is built once and reused for every module it runs on, so an optimizer must
+/// not be shared between threads.
+class Optimizer {
+public:
+  Optimizer(OptLevel level);
+
+  OptLevel level() const {
+    return level_;
+  }
+
+  /// Optimize the given module.
+  void run(llvm::Module& mod);
+
+private:
+  OptLevel level_;
+  Box<llvm::TargetMachine> tm_;  // Used for target cost models.
+  Box<llvm::PassBuilder> pb_;
+  llvm::LoopAnalysisManager lam_;
+  llvm::FunctionAnalysisManager fam_;
+  llvm::CGSCCAnalysisManager cgam_;
+  llvm::ModuleAnalysisManager mam_;
+  llvm::ModulePassManager mpm_;
+};
+
+} // namespace kscope
@@ -0,0 +1,162 @@
+// ===------------------------===
+// kscope buffered output runtime
+// ===------------------------===
+
+#include "output.h"
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+namespace {
+
+/// Size of the output buffer of each thread.
+constexpr size_t BUFFER_SIZE = 64 * 1024;
+
+/// Longest value `printd` writes, `-DBL_MAX` with six decimals and a newline.
+constexpr size_t MAX_VALUE_SIZE = 320;
+
+/// The output a thread has written and not flushed yet. The lock is only
+/// contended when another thread flushes all buffers.
+struct Buffer {
+  std::mutex mutex;
+  size_t size = 0;
+  char data[BUFFER_SIZE];
+
+  /// Write out the buffered output, with `mutex` held.
+  void flush() {
+    if (size > 0) {
+      fwrite(data, 1, size, stderr);
+      size = 0;
+    }
+  }
+};
+
+/// The buffers of all threads, which are flushed together by `flushd` and
+/// at exit. Threads of the parallel runtime never exit, so their buffers
+/// stay around; other threads flush theirs when they exit.
+class Output {
+public:
+  /// Returns the process-wide output, setting it up on first use. It is
+  /// never destroyed, so that threads exiting late still find it.
+  static Output& get() {
+    static Output* output = new Output();
+    return *output;
+  }
+
+  /// Whether `printd` writes the raw bytes of its values instead of text.
+  bool binary() const {
+    return binary_;
+  }
+
+  void add(Buffer* buffer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    buffers_.push_back(buffer);
+  }
+
+  void remove(Buffer* buffer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    buffers_.erase(std::find(buffers_.begin(), buffers_.end(), buffer));
+  }
+
+  void flush_all() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto* buffer : buffers_) {
+      std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+      buffer->flush();
+    }
+  }
+
+private:
+  std::mutex mutex_;
+  std::vector<Buffer*> buffers_;
+  bool binary_;
+
+  /// `KSCOPE_OUTPUT=binary` selects the raw output.
+  Output() {
+    const char* env = std::getenv("KSCOPE_OUTPUT");
+    binary_ = env && std::strcmp(env, "binary") == 0;
+    std::atexit([] { Output::get().flush_all(); });
+  }
+};
+
+/// Owns the buffer of the current thread and flushes it when the thread
+/// exits.
+class ThreadBuffer {
+public:
+  ThreadBuffer() : buffer_(std::make_unique<Buffer>()) {
+    Output::get().add(buffer_.get());
+  }
+
+  ~ThreadBuffer() {
+    Output::get().remove(buffer_.get());
+    buffer_->flush();
+  }
+
+  Buffer& get() {
+    return *buffer_;
+  }
+
+private:
+  std::unique_ptr<Buffer> buffer_;
+};
+
+thread_local ThreadBuffer thread_buffer;
+
+/// Reserve room for `size` bytes in the buffer of the current thread, which
+/// has to be locked, flushing it if needed.
+char* reserve(Buffer& buffer, size_t size) {
+  if (buffer.size + size > BUFFER_SIZE) {
+    buffer.flush();
+  }
+  return buffer.data + buffer.size;
+}
+
+} // namespace
+
+/// putchard - putchar a double and return 0.
+extern "C" DLLEXPORT double putchard(double x) {
+  auto& buffer = thread_buffer.get();
+  std::lock_guard<std::mutex> lock(buffer.mutex);
+  *reserve(buffer, 1) = (char) x;
+  buffer.size++;
+  return 0;
+}
+
+/// printd - print a double with newline and return 0. Writes the 8 bytes of
+/// the double instead in binary mode.
+extern "C" DLLEXPORT double printd(double x) {
+  static bool binary = Output::get().binary();
+  auto& buffer = thread_buffer.get();
+  std::lock_guard<std::mutex> lock(buffer.mutex);
+  if (binary) {
+    std::memcpy(reserve(buffer, sizeof(x)), &x, sizeof(x));
+    buffer.size += sizeof(x);
+    return 0;
+  }
+
+  // Same text as printf's "%f\n", which `to_chars` writes without parsing a
+  // format or taking the locale into account.
+  char* start = reserve(buffer, MAX_VALUE_SIZE);
+  auto res = std::to_chars(start, start + MAX_VALUE_SIZE - 1, x, std::chars_format::fixed, 6);
+  *res.ptr++ = '\n';
+  buffer.size += res.ptr - start;
+  return 0;
+}
+
+/// flushd - write out the output buffered by `printd` and `putchard` on all
+/// threads and return 0. Output is flushed at exit as well.
+extern "C" DLLEXPORT double flushd() {
+  Output::get().flush_all();
+  return 0;
+}
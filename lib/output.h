@@ -0,0 +1,5 @@
+#pragma once
+
+/// flushd - write out the output buffered by `printd` and `putchard` on all
+/// threads and return 0, see lib/output.cpp.
+extern "C" double flushd();
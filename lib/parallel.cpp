@@ -0,0 +1,436 @@
+// ===-------------------------===
+// kscope parallel loop runtime
+// ===-------------------------===
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+/// __ks_par_idle - number of threads of the pool with nothing to do, which
+/// code emitted for `par` reads before forking. Before the pool starts, it
+/// sends the first `par` to the runtime, which starts it.
+extern "C" {
+DLLEXPORT std::atomic<int32_t> __ks_par_idle{1};
+}
+
+static_assert(std::atomic<int32_t>::is_always_lock_free &&
+                  sizeof(std::atomic<int32_t>) == sizeof(int32_t),
+              "__ks_par_idle is read as a plain i32");
+
+namespace {
+
+/// Outlined body of a `pfor` loop, which runs the iterations [lo, hi) with
+/// the values it captured in `env`.
+using LoopTask = void (*)(void* env, int64_t lo, int64_t hi);
+
+/// Outlined body of a reduction, which returns the values of the iterations
+/// [lo, hi) combined.
+using ReduceTask = double (*)(void* env, int64_t lo, int64_t hi);
+
+/// Associative operator of a reduction.
+using Combine = double (*)(double lhs, double rhs);
+
+/// Outlined right operand of `par`, which returns its value.
+using SpawnTask = double (*)(void* env);
+
+/// Smallest number of iterations a reduction splits off by default. Smaller
+/// reductions run on the calling thread, where their loop is vectorized at
+/// the cost of a call.
+constexpr int64_t MIN_REDUCE_GRAIN = 4096;
+
+/// The result of a reduction on one thread, on a cache line of its own.
+struct alignas(64) Partial {
+  double val;
+};
+
+/// A running `pfor` loop or reduction. Its caller waits until no iterations
+/// remain. Each thread combines the ranges of a reduction it runs into its
+/// own partial result.
+struct Loop {
+  LoopTask task;
+  ReduceTask reduce;
+  Combine combine;
+  void* env;
+  int64_t grain;
+  std::atomic<int64_t> remaining;
+  std::vector<Partial> partials;
+};
+
+/// Most tasks a thread leaves for others to steal before it runs the
+/// operands of `par` itself. More would only be stolen once the pool has run
+/// out of other work.
+constexpr size_t MAX_PENDING_SPAWNS = 2;
+
+/// A forked operand of `par`. Whoever runs it stores the result and sets
+/// `done`; the thread that forked it frees it once it joined.
+struct Spawn {
+  SpawnTask task;
+  void* env;
+  double result;
+  /// Whether forking entered the pool from outside of it.
+  bool entered;
+  std::atomic<bool> done;
+};
+
+/// Work yet to be run: the iterations [lo, hi) of a loop, or a forked
+/// operand of `par` if `spawn` is set.
+struct Work {
+  Loop* loop;
+  int64_t lo, hi;
+  Spawn* spawn;
+};
+
+/// The work split off or forked by one thread. The owner pushes and pops at
+/// the back, where the smallest ranges are; thieves take the largest ones
+/// from the front.
+class WorkDeque {
+public:
+  void push(const Work& work) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    works_.push_back(work);
+  }
+
+  bool pop(Work& work) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (works_.empty()) {
+      return false;
+    }
+    work = works_.back();
+    works_.pop_back();
+    return true;
+  }
+
+  /// Take back the forked operand if nobody stole it yet.
+  bool pop_if(Spawn* spawn) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (works_.empty() || works_.back().spawn != spawn) {
+      return false;
+    }
+    works_.pop_back();
+    return true;
+  }
+
+  bool steal(Work& work) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (works_.empty()) {
+      return false;
+    }
+    work = works_.front();
+    works_.pop_front();
+    return true;
+  }
+
+  size_t size() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return works_.size();
+  }
+
+private:
+  std::mutex mutex_;
+  std::deque<Work> works_;
+};
+
+/// Slot of the current thread in the pool, or -1 outside of it.
+thread_local int current_slot = -1;
+
+/// Work-stealing thread pool running `pfor` loops, reductions and the
+/// operands of `par`. Slot 0 belongs to the thread that started the
+/// outermost loop or `par`, which works along with the others until it is
+/// done; nested ones run on the slot of the thread that starts them.
+class Pool {
+public:
+  /// Returns the process-wide pool, starting it on first use. It is never
+  /// destroyed, so that loops still running at exit do not lose their pool.
+  static Pool& get() {
+    static Pool* pool = new Pool(thread_count());
+    return *pool;
+  }
+
+  int threads() const {
+    return deques_.size();
+  }
+
+  /// A few ranges per thread balance uneven iterations.
+  int64_t auto_grain(int64_t count) const {
+    return std::max<int64_t>(1, count / (int64_t(threads()) * 8));
+  }
+
+  /// Run the iterations [0, count) of the loop and return once all of them
+  /// ran.
+  void run(Loop& loop, int64_t count) {
+    bool entered = enter();
+    int slot = current_slot;
+    run_range(slot, {&loop, 0, count, nullptr});
+    while (loop.remaining.load(std::memory_order_acquire) > 0) {
+      help(slot);
+    }
+    if (entered) {
+      leave();
+    }
+  }
+
+  /// Fork `task` for another thread to run, or return null if the pool is
+  /// busy enough already, in which case the caller runs it.
+  Spawn* spawn(SpawnTask task, void* env) {
+    if (threads() == 1 || __ks_par_idle.load(std::memory_order_relaxed) == 0 ||
+        (current_slot >= 0 && deques_[current_slot]->size() >= MAX_PENDING_SPAWNS)) {
+      return nullptr;
+    }
+    auto* spawn = new Spawn{task, env, 0, false, {false}};
+    spawn->entered = enter();
+    deques_[current_slot]->push({nullptr, 0, 0, spawn});
+    return spawn;
+  }
+
+  /// Wait for a forked task, running it if nobody stole it, and return its
+  /// result.
+  double sync(Spawn* spawn) {
+    int slot = current_slot;
+    if (deques_[slot]->pop_if(spawn)) {
+      spawn->result = spawn->task(spawn->env);
+    } else {
+      while (!spawn->done.load(std::memory_order_acquire)) {
+        help(slot);
+      }
+    }
+    if (spawn->entered) {
+      leave();
+    }
+    double result = spawn->result;
+    delete spawn;
+    return result;
+  }
+
+private:
+  std::vector<std::unique_ptr<WorkDeque>> deques_;
+  std::mutex outside_mutex_;
+  std::mutex sleep_mutex_;
+  std::condition_variable wake_;
+  /// Number of outermost loops and forks running, which keep the workers
+  /// awake.
+  std::atomic<int> active_{0};
+
+  /// `KSCOPE_THREADS` if set, otherwise one thread per core.
+  static unsigned thread_count() {
+    if (const char* env = std::getenv("KSCOPE_THREADS")) {
+      int threads = std::atoi(env);
+      if (threads > 0) {
+        return std::min(threads, 1024);
+      }
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  explicit Pool(unsigned threads) {
+    for (unsigned i = 0; i < threads; i++) {
+      deques_.push_back(std::make_unique<WorkDeque>());
+    }
+    __ks_par_idle.store(threads - 1, std::memory_order_relaxed);
+    for (unsigned i = 1; i < threads; i++) {
+      std::thread([this, i] { work(i); }).detach();
+    }
+  }
+
+  /// Threads outside the pool take turns on slot 0. Returns whether the
+  /// current thread entered the pool, and has to leave it once done. Work
+  /// forked inside the pool runs while the thread that entered it waits, so
+  /// only entering wakes the workers.
+  bool enter() {
+    if (current_slot >= 0) {
+      return false;
+    }
+    outside_mutex_.lock();
+    current_slot = 0;
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+      active_++;
+    }
+    wake_.notify_all();
+    return true;
+  }
+
+  void leave() {
+    active_--;
+    current_slot = -1;
+    outside_mutex_.unlock();
+  }
+
+  /// Run some work of the slot or stolen from another one while waiting.
+  void help(int slot) {
+    Work work;
+    if (find_work(slot, work)) {
+      run_work(slot, work);
+    } else {
+      std::this_thread::yield();
+    }
+  }
+
+  void work(int slot) {
+    current_slot = slot;
+    bool busy = false;
+    while (true) {
+      Work work;
+      if (find_work(slot, work)) {
+        if (!busy) {
+          busy = true;
+          __ks_par_idle.fetch_sub(1, std::memory_order_relaxed);
+        }
+        run_work(slot, work);
+        continue;
+      }
+      if (busy) {
+        busy = false;
+        __ks_par_idle.fetch_add(1, std::memory_order_relaxed);
+      }
+      if (active_.load() > 0) {
+        std::this_thread::yield();
+      } else {
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        wake_.wait(lock, [this] { return active_.load() > 0; });
+      }
+    }
+  }
+
+  void run_work(int slot, const Work& work) {
+    if (auto* spawn = work.spawn) {
+      spawn->result = spawn->task(spawn->env);
+      // The spawn may be gone once it is done.
+      spawn->done.store(true, std::memory_order_release);
+    } else {
+      run_range(slot, work);
+    }
+  }
+
+  /// Split the range in halves down to the grain size, leaving all but the
+  /// first piece for others to steal, and run that one.
+  void run_range(int slot, Work range) {
+    Loop* loop = range.loop;
+    while (range.hi - range.lo > loop->grain) {
+      int64_t mid = range.lo + (range.hi - range.lo) / 2;
+      deques_[slot]->push({loop, mid, range.hi, nullptr});
+      range.hi = mid;
+    }
+    if (loop->reduce) {
+      // A nested loop in the body may help with other ranges of this one on
+      // the same slot, so only read the partial once the range is reduced.
+      double val = loop->reduce(loop->env, range.lo, range.hi);
+      auto& partial = loop->partials[slot].val;
+      partial = loop->combine(partial, val);
+    } else {
+      loop->task(loop->env, range.lo, range.hi);
+    }
+    // The loop may be gone once its last iterations are counted.
+    loop->remaining.fetch_sub(range.hi - range.lo, std::memory_order_acq_rel);
+  }
+
+  bool find_work(int slot, Work& work) {
+    if (deques_[slot]->pop(work)) {
+      return true;
+    }
+    int threads = deques_.size();
+    for (int i = 1; i < threads; i++) {
+      if (deques_[(slot + i) % threads]->steal(work)) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+} // namespace
+
+/// __ks_pfor - run `task` over the iterations [0, count) on the thread pool,
+/// in ranges of about `grain` iterations, or a size picked from the number of
+/// threads if `grain` is not positive. Returns once all iterations ran.
+extern "C" DLLEXPORT void __ks_pfor(LoopTask task, void* env, int64_t count, int64_t grain) {
+  if (count <= 0) {
+    return;
+  }
+  auto& pool = Pool::get();
+  if (grain <= 0) {
+    grain = pool.auto_grain(count);
+  }
+  if (pool.threads() == 1 || count <= grain) {
+    task(env, 0, count);
+    return;
+  }
+  Loop loop{task, nullptr, nullptr, env, grain, {count}, {}};
+  pool.run(loop, count);
+}
+
+/// __ks_preduce - run the reduction `task` over the iterations [0, count) on
+/// the thread pool like `__ks_pfor`, and return the results of its ranges
+/// combined with `combine`, or `identity` if there are none. Reductions of
+/// fewer than `MIN_REDUCE_GRAIN` iterations run on the calling thread unless
+/// `grain` is given.
+extern "C" DLLEXPORT double __ks_preduce(ReduceTask task, void* env, int64_t count,
+                                         int64_t grain, Combine combine, double identity) {
+  if (count <= 0) {
+    return identity;
+  }
+  auto& pool = Pool::get();
+  if (grain <= 0) {
+    grain = std::max(MIN_REDUCE_GRAIN, pool.auto_grain(count));
+  }
+  if (pool.threads() == 1 || count <= grain) {
+    return task(env, 0, count);
+  }
+  Loop loop{nullptr, task, combine, env, grain, {count},
+            std::vector<Partial>(pool.threads(), Partial{identity})};
+  pool.run(loop, count);
+
+  // Combine the partial results pairwise, as a tree over the threads.
+  auto& partials = loop.partials;
+  for (size_t width = 1; width < partials.size(); width *= 2) {
+    for (size_t i = 0; i + width < partials.size(); i += 2 * width) {
+      partials[i].val = combine(partials[i].val, partials[i + width].val);
+    }
+  }
+  return partials[0].val;
+}
+
+/// __ks_spawn - fork `task` to run on another thread of the pool, if one is
+/// idle. Returns a handle to join it with `__ks_sync`, or null if it was not
+/// forked.
+extern "C" DLLEXPORT void* __ks_spawn(SpawnTask task, void* env) {
+  return Pool::get().spawn(task, env);
+}
+
+/// __ks_sync - wait for a task forked by `__ks_spawn` and return its result.
+/// Runs the task on the calling thread if it was not forked or nobody took
+/// it yet.
+extern "C" DLLEXPORT double __ks_sync(void* handle, SpawnTask task, void* env) {
+  if (!handle) {
+    return task(env);
+  }
+  return Pool::get().sync(static_cast<Spawn*>(handle));
+}
+
+/// __ks_reduce_add - combines partial sums.
+extern "C" DLLEXPORT double __ks_reduce_add(double lhs, double rhs) {
+  return lhs + rhs;
+}
+
+/// __ks_reduce_min - combines partial minimums, ignoring NaNs like `minnum`.
+extern "C" DLLEXPORT double __ks_reduce_min(double lhs, double rhs) {
+  return std::fmin(lhs, rhs);
+}
+
+/// __ks_reduce_max - combines partial maximums, ignoring NaNs like `maxnum`.
+extern "C" DLLEXPORT double __ks_reduce_max(double lhs, double rhs) {
+  return std::fmax(lhs, rhs);
+}
@@ -1,18 +1,30 @@
 #include "parser.h"
-#include <cctype>
+#include "llvm/ADT/SmallVector.h"
+#include <iostream>
 
 using namespace llvm;
 
 namespace kscope {
 
-Parser::Parser(std::istream& src)
-    : lexer_(Lexer(src)) {
+namespace {
+
+const Symbol SUM_NAME = Symbol::get("sum");
+const Symbol MIN_NAME = Symbol::get("min");
+const Symbol MAX_NAME = Symbol::get("max");
+const Symbol FOLD_NAME = Symbol::get("fold");
+const Symbol MEMO_NAME = Symbol::get("memo");
+
+} // namespace
+
+Parser::Parser(StringRef src, AstContext& ctx)
+    : lexer_(src), ctx_(ctx) {
+  tok_ = nullptr;
   cur_tok_ = TK_EOF;
   errored_ = false;
 }
 
-std::vector<Box<ItemAST>> Parser::parse() {
-  std::vector<Box<ItemAST>> items;
+std::vector<const ItemAST*> Parser::parse() {
+  std::vector<const ItemAST*> items;
   next_token();  // Prime first token.
 
   bool done = false;
@@ -25,22 +37,31 @@ std::vector<Box<ItemAST>> Parser::parse() {
       next_token();  // Ignore top-level semicolons.
       break;
     case TK_DEF:
-      if (auto def = parse_definition()) {
-        items.push_back(std::move(def));
+      if (auto* def = parse_definition()) {
+        items.push_back(def);
       } else {
         next_token();  // Skip token for error recovery.
       }
       break;
     case TK_EXTERN:
-      if (auto proto = parse_extern()) {
-        items.push_back(std::move(proto));
+      if (auto* proto = parse_extern()) {
+        items.push_back(proto);
       } else {
         next_token();  // Skip token for error recovery.
       }
       break;
     default:
-      if (auto expr = parse_expr()) {
-        items.push_back(std::move(expr));
+      // 'memo' is only a keyword in front of 'def'.
+      if (cur_tok_ == TK_IDENT && tok_->ident == MEMO_NAME && tok_[1].kind == TK_DEF) {
+        if (auto* def = parse_definition()) {
+          items.push_back(def);
+        } else {
+          next_token();  // Skip token for error recovery.
+        }
+        break;
+      }
+      if (auto* expr = parse_expr()) {
+        items.push_back(ctx_.anon(expr));
       } else {
         next_token();  // Skip token for error recovery.
       }
@@ -52,7 +73,12 @@ std::vector<Box<ItemAST>> Parser::parse() {
 }
 
 int Parser::next_token() {
-  cur_tok_ = lexer_.scan_token();
+  if (!tok_) {
+    tok_ = lexer_.tokens().data();
+  } else if (tok_->kind != TK_EOF) {
+    tok_++;
+  }
+  cur_tok_ = tok_->kind;
   return cur_tok_;
 }
 
@@ -66,37 +92,55 @@ int Parser::get_bin_precedence() {
   }
 }
 
-Box<PrototypeAST> Parser::parse_extern() {
+const PrototypeAST* Parser::parse_extern() {
   next_token();  // Consume 'extern'.
   return parse_prototype();
 }
 
-Box<FunctionAST> Parser::parse_definition() {
+const FunctionAST* Parser::parse_definition() {
+  bool memo = cur_tok_ == TK_IDENT;
+  if (memo) {
+    next_token();  // Consume 'memo'.
+  }
   next_token();  // Consume 'def'.
-  auto proto = parse_prototype();
+  auto* proto = parse_prototype();
   if (!proto) {
     return nullptr;
   }
-  if (auto expr = parse_expr()) {
-    return std::make_unique<FunctionAST>(std::move(proto), std::move(expr));
+  if (memo && proto->has_array_args()) {
+    log_err("memo functions cannot take arrays: " + proto->name().str());
+    return nullptr;
+  }
+  if (auto* expr = parse_expr()) {
+    return ctx_.function(proto, expr, memo);
   }
   return nullptr;
 }
 
-Box<PrototypeAST> Parser::parse_prototype() {
+const PrototypeAST* Parser::parse_prototype() {
   if (cur_tok_ != TK_IDENT) {
     return log_err_proto("expected function name in prototype");
   }
 
-  std::string name = lexer_.get_ident_str();
+  auto name = tok_->ident;
   next_token();  // Consume ident.
   if (cur_tok_ != '(') {
     return log_err_proto("expected '(' in prototype");
   }
 
-  std::vector<std::string> params;
-  while (next_token() == TK_IDENT) {
-    params.push_back(lexer_.get_ident_str());
+  SmallVector<Symbol, 4> params;
+  SmallVector<ValueType, 4> types;
+  next_token();  // Consume '('.
+  while (cur_tok_ == TK_IDENT) {
+    params.push_back(tok_->ident);
+    types.push_back(VT_NUM);
+    if (next_token() == '[') {
+      if (next_token() != ']') {
+        return log_err_proto("expected ']' after array argument");
+      }
+      types.back() = VT_ARRAY;
+      next_token();  // Consume ']'.
+    }
   }
 
   if (cur_tok_ != ')') {
@@ -104,18 +148,18 @@ Box<PrototypeAST> Parser::parse_prototype() {
   }
   next_token();  // Consume ')'.
 
-  return std::make_unique<PrototypeAST>(name, std::move(params));
+  return ctx_.proto(name, params, types);
 }
 
-Box<ExprAST> Parser::parse_expr() {
-  auto lhs = parse_primary();
+const ExprAST* Parser::parse_expr() {
+  auto* lhs = parse_primary();
   if (!lhs) {
     return nullptr;
   }
-  return parse_bin_rhs(0, std::move(lhs));
+  return parse_bin_rhs(0, lhs);
 }
 
-Box<ExprAST> Parser::parse_bin_rhs(int prec, Box<ExprAST> lhs) {
+const ExprAST* Parser::parse_bin_rhs(int prec, const ExprAST* lhs) {
   while (true) {
     // Proceed if binop binds as tighly as current precedence, otherwise return.
     int tok_prec = get_bin_precedence();
@@ -125,7 +169,7 @@ Box<ExprAST> Parser::parse_bin_rhs(int prec, Box<ExprAST> lhs) {
 
     int bin_op = cur_tok_;
     next_token();  // Consume the operator.
-    auto rhs = parse_primary();
+    auto* rhs = parse_primary();
     if (!rhs) {
       return nullptr;
     }
@@ -134,18 +178,18 @@ Box<ExprAST> Parser::parse_bin_rhs(int prec, Box<ExprAST> lhs) {
     // pending operator take RHS as its LHS.
     int next_prec = get_bin_precedence();
     if (tok_prec < next_prec) {
-      rhs = parse_bin_rhs(tok_prec + 1, std::move(rhs));
+      rhs = parse_bin_rhs(tok_prec + 1, rhs);
       if (!rhs) {
         return nullptr;
       }
     }
 
     // Merge into binary expression and repeat.
-    lhs = std::make_unique<BinExprAST>(bin_op, std::move(lhs), std::move(rhs));
+    lhs = ctx_.bin(bin_op, lhs, rhs);
   }
 }
 
-Box<ExprAST> Parser::parse_primary() {
+const ExprAST* Parser::parse_primary() {
   switch (cur_tok_) {
   case TK_IDENT:
     return parse_ident_or_call_expr();
@@ -156,28 +200,82 @@ Box<ExprAST> Parser::parse_primary() {
   case TK_IF:
     return parse_if_expr();
   case TK_FOR:
+  case TK_PFOR:
     return parse_for_expr();
+  case TK_ARRAY:
+    return parse_array_expr();
+  case TK_LEN:
+    return parse_len_expr();
+  case TK_VAR:
+    return parse_var_expr();
+  case TK_PAR:
+    return parse_par_expr();
   default:
     return log_err("unknown token when expecting an expression");
   }
 }
 
-Box<ExprAST> Parser::parse_ident_or_call_expr() {
-  std::string name = lexer_.get_ident_str();
+const ExprAST* Parser::parse_ident_or_call_expr() {
+  auto name = tok_->ident;
   next_token();  // Consume ident.
 
+  // Reduction names are only keywords in front of a loop, so they can still
+  // name functions and variables.
+  if (cur_tok_ == TK_IDENT && tok_[1].kind == TK_IN) {
+    if (name == SUM_NAME) {
+      return parse_reduce_expr(ReduceExprAST::RO_SUM);
+    } else if (name == MIN_NAME) {
+      return parse_reduce_expr(ReduceExprAST::RO_MIN);
+    } else if (name == MAX_NAME) {
+      return parse_reduce_expr(ReduceExprAST::RO_MAX);
+    }
+  }
+
+  // An array element, which may be assigned to.
+  if (cur_tok_ == '[') {
+    next_token();  // Consume '['.
+    auto* index = parse_expr();
+    if (!index) {
+      return nullptr;
+    }
+    if (cur_tok_ != ']') {
+      return log_err("expected ']'");
+    }
+    next_token();  // Consume ']'.
+
+    if (cur_tok_ != '=') {
+      return ctx_.index(name, index);
+    }
+    next_token();  // Consume '='.
+    auto* value = parse_expr();
+    if (!value) {
+      return nullptr;
+    }
+    return ctx_.store(name, index, value);
+  }
+
+  // An assignment to a variable.
+  if (cur_tok_ == '=') {
+    next_token();  // Consume '='.
+    auto* value = parse_expr();
+    if (!value) {
+      return nullptr;
+    }
+    return ctx_.assign(name, value);
+  }
+
   // A simple variable reference.
   if (cur_tok_ != '(') {
-    return std::make_unique<VarExprAST>(name);
+    return ctx_.var(name);
   }
 
   // Else, a function call.
   next_token();  // Consume '('.
-  std::vector<Box<ExprAST>> args;
+  SmallVector<const ExprAST*, 4> args;
   if (cur_tok_ != ')') {
     while (true) {
-      if (auto arg = parse_expr()) {
-        args.push_back(std::move(arg));
+      if (auto* arg = parse_expr()) {
+        args.push_back(arg);
       } else {
         return nullptr;
       }
@@ -192,18 +290,35 @@ Box<ExprAST> Parser::parse_ident_or_call_expr() {
   }
   next_token();  // Consume ')'.
 
-  return std::make_unique<CallExprAST>(name, std::move(args));
+  if (name == FOLD_NAME && cur_tok_ == TK_IDENT && tok_[1].kind == TK_IN) {
+    if (args.size() != 2 || !isa<VarExprAST>(args[0])) {
+      return log_err("expected 'fold(function, init)'");
+    }
+    return parse_reduce_expr(ReduceExprAST::RO_FOLD, cast<VarExprAST>(args[0])->symbol(),
+                             args[1]);
+  }
+
+  return ctx_.call(name, args);
+}
+
+const ExprAST* Parser::parse_reduce_expr(ReduceExprAST::ReduceOp op, Symbol fold,
+                                         const ExprAST* init) {
+  auto* loop = parse_loop(true);
+  if (!loop) {
+    return nullptr;
+  }
+  return ctx_.reduce(op, cast<ForExprAST>(loop), fold, init);
 }
 
-Box<ExprAST> Parser::parse_num_expr() {
-  auto res = std::make_unique<NumExprAST>(lexer_.get_num_value());
+const ExprAST* Parser::parse_num_expr() {
+  auto* res = ctx_.num(lexer_.num_value(*tok_));
   next_token();  // Consume the token.
-  return std::move(res);
+  return res;
 }
 
-Box<ExprAST> Parser::parse_paren_expr() {
+const ExprAST* Parser::parse_paren_expr() {
   next_token();  // Consume '('.
-  auto expr = parse_expr();
+  auto* expr = parse_expr();
   if (!expr) {
     return nullptr;
   }
@@ -214,10 +329,10 @@ Box<ExprAST> Parser::parse_paren_expr() {
   return expr;
 }
 
-Box<ExprAST> Parser::parse_if_expr() {
+const ExprAST* Parser::parse_if_expr() {
   next_token();  // Consume 'if'.
 
-  auto cond = parse_expr();
+  auto* cond = parse_expr();
   if (!cond) {
     return nullptr;
   }
@@ -227,7 +342,7 @@ Box<ExprAST> Parser::parse_if_expr() {
   }
   next_token();  // Consume ':'.
 
-  auto then_case = parse_expr();
+  auto* then_case = parse_expr();
   if (!then_case) {
     return nullptr;
   }
@@ -237,22 +352,27 @@ Box<ExprAST> Parser::parse_if_expr() {
   }
   next_token();  // Consume 'else'.
 
-  auto else_case = parse_expr();
+  auto* else_case = parse_expr();
   if (!else_case) {
     return nullptr;
   }
 
-  return std::make_unique<IfExprAST>(
-      std::move(cond), std::move(then_case), std::move(else_case));
+  return ctx_.if_expr(cond, then_case, else_case);
 }
 
-Box<ExprAST> Parser::parse_for_expr() {
-  next_token();  // Consume 'for'.
+const ExprAST* Parser::parse_for_expr() {
+  bool parallel = cur_tok_ == TK_PFOR;
+  next_token();  // Consume 'for' or 'pfor'.
 
   if (cur_tok_ != TK_IDENT) {
-    return log_err("expected identifier after 'for'");
+    return log_err(parallel ? "expected identifier after 'pfor'"
+                            : "expected identifier after 'for'");
   }
-  std::string name = lexer_.get_ident_str();
+  return parse_loop(parallel);
+}
+
+const ExprAST* Parser::parse_loop(bool parallel) {
+  auto name = tok_->ident;
   next_token();  // Consume ident.
 
   if (cur_tok_ != TK_IN) {
@@ -260,7 +380,7 @@ Box<ExprAST> Parser::parse_for_expr() {
   }
   next_token();  // Consume 'in'.
 
-  auto init = parse_expr();
+  auto* init = parse_expr();
   if (!init) {
     return nullptr;
   }
@@ -270,12 +390,12 @@ Box<ExprAST> Parser::parse_for_expr() {
   }
   next_token();  // Consume '..'.
 
-  auto stop =  parse_expr();
+  auto* stop = parse_expr();
   if (!stop) {
     return nullptr;
   }
 
-  Box<ExprAST> step;
+  const ExprAST* step = nullptr;
   if (cur_tok_ == ',') {
     next_token();  // Consume comma.
     step = parse_expr();
@@ -284,28 +404,130 @@ Box<ExprAST> Parser::parse_for_expr() {
     }
   }
 
+  // A parallel loop can also give its grain size.
+  const ExprAST* grain = nullptr;
+  if (parallel && cur_tok_ == ',') {
+    next_token();  // Consume comma.
+    grain = parse_expr();
+    if (!grain) {
+      return nullptr;
+    }
+  }
+
   if (cur_tok_ != ':') {
     return log_err("expected ':'");
   }
   next_token();  // Consume ':'.
 
-  auto body = parse_expr();
+  auto* body = parse_expr();
   if (!body) {
     return nullptr;
   }
 
-  return std::make_unique<ForExprAST>(
-      name, std::move(init), std::move(stop),
-      std::move(body), std::move(step));
+  return ctx_.for_expr(name, init, stop, body, step, parallel, grain);
+}
+
+const ExprAST* Parser::parse_array_expr() {
+  next_token();  // Consume 'array'.
+  if (cur_tok_ != '(') {
+    return log_err("expected '(' after 'array'");
+  }
+  next_token();  // Consume '('.
+
+  auto* size = parse_expr();
+  if (!size) {
+    return nullptr;
+  }
+
+  if (cur_tok_ != ')') {
+    return log_err("expected ')'");
+  }
+  next_token();  // Consume ')'.
+
+  return ctx_.array(size);
+}
+
+const ExprAST* Parser::parse_len_expr() {
+  next_token();  // Consume 'len'.
+  if (cur_tok_ != '(') {
+    return log_err("expected '(' after 'len'");
+  }
+  if (next_token() != TK_IDENT) {
+    return log_err("expected array name in 'len'");
+  }
+  auto name = tok_->ident;
+  if (next_token() != ')') {
+    return log_err("expected ')'");
+  }
+  next_token();  // Consume ')'.
+
+  return ctx_.len(name);
+}
+
+const ExprAST* Parser::parse_var_expr() {
+  next_token();  // Consume 'var'.
+
+  SmallVector<std::pair<Symbol, const ExprAST*>, 2> vars;
+  while (true) {
+    if (cur_tok_ != TK_IDENT) {
+      return log_err("expected identifier after 'var'");
+    }
+    auto name = tok_->ident;
+    if (next_token() != '=') {
+      return log_err("expected '=' after variable name");
+    }
+    next_token();  // Consume '='.
+
+    auto* init = parse_expr();
+    if (!init) {
+      return nullptr;
+    }
+    vars.push_back({name, init});
+
+    if (cur_tok_ != ',') {
+      break;
+    }
+    next_token();  // Consume ','.
+  }
+
+  if (cur_tok_ != TK_IN) {
+    return log_err("expected 'in' after 'var'");
+  }
+  next_token();  // Consume 'in'.
+
+  auto* body = parse_expr();
+  if (!body) {
+    return nullptr;
+  }
+
+  // Later variables are bound inside the earlier ones.
+  for (auto it = vars.rbegin(); it != vars.rend(); ++it) {
+    body = ctx_.let(it->first, it->second, body);
+  }
+  return body;
+}
+
+const ExprAST* Parser::parse_par_expr() {
+  next_token();  // Consume 'par'.
+
+  auto* expr = parse_expr();
+  if (!expr) {
+    return nullptr;
+  }
+  auto* bin = dyn_cast<BinExprAST>(expr);
+  if (!bin) {
+    return log_err("expected a binary operator after 'par'");
+  }
+  return ctx_.par(bin);
 }
 
-Box<ExprAST> Parser::log_err(StringRef msg) {
+const ExprAST* Parser::log_err(StringRef msg) {
   std::cerr << "[error] " << msg.str() << std::endl;
   errored_ = true;
   return nullptr;
 }
 
-Box<PrototypeAST> Parser::log_err_proto(StringRef msg) {
+const PrototypeAST* Parser::log_err_proto(StringRef msg) {
   log_err(msg);
   return nullptr;
 }
@@ -2,60 +2,93 @@
 
 #include "ast.h"
 #include "lexer.h"
-#include <iostream>
 
 namespace kscope {
 
 class Parser {
 public:
-  Parser(std::istream& src);
+  /// Items are made in `ctx`, which has to outlive them. The source has to
+  /// outlive the parser.
+  Parser(llvm::StringRef src, AstContext& ctx);
 
   /// top ::= definition | external | expr | ';'
-  std::vector<Box<ItemAST>> parse();
+  ///
+  /// Top-level expressions are returned as anonymous functions.
+  std::vector<const ItemAST*> parse();
 
   bool errored() const {
     return errored_;
   }
 
+  /// Returns the number of source lines consumed so far.
+  int lines() const {
+    return lexer_.lines();
+  }
+
 private:
   Lexer lexer_;
+  AstContext& ctx_;
+  const Token* tok_;
   int cur_tok_;
   bool errored_;
 
-  /// Reads another token from lexer and updates `cur_tok`.
+  /// Moves to the next token and updates `cur_tok`.
   int next_token();
 
   /// Get precedence of pending binary operator token.
   int get_bin_precedence();
 
   /// external ::= 'extern' prototype
-  Box<PrototypeAST> parse_extern();
-  /// definition ::= 'def' prototype expr
-  Box<FunctionAST> parse_definition();
-  /// prototype ::= ident '(' ident* ')'
-  Box<PrototypeAST> parse_prototype();
+  const PrototypeAST* parse_extern();
+  /// definition ::= 'memo'? 'def' prototype expr
+  const FunctionAST* parse_definition();
+  /// prototype ::= ident '(' (ident ('[' ']')?)* ')'
+  const PrototypeAST* parse_prototype();
   /// expr ::= primary bin_rhs
-  Box<ExprAST> parse_expr();
+  const ExprAST* parse_expr();
   /// bin_rhs ::= (OP primary)*
-  Box<ExprAST> parse_bin_rhs(int prec, Box<ExprAST> lhs);
+  const ExprAST* parse_bin_rhs(int prec, const ExprAST* lhs);
   /// primary ::= ident_expr | num_expr | paren_expr
-  ///           | if_expr | for_expr
-  Box<ExprAST> parse_primary();
+  ///           | if_expr | for_expr | array_expr | len_expr | var_expr
+  ///           | par_expr
+  const ExprAST* parse_primary();
   /// ident_expr ::= ident | ident '(' expr* ')'
-  Box<ExprAST> parse_ident_or_call_expr();
+  ///              | ident '[' expr ']' ('=' expr)? | ident '=' expr
+  ///              | reduce_expr
+  const ExprAST* parse_ident_or_call_expr();
+  /// reduce_expr ::= ('sum' | 'min' | 'max' | 'fold' '(' ident ',' expr ')') loop
+  const ExprAST* parse_reduce_expr(ReduceExprAST::ReduceOp op, Symbol fold = Symbol(),
+                                   const ExprAST* init = nullptr);
   /// num_expr ::= number
-  Box<ExprAST> parse_num_expr();
+  const ExprAST* parse_num_expr();
   /// paren_expr ::= '(' expr ')'
-  Box<ExprAST> parse_paren_expr();
+  const ExprAST* parse_paren_expr();
   /// if_expr ::= 'if' expr ':' expr 'else' expr
-  Box<ExprAST> parse_if_expr();
+  const ExprAST* parse_if_expr();
   /// for_expr ::= 'for' ident 'in' expr '..' expr (',' expr)? ':' expr
-  Box<ExprAST> parse_for_expr();
+  ///            |  'pfor' loop
+  const ExprAST* parse_for_expr();
+  /// loop ::= ident 'in' expr '..' expr (',' expr (',' expr)?)? ':' expr
+  ///
+  /// Only parallel loops take the grain size, the second value after the
+  /// range.
+  const ExprAST* parse_loop(bool parallel);
+  /// array_expr ::= 'array' '(' expr ')'
+  const ExprAST* parse_array_expr();
+  /// len_expr ::= 'len' '(' ident ')'
+  const ExprAST* parse_len_expr();
+  /// var_expr ::= 'var' ident '=' expr (',' ident '=' expr)* 'in' expr
+  const ExprAST* parse_var_expr();
+  /// par_expr ::= 'par' expr
+  ///
+  /// The expression has to be a binary operator, whose operands run
+  /// concurrently.
+  const ExprAST* parse_par_expr();
 
   /// Helper for error handling.
-  Box<ExprAST> log_err(llvm::StringRef msg);
+  const ExprAST* log_err(llvm::StringRef msg);
   /// Helper for error handling typed to prototypes.
-  Box<PrototypeAST> log_err_proto(llvm::StringRef msg);
+  const PrototypeAST* log_err_proto(llvm::StringRef msg);
 };
 
 } // namespace kscope
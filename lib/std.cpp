@@ -2,6 +2,10 @@
 // kscope standard library
 // ===-----------------===
 
+#include "output.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
 
 #ifdef _WIN32
@@ -10,14 +14,59 @@
 #define DLLEXPORT
 #endif
 
-/// putchard - putchar a double and return 0.
-extern "C" DLLEXPORT double putchard(double x) {
-  fputc((char) x, stderr);
-  return 0;
+/// kscope_show - print the result of a top-level expression to stdout; used
+/// by the main function of ahead-of-time compiled executables.
+extern "C" DLLEXPORT void kscope_show(double x) {
+  printf("%g\n", x);
 }
 
-/// printd - print a double with newline and return 0.
-extern "C" DLLEXPORT double printd(double x) {
-  fprintf(stderr, "%f\n", x);
-  return 0;
+/// Abort a program that hit a runtime error, after writing out what it
+/// printed before, including results still buffered by stdio.
+[[noreturn]] static void abort_program() {
+  fflush(nullptr);
+  abort();
+}
+
+// Arrays allocated by `array(n)` are chained into a list per function call
+// and freed together when the call returns. The header keeps the elements
+// 16-byte aligned.
+struct alignas(16) ArrayHeader {
+  ArrayHeader* next;
+};
+
+/// __ks_array_new - allocate a zeroed array of `size` numbers and push it on
+/// the list at `*arrays`.
+extern "C" DLLEXPORT double* __ks_array_new(void** arrays, int64_t size) {
+  if (size < 0 || uint64_t(size) > (SIZE_MAX - sizeof(ArrayHeader)) / sizeof(double)) {
+    flushd();
+    fprintf(stderr, "[error] invalid array size: %lld\n", (long long) size);
+    abort_program();
+  }
+  auto* header = (ArrayHeader*) calloc(1, sizeof(ArrayHeader) + size * sizeof(double));
+  if (!header) {
+    flushd();
+    fprintf(stderr, "[error] out of memory allocating an array of %lld\n", (long long) size);
+    abort_program();
+  }
+  header->next = (ArrayHeader*) *arrays;
+  *arrays = header;
+  return (double*) (header + 1);
+}
+
+/// __ks_array_free - free a list of arrays built by `__ks_array_new`.
+extern "C" DLLEXPORT void __ks_array_free(void* arrays) {
+  auto* header = (ArrayHeader*) arrays;
+  while (header) {
+    auto* next = header->next;
+    free(header);
+    header = next;
+  }
+}
+
+/// __ks_bounds_error - report an out of bounds array access and abort.
+extern "C" DLLEXPORT void __ks_bounds_error(int64_t index, int64_t size) {
+  flushd();
+  fprintf(stderr, "[error] array index %lld out of bounds for length %lld\n",
+          (long long) index, (long long) size);
+  abort_program();
 }
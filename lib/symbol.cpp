@@ -0,0 +1,24 @@
+#include "symbol.h"
+
+using namespace llvm;
+
+namespace kscope {
+
+Interner& Interner::global() {
+  static Interner interner;
+  return interner;
+}
+
+Interner::Interner() {
+  names_.push_back("");  // Id of the empty symbol.
+}
+
+uint32_t Interner::intern(StringRef name) {
+  auto [iter, inserted] = ids_.try_emplace(name, names_.size());
+  if (inserted) {
+    names_.push_back(iter->getKey());
+  }
+  return iter->second;
+}
+
+} // namespace kscope
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "common.h"
+#include "llvm/ADT/DenseMapInfo.h"
+#include "llvm/ADT/StringMap.h"
+
+namespace kscope {
+
+/// An interned identifier. Symbols of equal names are equal, so they can be
+/// compared and hashed as integers. All symbols share one process-wide
+/// interner; like the rest of the front-end it is not thread-safe.
+class Symbol {
+public:
+  /// Returns the symbol of the name, interning it on first use.
+  static Symbol get(llvm::StringRef name);
+
+  /// An empty symbol, which is not the symbol of any name.
+  Symbol() = default;
+
+  /// The interned name, valid for the lifetime of the process.
+  llvm::StringRef str() const;
+
+  uint32_t id() const {
+    return id_;
+  }
+
+  explicit operator bool() const {
+    return id_ != 0;
+  }
+
+  bool operator==(Symbol other) const {
+    return id_ == other.id_;
+  }
+
+  bool operator!=(Symbol other) const {
+    return id_ != other.id_;
+  }
+
+private:
+  friend struct llvm::DenseMapInfo<Symbol>;
+
+  explicit Symbol(uint32_t id) : id_(id) {}
+
+  uint32_t id_ = 0;
+};
+
+/// The table behind `Symbol`, mapping names to dense ids and back.
+class Interner {
+public:
+  static Interner& global();
+
+  uint32_t intern(llvm::StringRef name);
+
+  llvm::StringRef name(uint32_t id) const {
+    return names_[id];
+  }
+
+  /// Number of distinct names, not counting the empty symbol.
+  size_t size() const {
+    return names_.size() - 1;
+  }
+
+private:
+  Interner();
+
+  llvm::StringMap<uint32_t> ids_;
+  std::vector<llvm::StringRef> names_;  // Keys of `ids_`, by id.
+};
+
+inline Symbol Symbol::get(llvm::StringRef name) {
+  return Symbol(Interner::global().intern(name));
+}
+
+inline llvm::StringRef Symbol::str() const {
+  return Interner::global().name(id_);
+}
+
+} // namespace kscope
+
+namespace llvm {
+
+template <>
+struct DenseMapInfo<kscope::Symbol> {
+  static kscope::Symbol getEmptyKey() {
+    return kscope::Symbol(~0u);
+  }
+
+  static kscope::Symbol getTombstoneKey() {
+    return kscope::Symbol(~0u - 1);
+  }
+
+  static unsigned getHashValue(kscope::Symbol sym) {
+    return DenseMapInfo<uint32_t>::getHashValue(sym.id());
+  }
+
+  static bool isEqual(kscope::Symbol lhs, kscope::Symbol rhs) {
+    return lhs == rhs;
+  }
+};
+
+} // namespace llvm
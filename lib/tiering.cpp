@@ -0,0 +1,310 @@
+#include "tiering.h"
+#include "emitter.h"
+#include "timing.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+using namespace llvm::orc;
+
+namespace kscope {
+
+namespace {
+
+/// Symbol suffixes of the compiled bodies behind a function's stub.
+constexpr const char* BASELINE_SUFFIX = ".t0";
+constexpr const char* OPTIMIZED_SUFFIX = ".t3";
+
+void tier_up(void* ctx, const char* name) {
+  static_cast<TierManager*>(ctx)->request(name);
+}
+
+} // namespace
+
+Expected<Box<TierManager>> TierManager::create(LLJIT& lljit, JITTargetMachineBuilder jtmb) {
+  auto ism = createLocalIndirectStubsManagerBuilder(lljit.getTargetTriple())();
+  jtmb.setCodeGenOptLevel(CodeGenOpt::Aggressive);
+  auto tm = jtmb.createTargetMachine();
+  if (!tm) {
+    return tm.takeError();
+  }
+  return std::make_unique<TierManager>(lljit, std::move(ism), std::move(*tm));
+}
+
+TierManager::TierManager(LLJIT& lljit, Box<IndirectStubsManager> ism, Box<TargetMachine> tm)
+    : lljit_(lljit),
+      dylib_(lljit.getMainJITDylib()),
+      impl_dylib_(lljit.getExecutionSession().createBareJITDylib("<main>.tiers")),
+      ism_(std::move(ism)),
+      start_(Clock::now()),
+      tm_(std::move(tm)),
+      opt_(OL_O3) {
+  // Compiled bodies are only reachable through the stubs in the main dylib,
+  // and resolve their own calls through those stubs as well.
+  impl_dylib_.setLinkOrder(
+      {{&dylib_, JITDylibLookupFlags::MatchExportedSymbolsOnly}},
+      /*LinkAgainstThisJITDylibFirst=*/false);
+
+  cantFail(dylib_.define(absoluteSymbols({
+    {lljit_.mangleAndIntern(Emitter::TIER_UP_NAME),
+     JITEvaluatedSymbol(pointerToJITTargetAddress(&tier_up),
+                        JITSymbolFlags::Exported | JITSymbolFlags::Callable)},
+    {lljit_.mangleAndIntern(Emitter::TIER_CTX_NAME),
+     JITEvaluatedSymbol(pointerToJITTargetAddress(this), JITSymbolFlags::Exported)},
+  })));
+
+  worker_ = std::thread([this] { run_worker(); });
+}
+
+TierManager::~TierManager() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  queue_cv_.notify_all();
+  worker_.join();
+}
+
+Error TierManager::add_module(ThreadSafeModule tsm, ResourceTrackerSP tracker) {
+  auto bitcode = std::make_shared<std::string>();
+  std::vector<std::pair<std::string, JITSymbolFlags>> fns;
+  std::vector<std::string> counted;
+  SymbolAliasMap vars;
+  tsm.withModuleDo([&](Module& mod) {
+    raw_string_ostream stream(*bitcode);
+    WriteBitcodeToFile(mod, stream);
+    stream.flush();
+
+    // Move each body aside and point all calls, recursive ones included, at
+    // the stub, so they pick up optimized code as soon as it is swapped in.
+    std::vector<Function*> defs;
+    for (auto& fn : mod) {
+      if (!fn.isDeclaration()) {
+        defs.push_back(&fn);
+      }
+    }
+    for (auto* fn : defs) {
+      auto name = fn->getName().str();
+      fns.emplace_back(name, JITSymbolFlags::fromGlobalValue(*fn));
+      if (Emitter::has_tier_counter(*fn)) {
+        counted.push_back(name);
+      }
+      fn->setName(name + BASELINE_SUFFIX);
+      auto* decl = Function::Create(fn->getFunctionType(), GlobalValue::ExternalLinkage,
+                                    name, mod);
+      fn->replaceAllUsesWith(decl);
+    }
+
+    // Variables, like the caches of `memo` functions, are shared by the
+    // baseline and optimized code through the main dylib.
+    for (auto& var : mod.globals()) {
+      if (!var.isDeclaration() && !var.hasLocalLinkage()) {
+        auto name = lljit_.mangleAndIntern(var.getName());
+        vars[name] = SymbolAliasMapEntry(name, JITSymbolFlags::fromGlobalValue(var));
+      }
+    }
+  });
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  // Stubs come first, since the bodies call each other through them. They
+  // are pointed at the bodies once those are compiled. A redefined function
+  // keeps its stub, so code that is already linked against it calls the new
+  // definition.
+  IndirectStubsManager::StubInitsMap inits;
+  for (auto& fn : fns) {
+    if (!ism_->findStub(fn.first, false)) {
+      inits[fn.first] = {0, fn.second};
+    }
+  }
+  if (auto err = ism_->createStubs(inits)) {
+    return err;
+  }
+  SymbolMap stubs;
+  for (auto& fn : fns) {
+    stubs[lljit_.mangleAndIntern(fn.first)] = ism_->findStub(fn.first, false);
+  }
+  if (auto err = dylib_.define(absoluteSymbols(std::move(stubs)), tracker)) {
+    return err;
+  }
+  if (!vars.empty()) {
+    if (auto err = dylib_.define(reexports(impl_dylib_, std::move(vars)), tracker)) {
+      return err;
+    }
+  }
+
+  auto impl_tracker = impl_dylib_.createResourceTracker();
+  impl_trackers_[tracker.get()] = impl_tracker;
+  if (auto err = lljit_.addIRModule(impl_tracker, std::move(tsm))) {
+    return err;
+  }
+  SymbolLookupSet bodies;
+  for (auto& fn : fns) {
+    bodies.add(lljit_.mangleAndIntern(fn.first + BASELINE_SUFFIX));
+  }
+  auto& es = lljit_.getExecutionSession();
+  auto body_syms = es.lookup(makeJITDylibSearchOrder(&impl_dylib_), std::move(bodies));
+  if (!body_syms) {
+    return body_syms.takeError();
+  }
+  for (auto& fn : fns) {
+    auto& sym = (*body_syms)[lljit_.mangleAndIntern(fn.first + BASELINE_SUFFIX)];
+    if (auto err = ism_->updatePointer(fn.first, sym.getAddress())) {
+      return err;
+    }
+  }
+
+  for (auto& name : counted) {
+    auto& rec = records_[name];
+    rec.tier = {name, TS_BASELINE, since_start(), -1, -1};
+    rec.generation = next_generation_++;
+    rec.bitcode = bitcode;
+    rec.owner = tracker.get();
+    rec.opt_tracker = nullptr;
+  }
+  return Error::success();
+}
+
+void TierManager::remove_module(ResourceTracker& tracker) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto iter = records_.begin(); iter != records_.end();) {
+    if (iter->second.owner == &tracker) {
+      if (iter->second.opt_tracker) {
+        cantFail(iter->second.opt_tracker->remove());
+      }
+      iter = records_.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+
+  auto iter = impl_trackers_.find(&tracker);
+  if (iter != impl_trackers_.end()) {
+    cantFail(iter->second->remove());
+    impl_trackers_.erase(iter);
+  }
+}
+
+void TierManager::request(StringRef name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto iter = records_.find(name.str());
+  if (iter == records_.end() || iter->second.tier.state != TS_BASELINE) {
+    return;
+  }
+  iter->second.tier.state = TS_QUEUED;
+  iter->second.tier.hot_ms = since_start();
+  queue_.emplace_back(name.str(), iter->second.generation);
+  queue_cv_.notify_one();
+}
+
+std::vector<TierManager::FunctionTier> TierManager::functions() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<FunctionTier> res;
+  for (auto& entry : records_) {
+    res.push_back(entry.second.tier);
+  }
+  return res;
+}
+
+void TierManager::run_worker() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    queue_cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+    if (stopping_) {
+      return;
+    }
+    auto [name, generation] = queue_.front();
+    queue_.pop_front();
+    auto iter = records_.find(name);
+    if (iter == records_.end() || iter->second.generation != generation) {
+      continue;
+    }
+    auto bitcode = iter->second.bitcode;
+
+    // Optimization and code generation run unlocked; the function may be
+    // redefined or removed in the meantime.
+    lock.unlock();
+    auto obj = compile_optimized(name, *bitcode);
+    lock.lock();
+
+    iter = records_.find(name);
+    if (iter == records_.end() || iter->second.generation != generation) {
+      if (!obj) {
+        consumeError(obj.takeError());
+      }
+      continue;
+    }
+    auto& rec = iter->second;
+    if (!obj) {
+      logAllUnhandledErrors(obj.takeError(), errs(), "[error] ");
+      rec.tier.state = TS_BASELINE;
+      continue;
+    }
+
+    auto tracker = impl_dylib_.createResourceTracker();
+    if (auto err = lljit_.addObjectFile(tracker, std::move(*obj))) {
+      logAllUnhandledErrors(std::move(err), errs(), "[error] ");
+      rec.tier.state = TS_BASELINE;
+      continue;
+    }
+    auto sym = lljit_.getExecutionSession().lookup(
+        makeJITDylibSearchOrder(&impl_dylib_), lljit_.mangleAndIntern(name + OPTIMIZED_SUFFIX));
+    if (!sym) {
+      logAllUnhandledErrors(sym.takeError(), errs(), "[error] ");
+      cantFail(tracker->remove());
+      rec.tier.state = TS_BASELINE;
+      continue;
+    }
+
+    // Swapping the stub pointer is atomic; calls already running in the
+    // baseline code finish there.
+    cantFail(ism_->updatePointer(name, sym->getAddress()));
+    rec.opt_tracker = tracker;
+    rec.tier.state = TS_OPTIMIZED;
+    rec.tier.optimized_ms = since_start();
+  }
+}
+
+Expected<Box<MemoryBuffer>> TierManager::compile_optimized(const std::string& name,
+                                                           const std::string& bitcode) {
+  LLVMContext ctx;
+  auto mod = parseBitcodeFile(MemoryBufferRef(bitcode, name), ctx);
+  if (!mod) {
+    return mod.takeError();
+  }
+  auto* fn = (*mod)->getFunction(name);
+  if (!fn) {
+    return createStringError(inconvertibleErrorCode(), "no function in bitcode: %s",
+                             name.c_str());
+  }
+
+  // Only the hot function is emitted. The rest of its module stays around
+  // for inlining, just like definitions sharing a module in untiered mode,
+  // and its variables are those of the baseline code.
+  for (auto& other : **mod) {
+    Emitter::strip_tier_counter(other);
+    if (&other != fn && !other.isDeclaration()) {
+      other.setLinkage(GlobalValue::AvailableExternallyLinkage);
+    }
+  }
+  for (auto& var : (*mod)->globals()) {
+    if (!var.isDeclaration() && !var.hasLocalLinkage()) {
+      var.setInitializer(nullptr);
+    }
+  }
+  fn->setName(name + OPTIMIZED_SUFFIX);
+
+  opt_.run(**mod);
+  PhaseScope scope(PH_CODEGEN, name);
+  SimpleCompiler compiler(*tm_);
+  return compiler(**mod);
+}
+
+double TierManager::since_start() const {
+  std::chrono::duration<double, std::milli> dur = Clock::now() - start_;
+  return dur.count();
+}
+
+} // namespace kscope
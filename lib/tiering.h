@@ -0,0 +1,105 @@
+#pragma once
+
+#include "common.h"
+#include "optimizer.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Target/TargetMachine.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+
+namespace kscope {
+
+/// Tiered compilation. Functions are first compiled as-is (the JIT runs them
+/// at -O0) with the call counters inserted by the emitter. Callers reach
+/// every function through an indirect stub, so once a counter reports a hot
+/// function, a background thread recompiles it at -O3 and swaps the stub's
+/// target.
+class TierManager {
+public:
+  enum TierState {
+    TS_BASELINE,
+    TS_QUEUED,
+    TS_OPTIMIZED,
+  };
+
+  /// Tier state of a function, with times in milliseconds since the manager
+  /// was created (negative if not reached yet).
+  struct FunctionTier {
+    std::string name;
+    TierState state;
+    double defined_ms;
+    double hot_ms;
+    double optimized_ms;
+  };
+
+  static llvm::Expected<Box<TierManager>> create(
+      llvm::orc::LLJIT& lljit, llvm::orc::JITTargetMachineBuilder jtmb);
+
+  TierManager(llvm::orc::LLJIT& lljit, Box<llvm::orc::IndirectStubsManager> ism,
+              Box<llvm::TargetMachine> tm);
+  ~TierManager();
+
+  /// Compile the module at the baseline tier and define stubs for its
+  /// functions in the main dylib under the given tracker.
+  llvm::Error add_module(llvm::orc::ThreadSafeModule tsm,
+                         llvm::orc::ResourceTrackerSP tracker);
+
+  /// Drop all code compiled for the functions of the given tracker. The
+  /// caller still has to remove the tracker itself.
+  void remove_module(llvm::orc::ResourceTracker& tracker);
+
+  /// Queue the function for recompilation, called by the tier-up hook.
+  void request(llvm::StringRef name);
+
+  /// Snapshot of the tier state of all counted functions, sorted by name.
+  std::vector<FunctionTier> functions() const;
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Record {
+    FunctionTier tier;
+    /// Changes on every redefinition, so stale recompiles can be detected.
+    uint64_t generation;
+    /// Bitcode of the module the function was defined in.
+    std::shared_ptr<const std::string> bitcode;
+    llvm::orc::ResourceTracker* owner;
+    llvm::orc::ResourceTrackerSP opt_tracker;
+  };
+
+  void run_worker();
+  /// Optimize and compile one function out of the bitcode.
+  llvm::Expected<Box<llvm::MemoryBuffer>> compile_optimized(
+      const std::string& name, const std::string& bitcode);
+  double since_start() const;
+
+  llvm::orc::LLJIT& lljit_;
+  llvm::orc::JITDylib& dylib_;
+  llvm::orc::JITDylib& impl_dylib_;
+  Box<llvm::orc::IndirectStubsManager> ism_;
+  Clock::time_point start_;
+
+  // Used by the worker only.
+  Box<llvm::TargetMachine> tm_;
+  Optimizer opt_;
+
+  mutable std::mutex mutex_;  // Guards members below.
+  std::condition_variable queue_cv_;
+  std::deque<std::pair<std::string, uint64_t>> queue_;
+  bool stopping_ = false;
+  uint64_t next_generation_ = 0;
+  std::map<std::string, Record> records_;
+  llvm::DenseMap<llvm::orc::ResourceTracker*, llvm::orc::ResourceTrackerSP> impl_trackers_;
+
+  std::thread worker_;
+};
+
+} // namespace kscope
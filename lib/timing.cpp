@@ -0,0 +1,124 @@
+#include "timing.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/TimeProfiler.h"
+#include <atomic>
+#include <chrono>
+
+using namespace llvm;
+
+namespace kscope {
+
+namespace {
+
+std::atomic<uint64_t> counts[PH_LAST_];
+std::atomic<uint64_t> self_nanos[PH_LAST_];
+std::atomic<uint64_t> total_nanos[PH_LAST_];
+
+thread_local PhaseScope* current_scope = nullptr;
+
+uint64_t now_ns() {
+  auto since_epoch = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(since_epoch).count();
+}
+
+} // namespace
+
+StringRef phase_name(Phase phase) {
+  switch (phase) {
+  case PH_PARSE: return "parse";
+  case PH_EMIT: return "emit";
+  case PH_OPTIMIZE: return "optimize";
+  case PH_ADD_MODULE: return "add_module";
+  case PH_CODEGEN: return "codegen";
+  case PH_LOOKUP: return "lookup";
+  case PH_CALL: return "call";
+  case PH_LAST_: break;
+  }
+  return "unknown";
+}
+
+PhaseTimes PhaseTimes::operator-(const PhaseTimes& other) const {
+  PhaseTimes res;
+  for (int i = 0; i < PH_LAST_; i++) {
+    res.count[i] = count[i] - other.count[i];
+    res.self_ns[i] = self_ns[i] - other.self_ns[i];
+    res.total_ns[i] = total_ns[i] - other.total_ns[i];
+  }
+  return res;
+}
+
+void Timing::enable(bool trace, unsigned granularity_us) {
+  if (trace && !timeTraceProfilerEnabled()) {
+    timeTraceProfilerInitialize(granularity_us, "kscope");
+  }
+  enabled_ = true;
+}
+
+PhaseTimes Timing::totals() {
+  PhaseTimes res;
+  for (int i = 0; i < PH_LAST_; i++) {
+    res.count[i] = counts[i].load(std::memory_order_relaxed);
+    res.self_ns[i] = self_nanos[i].load(std::memory_order_relaxed);
+    res.total_ns[i] = total_nanos[i].load(std::memory_order_relaxed);
+  }
+  return res;
+}
+
+void Timing::print_report(raw_ostream& os, const PhaseTimes& times) {
+  os << formatv("[time] {0,-10} {1,8} {2,12} {3,12}\n", "phase", "count", "self ms",
+                "total ms");
+  uint64_t self_sum = 0;
+  for (int i = 0; i < PH_LAST_; i++) {
+    if (times.count[i] == 0) {
+      continue;
+    }
+    os << formatv("[time] {0,-10} {1,8} {2,12:f3} {3,12:f3}\n", phase_name(Phase(i)),
+                  times.count[i], times.self_ns[i] / 1e6, times.total_ns[i] / 1e6);
+    self_sum += times.self_ns[i];
+  }
+  os << formatv("[time] {0,-10} {1,8} {2,12:f3}\n", "total", "", self_sum / 1e6);
+}
+
+bool Timing::write_trace(StringRef path) {
+  if (!timeTraceProfilerEnabled()) {
+    return false;
+  }
+  auto err = timeTraceProfilerWrite(path, "kscope");
+  timeTraceProfilerCleanup();
+  if (err) {
+    logAllUnhandledErrors(std::move(err), errs(), "[error] ");
+    return false;
+  }
+  return true;
+}
+
+void PhaseScope::begin(Phase phase, StringRef detail) {
+  active_ = true;
+  phase_ = phase;
+  nested_ns_ = 0;
+  parent_ = current_scope;
+  current_scope = this;
+  // Only threads that initialized the profiler record trace events.
+  traced_ = timeTraceProfilerEnabled();
+  if (traced_) {
+    timeTraceProfilerBegin(phase_name(phase), detail);
+  }
+  start_ns_ = now_ns();
+}
+
+void PhaseScope::end() {
+  uint64_t elapsed = now_ns() - start_ns_;
+  if (traced_) {
+    timeTraceProfilerEnd();
+  }
+  current_scope = parent_;
+  if (parent_) {
+    parent_->nested_ns_ += elapsed;
+  }
+  counts[phase_].fetch_add(1, std::memory_order_relaxed);
+  self_nanos[phase_].fetch_add(elapsed - nested_ns_, std::memory_order_relaxed);
+  total_nanos[phase_].fetch_add(elapsed, std::memory_order_relaxed);
+}
+
+} // namespace kscope
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "common.h"
+#include "llvm/Support/Compiler.h"
+#include "llvm/Support/raw_ostream.h"
+#include <array>
+
+namespace kscope {
+
+/// Phases an item goes through from source text to its result.
+enum Phase : uint8_t {
+  PH_PARSE,       // Lexing and parsing.
+  PH_EMIT,        // IR or bytecode generation.
+  PH_OPTIMIZE,    // `Optimizer::run`.
+  PH_ADD_MODULE,  // Handing a module to the JIT.
+  PH_CODEGEN,     // Machine code generation.
+  PH_LOOKUP,      // Symbol lookup, including the materialization it triggers.
+  PH_CALL,        // Running a top-level expression.
+  PH_LAST_,
+};
+
+/// Returns the name of the phase, as shown in reports and traces.
+llvm::StringRef phase_name(Phase phase);
+
+/// Time spent per phase. Self time leaves out phases nested inside, such as
+/// the code generation triggered by a lookup.
+struct PhaseTimes {
+  std::array<uint64_t, PH_LAST_> count{};
+  std::array<uint64_t, PH_LAST_> self_ns{};
+  std::array<uint64_t, PH_LAST_> total_ns{};
+
+  PhaseTimes operator-(const PhaseTimes& other) const;
+};
+
+/// Process-wide phase timing, fed by `PhaseScope`s on any thread. Timing is
+/// off until `enable` is called, and while it is off a scope costs a branch.
+class Timing {
+public:
+  static bool enabled() {
+    return enabled_;
+  }
+
+  /// Start timing phases. Must be called before other threads start. With
+  /// `trace` set, phases and LLVM's own time-trace scopes on the calling
+  /// thread are also recorded as trace events, dropping those shorter than
+  /// `granularity_us`.
+  static void enable(bool trace, unsigned granularity_us = 0);
+
+  /// Returns the totals of all threads so far.
+  static PhaseTimes totals();
+
+  /// Print a table of phase times.
+  static void print_report(llvm::raw_ostream& os, const PhaseTimes& times);
+
+  /// Write the recorded trace events in the Chrome trace format, which
+  /// Perfetto and chrome://tracing open. Returns false on errors.
+  static bool write_trace(llvm::StringRef path);
+
+private:
+  static inline bool enabled_ = false;
+};
+
+/// Times the enclosing scope as a phase. Scopes nest per thread.
+class PhaseScope {
+public:
+  explicit PhaseScope(Phase phase, llvm::StringRef detail = "") {
+    if (LLVM_UNLIKELY(Timing::enabled())) {
+      begin(phase, detail);
+    }
+  }
+
+  ~PhaseScope() {
+    if (LLVM_UNLIKELY(active_)) {
+      end();
+    }
+  }
+
+  PhaseScope(const PhaseScope&) = delete;
+  PhaseScope& operator=(const PhaseScope&) = delete;
+
+private:
+  bool active_ = false;
+  bool traced_ = false;
+  Phase phase_;
+  uint64_t start_ns_;
+  uint64_t nested_ns_;  // Spent in scopes nested inside this one.
+  PhaseScope* parent_;
+
+  void begin(Phase phase, llvm::StringRef detail);
+  void end();
+};
+
+} // namespace kscope
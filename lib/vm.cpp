@@ -0,0 +1,489 @@
+#include "vm.h"
+#include <iostream>
+#include <limits>
+
+using namespace llvm;
+
+namespace kscope {
+
+namespace {
+
+using Fn0 = double (*)();
+using Fn1 = double (*)(double);
+using Fn2 = double (*)(double, double);
+using Fn3 = double (*)(double, double, double);
+using Fn4 = double (*)(double, double, double, double);
+using Fn5 = double (*)(double, double, double, double, double);
+using Fn6 = double (*)(double, double, double, double, double, double);
+using Fn7 = double (*)(double, double, double, double, double, double, double);
+using Fn8 = double (*)(double, double, double, double, double, double, double, double);
+
+/// Call a native function with arguments taken from the given registers.
+double call_native(const Bytecode::Callee& callee, const double* regs, const uint16_t* args) {
+  auto* addr = callee.addr;
+  switch (callee.num_args) {
+  case 0: return ((Fn0) addr)();
+  case 1: return ((Fn1) addr)(regs[args[0]]);
+  case 2: return ((Fn2) addr)(regs[args[0]], regs[args[1]]);
+  case 3: return ((Fn3) addr)(regs[args[0]], regs[args[1]], regs[args[2]]);
+  case 4:
+    return ((Fn4) addr)(regs[args[0]], regs[args[1]], regs[args[2]], regs[args[3]]);
+  case 5:
+    return ((Fn5) addr)(regs[args[0]], regs[args[1]], regs[args[2]], regs[args[3]],
+                        regs[args[4]]);
+  case 6:
+    return ((Fn6) addr)(regs[args[0]], regs[args[1]], regs[args[2]], regs[args[3]],
+                        regs[args[4]], regs[args[5]]);
+  case 7:
+    return ((Fn7) addr)(regs[args[0]], regs[args[1]], regs[args[2]], regs[args[3]],
+                        regs[args[4]], regs[args[5]], regs[args[6]]);
+  case 8:
+    return ((Fn8) addr)(regs[args[0]], regs[args[1]], regs[args[2]], regs[args[3]],
+                        regs[args[4]], regs[args[5]], regs[args[6]], regs[args[7]]);
+  }
+  return 0.0;
+}
+
+} // namespace
+
+BytecodeCompiler::BytecodeCompiler(ProtoLookup lookup_proto, AddrLookup lookup_addr)
+    : lookup_proto_(std::move(lookup_proto)), lookup_addr_(std::move(lookup_addr)) {}
+
+bool BytecodeCompiler::is_cold(const ExprAST* expr) {
+  if (auto* bin = dyn_cast<BinExprAST>(expr)) {
+    return is_cold(bin->lhs()) && is_cold(bin->rhs());
+  } else if (auto* call = dyn_cast<CallExprAST>(expr)) {
+    if (call->num_args() > MAX_ARGS) {
+      return false;
+    }
+    for (auto* arg : call->args()) {
+      if (!is_cold(arg)) {
+        return false;
+      }
+    }
+    return true;
+  } else if (auto* ifexpr = dyn_cast<IfExprAST>(expr)) {
+    return is_cold(ifexpr->cond_expr()) && is_cold(ifexpr->then_expr()) &&
+           is_cold(ifexpr->else_expr());
+  } else if (auto* let = dyn_cast<LetExprAST>(expr)) {
+    return is_cold(let->init_expr()) && is_cold(let->body_expr());
+  } else if (auto* assign = dyn_cast<AssignExprAST>(expr)) {
+    return is_cold(assign->value_expr());
+  } else if (isa<ForExprAST>(expr) || isa<ReduceExprAST>(expr) || isa<ParExprAST>(expr) ||
+             isa<IndexExprAST>(expr) || isa<StoreExprAST>(expr) || isa<LenExprAST>(expr) ||
+             isa<ArrayExprAST>(expr)) {
+    return false;
+  }
+  return true;
+}
+
+Box<Bytecode> BytecodeCompiler::compile(const ExprAST* expr) {
+  code_ = std::make_unique<Bytecode>();
+  var_regs_.clear();
+  errored_ = false;
+
+  auto res = emit_expr(expr);
+  emit(Bytecode::OP_RET, res);
+  if (errored_) {
+    return nullptr;
+  }
+  return std::move(code_);
+}
+
+uint16_t BytecodeCompiler::alloc_reg() {
+  if (code_->num_regs == std::numeric_limits<uint16_t>::max()) {
+    return log_err("expression too large for the bytecode VM");
+  }
+  return code_->num_regs++;
+}
+
+uint16_t BytecodeCompiler::emit(Bytecode::Opcode op, uint16_t a, uint16_t b, uint16_t c) {
+  // Jump targets are register-sized as well.
+  if (code_->code.size() == std::numeric_limits<uint16_t>::max()) {
+    return log_err("expression too large for the bytecode VM");
+  }
+  code_->code.push_back({op, a, b, c});
+  return code_->code.size() - 1;
+}
+
+uint16_t BytecodeCompiler::emit_const(double val) {
+  auto reg = alloc_reg();
+  emit(Bytecode::OP_LOADK, reg, code_->consts.size());
+  code_->consts.push_back(val);
+  return reg;
+}
+
+uint16_t BytecodeCompiler::emit_expr(const ExprAST* expr) {
+  if (auto* num = dyn_cast<NumExprAST>(expr)) {
+    return emit_const(num->value());
+  } else if (auto* var = dyn_cast<VarExprAST>(expr)) {
+    return emit_var_expr(var);
+  } else if (auto* bin = dyn_cast<BinExprAST>(expr)) {
+    return emit_bin_expr(bin);
+  } else if (auto* call = dyn_cast<CallExprAST>(expr)) {
+    return emit_call_expr(call);
+  } else if (auto* ifexpr = dyn_cast<IfExprAST>(expr)) {
+    return emit_if_expr(ifexpr);
+  } else if (auto* forexpr = dyn_cast<ForExprAST>(expr)) {
+    return emit_for_expr(forexpr);
+  } else if (auto* let = dyn_cast<LetExprAST>(expr)) {
+    return emit_let_expr(let);
+  } else if (auto* assign = dyn_cast<AssignExprAST>(expr)) {
+    return emit_assign_expr(assign);
+  } else if (auto* reduce = dyn_cast<ReduceExprAST>(expr)) {
+    return emit_reduce_expr(reduce);
+  } else if (auto* par = dyn_cast<ParExprAST>(expr)) {
+    // The VM runs the operands one after the other.
+    return emit_bin_expr(par->bin());
+  } else if (isa<IndexExprAST>(expr) || isa<StoreExprAST>(expr) || isa<LenExprAST>(expr) ||
+             isa<ArrayExprAST>(expr)) {
+    return log_err("arrays are not supported by the bytecode VM");
+  } else {
+    return log_err("unknown expression");
+  }
+}
+
+uint16_t BytecodeCompiler::emit_var_expr(const VarExprAST* var) {
+  if (!locals_.count(var->symbol())) {
+    return log_err("unknown variable name: " + var->name().str());
+  }
+  auto reg = locals_.lookup(var->symbol());
+  if (!var_regs_.count(reg)) {
+    return reg;
+  }
+
+  // Copy variables, so that assignments later in the expression do not
+  // change values read before them.
+  auto dst = alloc_reg();
+  emit(Bytecode::OP_MOV, dst, reg);
+  return dst;
+}
+
+uint16_t BytecodeCompiler::emit_bin_expr(const BinExprAST* bin) {
+  auto lhs = emit_expr(bin->lhs());
+  auto rhs = emit_expr(bin->rhs());
+
+  Bytecode::Opcode op;
+  switch (bin->op()) {
+  case '+':
+    op = Bytecode::OP_ADD;
+    break;
+  case '-':
+    op = Bytecode::OP_SUB;
+    break;
+  case '*':
+    op = Bytecode::OP_MUL;
+    break;
+  case '<':
+    op = Bytecode::OP_LT;
+    break;
+  default:
+    return log_err("invalid binary operator: " + std::string(1, bin->op()));
+  }
+  auto dst = alloc_reg();
+  emit(op, dst, lhs, rhs);
+  return dst;
+}
+
+uint16_t BytecodeCompiler::emit_call_expr(const CallExprAST* call) {
+  auto* proto = lookup_proto_(call->callee_symbol());
+  if (!proto) {
+    return log_err("unknown function: " + call->callee().str());
+  }
+  if (proto->num_args() != call->num_args()) {
+    return log_err("incorrect number of arguments passed");
+  }
+  for (size_t i = 0; i < call->num_args(); i++) {
+    // The VM has no arrays, so every array argument is either unsupported or
+    // a number passed by mistake.
+    if (proto->arg_types()[i] == VT_ARRAY) {
+      if (isa<ArrayExprAST>(call->args()[i])) {
+        return log_err("arrays are not supported by the bytecode VM");
+      }
+      return log_err("expected an array as argument " + std::to_string(i + 1) + " of " +
+                     call->callee().str());
+    }
+  }
+  if (call->num_args() > MAX_ARGS) {
+    return log_err("too many arguments for the bytecode VM");
+  }
+
+  std::vector<uint16_t> arg_regs;
+  for (auto* arg : call->args()) {
+    arg_regs.push_back(emit_expr(arg));
+  }
+  if (errored_) {
+    return 0;
+  }
+
+  auto* addr = lookup_addr_(call->callee_symbol());
+  if (!addr) {
+    return log_err("cannot resolve function: " + call->callee().str());
+  }
+  auto callee_idx = code_->callees.size();
+  code_->callees.push_back({addr, (uint16_t) call->num_args()});
+  auto args_idx = code_->args.size();
+  code_->args.insert(code_->args.end(), arg_regs.begin(), arg_regs.end());
+
+  auto dst = alloc_reg();
+  emit(Bytecode::OP_CALL, dst, callee_idx, args_idx);
+  return dst;
+}
+
+uint16_t BytecodeCompiler::emit_if_expr(const IfExprAST* ifexpr) {
+  auto cond = emit_expr(ifexpr->cond_expr());
+  auto dst = alloc_reg();
+  auto jmp_else = emit(Bytecode::OP_JMPZ, cond);
+
+  auto then_val = emit_expr(ifexpr->then_expr());
+  emit(Bytecode::OP_MOV, dst, then_val);
+  auto jmp_end = emit(Bytecode::OP_JMP);
+
+  code_->code[jmp_else].b = code_->code.size();
+  auto else_val = emit_expr(ifexpr->else_expr());
+  emit(Bytecode::OP_MOV, dst, else_val);
+  code_->code[jmp_end].a = code_->code.size();
+
+  return dst;
+}
+
+uint16_t BytecodeCompiler::emit_for_expr(const ForExprAST* forexpr,
+                                         function_ref<void(uint16_t)> combine) {
+  // Emit the range bounds (these are evaluated once).
+  auto init = emit_expr(forexpr->init_expr());
+  auto stop = emit_expr(forexpr->stop_expr());
+  auto step = forexpr->has_step() ? emit_expr(forexpr->step_expr())
+                                  : emit_const(ForExprAST::DEFAULT_STEP);
+  // The VM runs parallel loops and reductions serially, so their grain size
+  // is unused.
+  if (forexpr->has_grain()) {
+    emit_expr(forexpr->grain_expr());
+  }
+  auto zero = emit_const(0.0);
+  auto iter = alloc_reg();
+  emit(Bytecode::OP_MOV, iter, init);
+
+  // Same conditions as the emitter: count down while iter > stop if the
+  // step is negative, count up while iter < stop otherwise. A NaN ends the
+  // loop.
+  auto down = alloc_reg();
+  emit(Bytecode::OP_OLT, down, step, zero);
+  auto cond = alloc_reg();
+  auto loop_start = emit(Bytecode::OP_JMPZ, down);
+  emit(Bytecode::OP_OGT, cond, iter, stop);
+  auto jmp_check = emit(Bytecode::OP_JMP);
+  code_->code[loop_start].b = emit(Bytecode::OP_OLT, cond, iter, stop);
+  code_->code[jmp_check].a = code_->code.size();
+  auto jmp_end = emit(Bytecode::OP_JMPZ, cond);
+
+  // Emit the loop body with the itervar shadowing any outer variable.
+  {
+    ScopedHashTableScope<Symbol, uint16_t> scope(locals_);
+    locals_.insert(forexpr->itervar_symbol(), iter);
+    auto val = emit_expr(forexpr->body_expr());
+    if (combine) {
+      combine(val);
+    }
+  }
+
+  emit(Bytecode::OP_ADD, iter, iter, step);
+  emit(Bytecode::OP_JMP, loop_start);
+  code_->code[jmp_end].b = code_->code.size();
+
+  // For now, for/in expression always returns zero.
+  return zero;
+}
+
+uint16_t BytecodeCompiler::emit_reduce_expr(const ReduceExprAST* reduce) {
+  // Values are combined in loop order, like the JIT does unless it may
+  // reassociate.
+  auto acc = alloc_reg();
+  switch (reduce->op()) {
+  case ReduceExprAST::RO_SUM:
+    emit(Bytecode::OP_MOV, acc, emit_const(0.0));
+    emit_for_expr(reduce->loop(), [&](uint16_t val) {
+      emit(Bytecode::OP_ADD, acc, acc, val);
+    });
+    break;
+  case ReduceExprAST::RO_MIN:
+  case ReduceExprAST::RO_MAX: {
+    // The accumulator is never NaN, so NaNs fail the compare and are skipped
+    // like minnum and maxnum do.
+    bool is_min = reduce->op() == ReduceExprAST::RO_MIN;
+    auto inf = std::numeric_limits<double>::infinity();
+    emit(Bytecode::OP_MOV, acc, emit_const(is_min ? inf : -inf));
+    auto cond = alloc_reg();
+    emit_for_expr(reduce->loop(), [&](uint16_t val) {
+      emit(is_min ? Bytecode::OP_OLT : Bytecode::OP_OGT, cond, val, acc);
+      auto jmp_skip = emit(Bytecode::OP_JMPZ, cond);
+      emit(Bytecode::OP_MOV, acc, val);
+      code_->code[jmp_skip].b = code_->code.size();
+    });
+    break;
+  }
+  case ReduceExprAST::RO_FOLD: {
+    auto* proto = lookup_proto_(reduce->fold_symbol());
+    if (!proto) {
+      return log_err("unknown function: " + reduce->fold_name().str());
+    }
+    if (proto->num_args() != 2 || proto->has_array_args()) {
+      return log_err("fold needs a function of two numbers: " + reduce->fold_name().str());
+    }
+    auto* addr = lookup_addr_(reduce->fold_symbol());
+    if (!addr) {
+      return log_err("cannot resolve function: " + reduce->fold_name().str());
+    }
+    emit(Bytecode::OP_MOV, acc, emit_expr(reduce->init_expr()));
+    emit_for_expr(reduce->loop(), [&](uint16_t val) {
+      auto callee_idx = code_->callees.size();
+      code_->callees.push_back({addr, 2});
+      auto args_idx = code_->args.size();
+      code_->args.push_back(acc);
+      code_->args.push_back(val);
+      emit(Bytecode::OP_CALL, acc, callee_idx, args_idx);
+    });
+    break;
+  }
+  }
+  return acc;
+}
+
+uint16_t BytecodeCompiler::emit_let_expr(const LetExprAST* let) {
+  auto init = emit_expr(let->init_expr());
+  auto reg = alloc_reg();
+  emit(Bytecode::OP_MOV, reg, init);
+  var_regs_.insert(reg);
+
+  // The variable shadows any outer variable until the scope ends.
+  ScopedHashTableScope<Symbol, uint16_t> scope(locals_);
+  locals_.insert(let->var_symbol(), reg);
+  return emit_expr(let->body_expr());
+}
+
+uint16_t BytecodeCompiler::emit_assign_expr(const AssignExprAST* assign) {
+  if (!locals_.count(assign->var_symbol())) {
+    return log_err("unknown variable name: " + assign->var_name().str());
+  }
+  auto reg = locals_.lookup(assign->var_symbol());
+  if (!var_regs_.count(reg)) {
+    return log_err("not a var: " + assign->var_name().str());
+  }
+  auto val = emit_expr(assign->value_expr());
+  emit(Bytecode::OP_MOV, reg, val);
+  return val;
+}
+
+uint16_t BytecodeCompiler::log_err(StringRef msg) {
+  std::cerr << "[error] " << msg.str() << std::endl;
+  errored_ = true;
+  return 0;
+}
+
+// Threaded dispatch jumps straight from one handler to the next through a
+// table of label addresses, so every handler gets its own indirect branch.
+#if defined(__GNUC__) || defined(__clang__)
+#define VM_THREADED 1
+#define VM_BEGIN goto *labels[pc->op];
+#define VM_END
+#define VM_CASE(op) L_##op:
+#define VM_NEXT() \
+  pc++;           \
+  goto *labels[pc->op]
+#define VM_JUMP(target) \
+  pc = code.code.data() + (target); \
+  goto *labels[pc->op]
+#else
+#define VM_BEGIN \
+  for (;;) {     \
+    switch (pc->op) {
+#define VM_END  \
+    default:    \
+      return 0.0; \
+    }           \
+  }
+#define VM_CASE(op) case Bytecode::op:
+#define VM_NEXT() \
+  pc++;           \
+  continue
+#define VM_JUMP(target) \
+  pc = code.code.data() + (target); \
+  continue
+#endif
+
+double VM::run(const Bytecode& code) {
+  if (regs_.size() < code.num_regs) {
+    regs_.resize(code.num_regs);
+  }
+  double* regs = regs_.data();
+  const auto* pc = code.code.data();
+
+#ifdef VM_THREADED
+  // Indexed by opcode.
+  static const void* labels[Bytecode::OP_LAST_] = {
+    &&L_OP_LOADK, &&L_OP_MOV, &&L_OP_ADD, &&L_OP_SUB, &&L_OP_MUL, &&L_OP_LT,
+    &&L_OP_OLT, &&L_OP_OGT, &&L_OP_JMP, &&L_OP_JMPZ, &&L_OP_CALL, &&L_OP_RET,
+  };
+#endif
+
+  VM_BEGIN
+    VM_CASE(OP_LOADK) {
+      regs[pc->a] = code.consts[pc->b];
+      VM_NEXT();
+    }
+    VM_CASE(OP_MOV) {
+      regs[pc->a] = regs[pc->b];
+      VM_NEXT();
+    }
+    VM_CASE(OP_ADD) {
+      regs[pc->a] = regs[pc->b] + regs[pc->c];
+      VM_NEXT();
+    }
+    VM_CASE(OP_SUB) {
+      regs[pc->a] = regs[pc->b] - regs[pc->c];
+      VM_NEXT();
+    }
+    VM_CASE(OP_MUL) {
+      regs[pc->a] = regs[pc->b] * regs[pc->c];
+      VM_NEXT();
+    }
+    VM_CASE(OP_LT) {
+      regs[pc->a] = !(regs[pc->b] >= regs[pc->c]) ? 1.0 : 0.0;
+      VM_NEXT();
+    }
+    VM_CASE(OP_OLT) {
+      regs[pc->a] = regs[pc->b] < regs[pc->c] ? 1.0 : 0.0;
+      VM_NEXT();
+    }
+    VM_CASE(OP_OGT) {
+      regs[pc->a] = regs[pc->b] > regs[pc->c] ? 1.0 : 0.0;
+      VM_NEXT();
+    }
+    VM_CASE(OP_JMP) {
+      VM_JUMP(pc->a);
+    }
+    VM_CASE(OP_JMPZ) {
+      // Conditions hold if they are ordered and not equal to zero.
+      double val = regs[pc->a];
+      if (!(val < 0.0 || val > 0.0)) {
+        VM_JUMP(pc->b);
+      }
+      VM_NEXT();
+    }
+    VM_CASE(OP_CALL) {
+      regs[pc->a] = call_native(code.callees[pc->b], regs, code.args.data() + pc->c);
+      VM_NEXT();
+    }
+    VM_CASE(OP_RET) {
+      return regs[pc->a];
+    }
+  VM_END
+}
+
+#undef VM_THREADED
+#undef VM_BEGIN
+#undef VM_END
+#undef VM_CASE
+#undef VM_NEXT
+#undef VM_JUMP
+
+} // namespace kscope
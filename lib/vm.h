@@ -0,0 +1,106 @@
+#pragma once
+
+#include "ast.h"
+#include "common.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/ScopedHashTable.h"
+#include <functional>
+
+namespace kscope {
+
+/// Register bytecode for one expression. Every value lives in a register of
+/// the frame; constants and call targets are kept in side tables.
+struct Bytecode {
+  enum Opcode : uint8_t {
+    OP_LOADK,  // a = consts[b]
+    OP_MOV,    // a = b
+    OP_ADD,    // a = b + c
+    OP_SUB,    // a = b - c
+    OP_MUL,    // a = b * c
+    OP_LT,     // a = b < c (unordered is true)
+    OP_OLT,    // a = b < c (unordered is false)
+    OP_OGT,    // a = b > c (unordered is false)
+    OP_JMP,    // pc = a
+    OP_JMPZ,   // if a is zero or NaN, pc = b
+    OP_CALL,   // a = callees[b](regs[args[c]], ...)
+    OP_RET,    // return a
+    OP_LAST_,
+  };
+
+  struct Instr {
+    Opcode op;
+    uint16_t a, b, c;
+  };
+
+  struct Callee {
+    const void* addr;
+    uint16_t num_args;
+  };
+
+  std::vector<Instr> code;
+  std::vector<double> consts;
+  std::vector<Callee> callees;
+  std::vector<uint16_t> args;  // Argument registers of all calls.
+  uint16_t num_regs = 0;
+};
+
+/// Lowers expressions to bytecode. Callees are native functions, either
+/// JIT-compiled definitions or externs, resolved once at compile time.
+class BytecodeCompiler {
+public:
+  /// Largest number of arguments a call may pass.
+  static constexpr size_t MAX_ARGS = 8;
+
+  using ProtoLookup = std::function<const PrototypeAST*(Symbol)>;
+  using AddrLookup = std::function<const void*(Symbol)>;
+
+  BytecodeCompiler(ProtoLookup lookup_proto, AddrLookup lookup_addr);
+
+  /// Whether the expression is cheap enough to be interpreted, i.e. contains
+  /// no loops, no arrays and no calls the VM cannot make.
+  static bool is_cold(const ExprAST* expr);
+
+  /// Compile the expression, or return null after reporting errors.
+  Box<Bytecode> compile(const ExprAST* expr);
+
+private:
+  ProtoLookup lookup_proto_;
+  AddrLookup lookup_addr_;
+  Box<Bytecode> code_;
+  llvm::ScopedHashTable<Symbol, uint16_t> locals_;
+  /// Registers of `var` bindings, which assignments overwrite.
+  llvm::DenseSet<uint16_t> var_regs_;
+  bool errored_;
+
+  uint16_t alloc_reg();
+  uint16_t emit(Bytecode::Opcode op, uint16_t a = 0, uint16_t b = 0, uint16_t c = 0);
+  uint16_t emit_const(double val);
+
+  uint16_t emit_expr(const ExprAST* expr);
+  uint16_t emit_var_expr(const VarExprAST* var);
+  uint16_t emit_bin_expr(const BinExprAST* bin);
+  uint16_t emit_call_expr(const CallExprAST* call);
+  uint16_t emit_if_expr(const IfExprAST* ifexpr);
+  /// Emit a loop, calling `combine` with the register holding the value of
+  /// its body after each iteration if given.
+  uint16_t emit_for_expr(const ForExprAST* forexpr,
+                         llvm::function_ref<void(uint16_t)> combine = nullptr);
+  uint16_t emit_reduce_expr(const ReduceExprAST* reduce);
+  uint16_t emit_let_expr(const LetExprAST* let);
+  uint16_t emit_assign_expr(const AssignExprAST* assign);
+
+  /// Helper for error handling.
+  uint16_t log_err(llvm::StringRef msg);
+};
+
+/// Interpreter for bytecode, dispatching through a table of labels when the
+/// compiler supports it.
+class VM {
+public:
+  double run(const Bytecode& code);
+
+private:
+  std::vector<double> regs_;  // Reused across runs.
+};
+
+} // namespace kscope
@@ -1,27 +1,182 @@
+#include "compiler.h"
 #include "emitter.h"
+#include "evaluator.h"
 #include "executor.h"
+#include "output.h"
 #include "parser.h"
+#include "timing.h"
+#include "vm.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "llvm/Support/raw_ostream.h"
+#include <chrono>
 #include <iostream>
-#include <sstream>
 #include <string>
+#include <vector>
 
 using namespace kscope;
 
 namespace {
 
+namespace cl = llvm::cl;
+
+cl::OptionCategory kscope_category("kscope options");
+
+cl::opt<std::string> input_file(
+    cl::Positional, cl::desc("[input file]"), cl::init(""),
+    cl::cat(kscope_category));
+
+cl::opt<std::string> opt_level_flag(
+    "O", cl::Prefix, cl::desc("Optimization level: -O0, -O1, -O2, -O3 or -Os"),
+    cl::value_desc("level"), cl::init("2"), cl::cat(kscope_category));
+
+cl::opt<bool> force_repl(
+    "interactive", cl::desc("Run the REPL even if stdin is not a terminal"),
+    cl::init(false), cl::cat(kscope_category));
+
+cl::opt<Compiler::OutputKind> emit_kind(
+    "emit", cl::desc("Compile ahead-of-time instead of running the JIT"),
+    cl::values(
+      clEnumValN(Compiler::OK_OBJECT, "obj", "native object file"),
+      clEnumValN(Compiler::OK_SHARED, "lib", "shared library with C ABI functions"),
+      clEnumValN(Compiler::OK_EXECUTABLE, "exe", "executable evaluating top-level expressions")),
+    cl::cat(kscope_category));
+
+cl::opt<std::string> output_file(
+    "o", cl::desc("Output path for --emit"), cl::value_desc("path"),
+    cl::init(""), cl::cat(kscope_category));
+
+cl::opt<std::string> cache_dir(
+    "cache-dir", cl::desc("Directory of the persistent JIT object cache"),
+    cl::value_desc("dir"), cl::init(""), cl::cat(kscope_category));
+
+cl::opt<unsigned> cache_size_mb(
+    "cache-size", cl::desc("Size cap of the object cache in MiB"),
+    cl::value_desc("mib"), cl::init(256), cl::cat(kscope_category));
+
+cl::opt<bool> lazy_jit(
+    "lazy", cl::desc("Compile each function on its first call"),
+    cl::init(false), cl::cat(kscope_category));
+
+cl::opt<unsigned> jit_threads(
+    "jit-threads", cl::desc("Number of threads compiling definitions concurrently"),
+    cl::value_desc("n"), cl::init(0), cl::cat(kscope_category));
+
+cl::opt<bool> tiered_jit(
+    "tiered", cl::desc("Run functions at -O0 first and recompile hot ones at -O3"),
+    cl::init(false), cl::cat(kscope_category));
+
+cl::opt<uint64_t> tier_threshold(
+    "tier-threshold", cl::desc("Calls after which a function is recompiled in --tiered mode"),
+    cl::value_desc("n"), cl::init(1000), cl::cat(kscope_category));
+
+/// Engine evaluating top-level expressions.
+enum ExecPolicy {
+  EP_AUTO,
+  EP_JIT,
+  EP_VM,
+};
+
+cl::opt<ExecPolicy> exec_policy(
+    "exec", cl::desc("Engine evaluating top-level expressions"),
+    cl::values(
+      clEnumValN(EP_AUTO, "auto", "bytecode VM for expressions without loops, JIT otherwise"),
+      clEnumValN(EP_JIT, "jit", "always compile with the JIT"),
+      clEnumValN(EP_VM, "vm", "always interpret with the bytecode VM")),
+    cl::init(EP_AUTO), cl::cat(kscope_category));
+
+cl::opt<bool> whole_program(
+    "whole-program",
+    cl::desc("Link the definitions each top-level expression calls into its module "
+             "and optimize them as one program"),
+    cl::init(false), cl::cat(kscope_category));
+
+cl::opt<bool> fp_reassoc(
+    "fp-reassoc",
+    cl::desc("Let sums and folds combine values in any order, so that they vectorize and "
+             "run in parallel"),
+    cl::init(false), cl::cat(kscope_category));
+
+cl::opt<uint64_t> memo_size(
+    "memo-size", cl::desc("Number of results cached by each memo function"),
+    cl::value_desc("n"), cl::init(Emitter::MEMO_SIZE), cl::cat(kscope_category));
+
+cl::opt<uint64_t> eval_fuel(
+    "eval-fuel",
+    cl::desc("Nodes of each top-level expression evaluated at compile time, 0 to turn "
+             "evaluation off"),
+    cl::value_desc("n"), cl::init(Evaluator::FUEL), cl::cat(kscope_category));
+
+cl::opt<bool> time_report(
+    "time-report", cl::desc("Print the time spent in each compilation and execution phase"),
+    cl::init(false), cl::cat(kscope_category));
+
+cl::opt<std::string> trace_file(
+    "trace", cl::desc("Write a Chrome trace of all phases to the given file"),
+    cl::value_desc("path"), cl::init(""), cl::cat(kscope_category));
+
+cl::opt<unsigned> trace_granularity(
+    "trace-granularity", cl::desc("Minimum duration of trace events in microseconds"),
+    cl::value_desc("us"), cl::init(0), cl::cat(kscope_category));
+
+#ifndef KSCOPE_RT_PATH
+#define KSCOPE_RT_PATH "libkscope-rt.a"
+#endif
+
+using Clock = std::chrono::steady_clock;
+
+double elapsed_ms(Clock::time_point start) {
+  std::chrono::duration<double, std::milli> dur = Clock::now() - start;
+  return dur.count();
+}
+
 class Driver {
 public:
-  Driver() {
-    jit_ = Executor::create();
-    emitter_ = std::make_unique<Emitter>("__main__", jit_->data_layout());
+  /// Module size when batch definitions are compiled concurrently.
+  static constexpr size_t DEFS_PER_MODULE = 32;
+  /// Bounds the thunk module of a chunk with many top-level expressions.
+  static constexpr size_t EXPRS_PER_MODULE = 1024;
+
+  Driver(bool batch, const ExecutorOptions& opts, ExecPolicy policy, bool whole_program = false,
+         bool fp_reassoc = false, bool time_items = false)
+      : batch_(batch),
+        policy_(policy),
+        whole_program_(whole_program),
+        time_items_(time_items),
+        evaluator_(ast_),
+        bytecode_(
+          [this](Symbol name) { return emitter_->lookup_proto(name); },
+          [this](Symbol name) { return lookup_addr(name); }) {
+    jit_ = Executor::create(opts);
+    if (!opts.optimize && !opts.tier_threshold) {
+      // Otherwise the executor optimizes on its compile threads.
+      opt_ = std::make_unique<Optimizer>(opts.opt_level);
+    }
+    // Whole programs are optimized once they are linked, see
+    // `handle_top_level_expr`.
+    emitter_ = std::make_unique<Emitter>("__main__", jit_->data_layout(),
+                                         whole_program_ ? nullptr : opt_.get());
+    emitter_->set_tier_threshold(opts.tier_threshold);
+    emitter_->set_fp_reassoc(fp_reassoc);
   }
 
   ~Driver() {
     trackers_.clear();
   }
 
-  Box<llvm::Module> run() {
+  void set_memo_size(uint64_t entries) {
+    emitter_->set_memo_size(entries);
+  }
+
+  void set_eval_fuel(uint64_t fuel) {
+    evaluator_.set_fuel(fuel);
+  }
+
+  llvm::orc::ThreadSafeModule run() {
     std::cout << "[kscope]" << std::endl;
     while (true) {
       std::cerr << "ks> ";
@@ -32,27 +187,32 @@ public:
         break;
       }
 
-      std::stringstream src(input_);
-      Parser parser(src);
-      auto items = parser.parse();
-      if (parser.errored()) {
-        std::cerr << "note: there were some parse errors" << std::endl;
-      }
-
-      for (auto& iter : items) {
-        auto item = std::move(iter);
-        if (llvm::dyn_cast<PrototypeAST>(item.get())) {
-          Box<PrototypeAST> proto((PrototypeAST*) item.release());
-          handle_extern(std::move(proto));
-        } else if (llvm::dyn_cast<FunctionAST>(item.get())) {
-          Box<FunctionAST> def((FunctionAST*) item.release());
-          handle_define(std::move(def));
-        } else if (llvm::dyn_cast<ExprAST>(item.get())) {
-          Box<ExprAST> expr((ExprAST*) item.release());
-          auto anon_fn = FunctionAST::make_anon(std::move(expr));
-          handle_top_level_expr(std::move(anon_fn));
-        } else {
-          std::cerr << "unknown item" << std::endl;
+      auto times = Timing::totals();
+      std::vector<const ItemAST*> items;
+      {
+        PhaseScope scope(PH_PARSE);
+        Parser parser(input_, ast_);
+        items = parser.parse();
+        if (parser.errored()) {
+          std::cerr << "note: there were some parse errors" << std::endl;
+        }
+      }
+
+      // The first item of a line is charged with parsing it, and the last
+      // one with running the line's expressions.
+      for (size_t i = 0; i < items.size(); i++) {
+        handle_item(items[i]);
+        if (i + 1 == items.size()) {
+          flush_exprs();
+          // Looking up the counters would compile lazy functions early.
+          if (!jit_->is_lazy()) {
+            print_memo_stats(true);
+          }
+        }
+        if (time_items_) {
+          auto now = Timing::totals();
+          print_item_times(now - times);
+          times = now;
         }
         std::cerr << std::endl;
       }
@@ -60,79 +220,782 @@ public:
     return emitter_->take_mod();
   }
 
-  void handle_extern(Box<PrototypeAST> proto) {
-    auto* fn_ir = emitter_->codegen(proto.get());
+  /// Run the whole input through a single parser. Definitions are
+  /// collected into one module that is handed to the JIT right before the
+  /// next top-level expression needs it, and only expression results are
+  /// printed (to stdout).
+  void run_batch(llvm::StringRef src) {
+    auto start = Clock::now();
+    std::vector<const ItemAST*> items;
+    int lines;
+    bool errored;
+    {
+      PhaseScope scope(PH_PARSE);
+      Parser parser(src, ast_);
+      items = parser.parse();
+      lines = parser.lines();
+      errored = parser.errored();
+    }
+    double parse_ms = elapsed_ms(start);
+    // Folding expressions makes more nodes, which do not count as parsed.
+    uint64_t nodes_made = ast_.nodes_made();
+    uint64_t nodes_unique = ast_.nodes_unique();
+    size_t ast_bytes = ast_.bytes();
+    if (errored) {
+      std::cerr << "note: there were some parse errors" << std::endl;
+    }
+
+    auto exec_start = Clock::now();
+    for (auto* item : items) {
+      handle_item(item);
+    }
+    flush_exprs();
+    flush_defs();
+    double exec_ms = elapsed_ms(exec_start);
+    // What the program printed comes before the summary.
+    flushd();
+
+    // Codegen of definitions is part of the front-end; expression execution
+    // (which includes JIT materialization) is reported separately.
+    double front_ms = parse_ms + codegen_ms_;
+    std::cerr << "[batch] " << lines << " lines, " << items.size()
+              << " items: parse " << parse_ms << " ms, codegen " << codegen_ms_
+              << " ms, run " << exec_ms - codegen_ms_ << " ms ("
+              << (front_ms > 0 ? double(lines) / front_ms * 1000.0 : 0.0)
+              << " lines/sec)" << std::endl;
+    if (nodes_made > 0) {
+      std::cerr << "[ast] " << nodes_made << " nodes, " << nodes_unique << " unique, "
+                << double(ast_bytes) / nodes_made << " bytes/node" << std::endl;
+    }
+  }
+
+  /// Print JIT statistics to stderr, if there are any.
+  void print_stats() {
+    if (auto* cache = jit_->cache()) {
+      std::cerr << "[cache] " << cache->hits() << " hits, " << cache->misses()
+                << " misses, " << cache->evictions() << " evictions" << std::endl;
+    }
+    if (jit_->is_lazy()) {
+      std::cerr << "[lazy] " << jit_->functions_compiled() << " of "
+                << jit_->functions_defined() << " functions compiled" << std::endl;
+    }
+    if (evaluator_.enabled() && folded_exprs_ + vm_exprs_ + jit_exprs_ > 0) {
+      std::cerr << "[eval] " << folded_exprs_ << " of " << folded_exprs_ + vm_exprs_ + jit_exprs_
+                << " top-level expressions evaluated, "
+                << evaluator_.specializations_made() << " specializations" << std::endl;
+    }
+    if (policy_ != EP_JIT && vm_exprs_ + jit_exprs_ > 0) {
+      std::cerr << "[vm] " << vm_exprs_ << " of " << vm_exprs_ + jit_exprs_
+                << " top-level expressions interpreted" << std::endl;
+    }
+    print_memo_stats(false);
+    if (auto* tiers = jit_->tiers()) {
+      for (auto& fn : tiers->functions()) {
+        std::cerr << "[tier] " << fn.name << ": ";
+        switch (fn.state) {
+        case TierManager::TS_BASELINE:
+          std::cerr << "baseline";
+          break;
+        case TierManager::TS_QUEUED:
+          std::cerr << "queued, hot at " << fn.hot_ms << " ms";
+          break;
+        case TierManager::TS_OPTIMIZED:
+          std::cerr << "optimized, hot at " << fn.hot_ms << " ms, swapped at "
+                    << fn.optimized_ms << " ms";
+          break;
+        }
+        std::cerr << " (defined at " << fn.defined_ms << " ms)" << std::endl;
+      }
+    }
+  }
+
+  void handle_item(const ItemAST* item) {
+    // Groups the phases of each item in traces.
+    llvm::TimeTraceScope scope("item");
+    if (auto* proto = llvm::dyn_cast<PrototypeAST>(item)) {
+      handle_extern(proto);
+    } else if (auto* def = llvm::dyn_cast<FunctionAST>(item)) {
+      if (def->is_anon()) {
+        handle_top_level_expr(def);
+      } else {
+        handle_define(def);
+      }
+    } else {
+      std::cerr << "unknown item" << std::endl;
+    }
+  }
+
+  void handle_extern(const PrototypeAST* proto) {
+    auto* fn_ir = emitter_->codegen(proto);
     if (fn_ir != nullptr && !emitter_->errored()) {
-      std::cerr << "read extern prototype:\n";
-      fn_ir->print(llvm::errs());
-      emitter_->register_proto(std::move(proto));
+      if (!batch_) {
+        std::cerr << "read extern prototype:\n";
+        fn_ir->print(llvm::errs());
+      }
+      emitter_->register_proto(proto);
     } else {
       std::cerr << "note: error during codegen of prototype" << std::endl;
     }
   }
 
-  void handle_define(Box<FunctionAST> def) {
-    auto* fn_ir = emitter_->codegen(def.get());
-    if (fn_ir != nullptr && !emitter_->errored()) {
-      std::cerr << "read function definition:\n";
-      fn_ir->print(llvm::errs());
+  void handle_define(const FunctionAST* def) {
+    // Earlier expressions still see the previous definition.
+    flush_exprs();
+    if (def->is_memo()) {
+      memo_counts_[def->proto()->name().str()] = {};
+    } else {
+      memo_counts_.erase(def->proto()->name().str());
+    }
+    if (whole_program_) {
+      handle_program_define(def);
+      return;
+    }
+    if (batch_) {
+      handle_batch_define(def);
+      return;
+    }
 
+    auto* fn_ir = emitter_->codegen(def);
+    if (fn_ir != nullptr && !emitter_->errored()) {
       auto fn_name = fn_ir->getName().str();
       auto iter = trackers_.find(fn_name);
       if (iter != trackers_.end()) {
         jit_->remove_module(iter->second);
+        fn_addrs_.clear();
       }
 
+      // Taking the module optimizes it, so print the function afterwards.
       auto mod = emitter_->take_mod();
+      std::cerr << "read function definition:\n";
+      fn_ir->print(llvm::errs());
+
       auto tracker = jit_->add_module(std::move(mod));
       trackers_[fn_name] = tracker;
+      evaluator_.define(def);
     } else {
       std::cerr << "note: error during codegen of function" << std::endl;
+      evaluator_.forget(def->proto()->symbol());
+    }
+  }
+
+  /// Emit the definition into the pending module without handing it to the
+  /// JIT yet; see `flush_defs`.
+  void handle_batch_define(const FunctionAST* def) {
+    auto fn_name = def->proto()->name().str();
+    auto start = Clock::now();
+    auto* fn_ir = emitter_->codegen(def);
+    codegen_ms_ += elapsed_ms(start);
+    if (fn_ir == nullptr || emitter_->errored()) {
+      std::cerr << "note: error during codegen of function" << std::endl;
+      evaluator_.forget(def->proto()->symbol());
+      return;
+    }
+
+    auto iter = trackers_.find(fn_name);
+    if (iter != trackers_.end()) {
+      // The previous definition already lives in the JIT. Its module goes,
+      // and the other functions it held are emitted again.
+      auto tracker = iter->second;
+      jit_->remove_module(tracker);
+      fn_addrs_.clear();
+      for (auto entry = trackers_.begin(); entry != trackers_.end();) {
+        if (entry->second != tracker) {
+          ++entry;
+          continue;
+        }
+        if (entry->first != fn_name) {
+          auto* other = batch_defs_[entry->first];
+          start = Clock::now();
+          bool emitted = emitter_->codegen(other) && !emitter_->errored();
+          codegen_ms_ += elapsed_ms(start);
+          if (emitted) {
+            pending_.push_back(entry->first);
+          } else {
+            // It no longer fits the new definition, e.g. its arity.
+            std::cerr << "note: error during codegen of function" << std::endl;
+            evaluator_.forget(other->proto()->symbol());
+          }
+        }
+        entry = trackers_.erase(entry);
+      }
+    }
+
+    pending_.push_back(fn_name);
+    batch_defs_[fn_name] = def;
+    evaluator_.define(def);
+    if (jit_->is_lazy()) {
+      // Lazy compilation works per module, so keep one function per module.
+      flush_defs();
+    } else if (jit_->is_concurrent() && pending_.size() >= DEFS_PER_MODULE) {
+      // Give the compile threads independent modules to work on, but not
+      // so small that linking each one dominates.
+      flush_defs();
     }
   }
 
-  void handle_top_level_expr(Box<FunctionAST> anon_fn) {
-    auto* fn_ir = emitter_->codegen(anon_fn.get());
+  /// Check the definition and keep it for the expressions that call it,
+  /// which replaces any previous definition of the function.
+  void handle_program_define(const FunctionAST* def) {
+    auto start = Clock::now();
+    auto* fn_ir = emitter_->codegen(def);
+    codegen_ms_ += elapsed_ms(start);
     if (fn_ir != nullptr && !emitter_->errored()) {
-      std::cerr << "read top-level expression:\n";
-      fn_ir->print(llvm::errs());
+      program_[def->proto()->symbol()] = def;
+      evaluator_.define(def);
+      if (!batch_) {
+        std::cerr << "read function definition:\n";
+        fn_ir->print(llvm::errs());
+      }
+    } else {
+      std::cerr << "note: error during codegen of function" << std::endl;
+      evaluator_.forget(def->proto()->symbol());
+    }
+    // The definition is emitted again into every module that calls it.
+    emitter_->take_mod();
+  }
+
+  /// Returns the definitions the expression calls, directly or through
+  /// other definitions.
+  std::vector<const FunctionAST*> reachable_defs(const ExprAST* expr) {
+    std::vector<const FunctionAST*> defs;
+    llvm::SmallPtrSet<const ExprAST*, 32> visited;
+    llvm::SmallPtrSet<const FunctionAST*, 16> visited_defs;
+    std::vector<const ExprAST*> worklist{expr};
+    while (!worklist.empty()) {
+      auto* cur = worklist.back();
+      worklist.pop_back();
+      // Subexpressions are shared, so visit each once.
+      if (!visited.insert(cur).second) {
+        continue;
+      }
+      Symbol callee;
+      if (auto* call = llvm::dyn_cast<CallExprAST>(cur)) {
+        callee = call->callee_symbol();
+      } else if (auto* reduce = llvm::dyn_cast<ReduceExprAST>(cur)) {
+        callee = reduce->fold_symbol();
+      }
+      auto iter = callee ? program_.find(callee) : program_.end();
+      if (iter != program_.end() && visited_defs.insert(iter->second).second) {
+        defs.push_back(iter->second);
+        worklist.push_back(iter->second->body());
+      }
+      for_each_child(cur, [&](const ExprAST* child) { worklist.push_back(child); });
+    }
+    return defs;
+  }
 
-      // JIT the module containing the anon function.
+  /// Hand all pending definitions to the JIT as a single module.
+  void flush_defs() {
+    if (pending_.empty()) {
+      return;
+    }
+    auto tracker = jit_->add_module(emitter_->take_mod());
+    for (auto& fn_name : pending_) {
+      trackers_[fn_name] = tracker;
+    }
+    pending_.clear();
+  }
+
+  /// Queue the expression to run with the rest of its chunk, see
+  /// `flush_exprs`. Expressions the JIT runs become thunks of a shared
+  /// module.
+  void handle_top_level_expr(const FunctionAST* anon_fn) {
+    flush_defs();
+
+    // Expressions the JIT compiles anyway may call specializations, which
+    // are compiled with them. The VM can only call compiled definitions, and
+    // whole programs are specialized by the optimizer.
+    auto* body = anon_fn->body();
+    bool specialize = !whole_program_ && (policy_ == EP_JIT ||
+                                          (policy_ == EP_AUTO && !BytecodeCompiler::is_cold(body)));
+    {
+      PhaseScope scope(PH_EMIT, "fold");
+      body = evaluator_.fold(body, specialize);
+    }
+    if (auto* num = llvm::dyn_cast<NumExprAST>(body)) {
+      queue_constant_expr(num);
+      return;
+    }
+
+    // In whole-program mode the JIT only holds definitions linked into an
+    // expression, so the VM cannot call them.
+    auto defs = linked_defs(body);
+    if (policy_ == EP_VM ||
+        (policy_ == EP_AUTO && defs.empty() && BytecodeCompiler::is_cold(body))) {
+      queue_interpreted_expr(body);
+      return;
+    }
+    jit_exprs_++;
+    queue_compiled_expr(body, defs);
+  }
+
+  /// Returns the definitions that have to be emitted along with the
+  /// expression: those it reaches in whole-program mode, and the
+  /// specializations it calls otherwise.
+  std::vector<const FunctionAST*> linked_defs(const ExprAST* body) {
+    return whole_program_ ? reachable_defs(body) : evaluator_.specializations(body);
+  }
+
+  /// Emit the expression as a thunk into the pending module, along with the
+  /// definitions it needs, see `linked_defs`.
+  void queue_compiled_expr(const ExprAST* body, llvm::ArrayRef<const FunctionAST*> defs) {
+    // Specializations may call each other.
+    for (auto* def : defs) {
+      emitter_->register_proto(def->proto());
+    }
+    bool linked = true;
+    for (auto* def : defs) {
+      // Definitions only need to be emitted once per module.
+      if (linked_defs_.insert(def).second) {
+        linked = linked && emitter_->codegen(def) && !emitter_->errored();
+      }
+    }
+    auto name = FunctionAST::ANON_NAME + "." + std::to_string(thunks_.size());
+    auto* fn_ir = linked ? emitter_->codegen(ast_.anon(body, name)) : nullptr;
+    if (fn_ir != nullptr && !emitter_->errored()) {
+      queued_exprs_.push_back({body, fn_ir, nullptr, nullptr, defs.vec()});
+      thunks_.push_back(name);
+      if (thunks_.size() >= EXPRS_PER_MODULE) {
+        flush_exprs();
+      }
+    } else {
+      std::cerr << "note: error during codegen of expression" << std::endl;
+    }
+  }
+
+  /// Run the queued expressions in order. The thunks of all expressions
+  /// the JIT runs share one module, which is compiled and looked up once
+  /// and then dropped.
+  void flush_exprs() {
+    if (queued_exprs_.empty()) {
+      return;
+    }
+    auto queued = std::move(queued_exprs_);
+    auto thunks = std::move(thunks_);
+    queued_exprs_.clear();
+    thunks_.clear();
+    linked_defs_.clear();
+    // The expressions keep the specializations they call, which are dropped
+    // with their module.
+    evaluator_.clear_specializations();
+
+    llvm::orc::ResourceTrackerSP tracker;
+    std::vector<llvm::orc::ExecutorAddr> addrs;
+    if (!thunks.empty()) {
       auto mod = emitter_->take_mod();
-      auto tracker = jit_->add_module(std::move(mod));
+      if (whole_program_) {
+        // Only the thunks are called from outside, which lets the inliner,
+        // IPSCCP and global DCE work on the definitions.
+        mod.withModuleDo([this, &thunks](llvm::Module& mod) {
+          internalize_except(mod, thunks);
+          if (opt_) {
+            opt_->run(mod);
+          }
+        });
+      }
+      if (!batch_) {
+        std::cerr << "read top-level expressions:\n";
+        for (auto& expr : queued) {
+          if (expr.fn_ir != nullptr) {
+            expr.fn_ir->print(llvm::errs());
+          }
+        }
+      }
 
-      // Get the symbol address, cast to native function, and call it.
-      auto addr = jit_->lookup(FunctionAST::ANON_NAME);
-      assert(addr && "anon function not found");
+      tracker = jit_->add_module(std::move(mod));
+      auto found = jit_->lookup(thunks);
+      if (!found) {
+        llvm::logAllUnhandledErrors(found.takeError(), llvm::errs(), "[error] ");
+        jit_->remove_module(tracker);
+        if (thunks.size() > 1) {
+          // One thunk failed to link, e.g. by calling a function whose
+          // definition failed, and took the module with it. Give every
+          // expression its own module so that the others still run.
+          for (auto& expr : queued) {
+            if (expr.code || expr.value) {
+              queued_exprs_.push_back(std::move(expr));
+              continue;
+            }
+            queue_compiled_expr(expr.body, expr.defs);
+            flush_exprs();
+          }
+          flush_exprs();
+        }
+        return;
+      }
+      addrs = std::move(*found);
+    }
 
-      double (*fp)() = addr->toPtr<double()>();
-      double res = fp();
-      std::cerr << "evaluated to: " << res << std::endl;
+    size_t thunk = 0;
+    for (auto& expr : queued) {
+      double res;
+      if (expr.value) {
+        res = expr.value->value();
+      } else if (expr.code) {
+        PhaseScope scope(PH_CALL, "bytecode");
+        res = vm_.run(*expr.code);
+      } else {
+        double (*fp)() = addrs[thunk].toPtr<double()>();
+        PhaseScope scope(PH_CALL, thunks[thunk]);
+        res = fp();
+        thunk++;
+      }
+      print_result(res);
+    }
 
-      // Delete the anon module from the JIT.
+    // Delete the thunk module from the JIT.
+    if (tracker) {
       jit_->remove_module(tracker);
-    } else {
+    }
+  }
+
+  /// Queue the value of an expression that was evaluated while folding it.
+  void queue_constant_expr(const NumExprAST* value) {
+    folded_exprs_++;
+    if (!batch_) {
+      std::cerr << "read top-level expression: folded to a constant" << std::endl;
+    }
+    queued_exprs_.push_back({value, nullptr, nullptr, value});
+  }
+
+  /// Compile the expression for the bytecode VM, skipping LLVM entirely.
+  void queue_interpreted_expr(const ExprAST* expr) {
+    Box<Bytecode> code;
+    {
+      PhaseScope scope(PH_EMIT, "bytecode");
+      code = bytecode_.compile(expr);
+    }
+    if (!code) {
       std::cerr << "note: error during codegen of expression" << std::endl;
+      return;
+    }
+    vm_exprs_++;
+    if (!batch_) {
+      std::cerr << "read top-level expression: " << code->code.size()
+                << " bytecode instructions" << std::endl;
+    }
+    queued_exprs_.push_back({expr, nullptr, std::move(code)});
+  }
+
+  /// Print the time an item spent in each phase.
+  void print_item_times(const PhaseTimes& times) {
+    std::cerr << "[time]";
+    const char* sep = " ";
+    for (int i = 0; i < PH_LAST_; i++) {
+      if (times.count[i] > 0) {
+        std::cerr << sep << phase_name(Phase(i)).str() << " " << times.self_ns[i] / 1e6 << " ms";
+        sep = ", ";
+      }
+    }
+    std::cerr << std::endl;
+  }
+
+  void print_result(double res) {
+    if (batch_) {
+      std::cout << res << '\n';
+    } else {
+      // What the expression printed comes first.
+      flushd();
+      std::cerr << "evaluated to: " << res << std::endl;
     }
   }
 
+  /// Print the hit and miss counts of `memo` functions, or only those that
+  /// changed since they were last printed. Counts are not available for
+  /// functions that the JIT does not expose, in whole-program and tiered
+  /// mode.
+  void print_memo_stats(bool changed_only) {
+    for (auto& [name, last] : memo_counts_) {
+      auto addrs = jit_->lookup({name + Emitter::MEMO_HITS_SUFFIX,
+                                 name + Emitter::MEMO_MISSES_SUFFIX});
+      if (!addrs) {
+        llvm::consumeError(addrs.takeError());
+        continue;
+      }
+      MemoCounts counts{*(*addrs)[0].toPtr<const uint64_t*>(),
+                        *(*addrs)[1].toPtr<const uint64_t*>()};
+      if (changed_only && counts.hits == last.hits && counts.misses == last.misses) {
+        continue;
+      }
+      uint64_t calls = counts.hits + counts.misses;
+      std::cerr << "[memo] " << name << ": " << counts.hits << " hits, " << counts.misses
+                << " misses (" << (calls > 0 ? 100.0 * counts.hits / calls : 0.0)
+                << "% hits)" << std::endl;
+      last = counts;
+    }
+  }
+
+  /// Native address of a JIT-compiled function or extern, cached until the
+  /// next redefinition.
+  const void* lookup_addr(Symbol name) {
+    auto iter = fn_addrs_.find(name);
+    if (iter != fn_addrs_.end()) {
+      return iter->second;
+    }
+    auto addr = jit_->lookup(name.str());
+    if (!addr) {
+      llvm::logAllUnhandledErrors(addr.takeError(), llvm::errs(), "[error] ");
+      return nullptr;
+    }
+    auto* ptr = addr->toPtr<const void*>();
+    fn_addrs_[name] = ptr;
+    return ptr;
+  }
+
 private:
+  bool batch_;
+  ExecPolicy policy_;
+  bool whole_program_;
+  bool time_items_;
+  double codegen_ms_ = 0;
+  std::vector<std::string> pending_;
+  /// Top-level expression waiting to run, either a thunk of the pending
+  /// module, bytecode or its value.
+  struct QueuedExpr {
+    const ExprAST* body;
+    llvm::Function* fn_ir;
+    Box<Bytecode> code;
+    const NumExprAST* value = nullptr;
+    /// Definitions emitted along with the thunk, see `linked_defs`.
+    std::vector<const FunctionAST*> defs;
+  };
+  std::vector<QueuedExpr> queued_exprs_;
+  std::vector<std::string> thunks_;
+  llvm::DenseSet<const FunctionAST*> linked_defs_;
   std::map<std::string, llvm::orc::ResourceTrackerSP> trackers_;
+  /// Latest definition of every function in batch mode, emitted again when
+  /// another function of its module is redefined.
+  std::map<std::string, const FunctionAST*> batch_defs_;
+  /// Latest definition of every function, in whole-program mode.
+  llvm::DenseMap<Symbol, const FunctionAST*> program_;
+  AstContext ast_;
+  Evaluator evaluator_;
+  Box<Optimizer> opt_;
   Box<Emitter> emitter_;
   Box<Executor> jit_;
+  BytecodeCompiler bytecode_;
+  VM vm_;
+  uint64_t folded_exprs_ = 0;
+  uint64_t vm_exprs_ = 0;
+  uint64_t jit_exprs_ = 0;
+  llvm::DenseMap<Symbol, const void*> fn_addrs_;
+  /// Hit and miss counts of every `memo` function, as last printed.
+  struct MemoCounts {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+  };
+  std::map<std::string, MemoCounts> memo_counts_;
   std::string input_;
 };
 
+/// Compile the whole input ahead-of-time into the requested artifact.
+int compile_aot(llvm::StringRef src, Compiler::OutputKind kind, const std::string& out_path,
+                OptLevel level) {
+  auto compiler = Compiler::create(level);
+  if (!compiler) {
+    return 1;
+  }
+  AstContext ast;
+  Optimizer opt(level);
+  Emitter emitter("__main__", compiler->data_layout(), &opt);
+  emitter.set_fp_reassoc(fp_reassoc);
+  emitter.set_memo_size(memo_size);
+
+  std::vector<const ItemAST*> items;
+  bool errored;
+  {
+    PhaseScope scope(PH_PARSE);
+    Parser parser(src, ast);
+    items = parser.parse();
+    errored = parser.errored();
+  }
+
+  std::vector<std::string> thunks;
+  size_t skipped_exprs = 0;
+  // Everything goes into one module, where a redefinition would also
+  // replace the body earlier expressions call.
+  llvm::DenseSet<Symbol> defined;
+  for (auto* item : items) {
+    if (auto* proto = llvm::dyn_cast<PrototypeAST>(item)) {
+      if (emitter.codegen(proto) && !emitter.errored()) {
+        emitter.register_proto(proto);
+      } else {
+        errored = true;
+      }
+    } else if (auto* def = llvm::dyn_cast<FunctionAST>(item)) {
+      if (!def->is_anon()) {
+        if (!defined.insert(def->proto()->symbol()).second) {
+          std::cerr << "[error] cannot redefine function when compiling ahead of time: "
+                    << def->proto()->name().str() << std::endl;
+          errored = true;
+        } else if (!emitter.codegen(def) || emitter.errored()) {
+          errored = true;
+        }
+        continue;
+      }
+      if (kind != Compiler::OK_EXECUTABLE) {
+        skipped_exprs++;
+        continue;
+      }
+      auto name = FunctionAST::ANON_NAME + "." + std::to_string(thunks.size());
+      auto* anon_fn = ast.anon(def->body(), name);
+      if (emitter.codegen(anon_fn) && !emitter.errored()) {
+        thunks.push_back(name);
+      } else {
+        errored = true;
+      }
+    }
+  }
+  if (errored) {
+    std::cerr << "note: not writing output due to errors" << std::endl;
+    return 1;
+  }
+  if (skipped_exprs > 0) {
+    std::cerr << "note: ignored " << skipped_exprs
+              << " top-level expressions (only evaluated by --emit=exe)" << std::endl;
+  }
+
+  auto tsm = emitter.take_mod();
+  auto* mod = tsm.getModuleUnlocked();
+  if (kind == Compiler::OK_EXECUTABLE) {
+    compiler->add_main(*mod, thunks);
+  }
+
+  if (kind == Compiler::OK_OBJECT) {
+    return compiler->write_object(*mod, out_path) ? 0 : 1;
+  }
+
+  llvm::SmallString<128> obj_path;
+  if (auto ec = llvm::sys::fs::createTemporaryFile("kscope", "o", obj_path)) {
+    std::cerr << "[error] cannot create temporary file: " << ec.message() << std::endl;
+    return 1;
+  }
+  bool ok = compiler->write_object(*mod, obj_path) &&
+            compiler->link(obj_path, out_path, kind, KSCOPE_RT_PATH);
+  llvm::sys::fs::remove(obj_path);
+  return ok ? 0 : 1;
+}
+
+/// Read the whole input file, or stdin if there is none. Files are mapped
+/// into memory where possible.
+Box<llvm::MemoryBuffer> read_input() {
+  auto path = input_file.empty() ? std::string("-") : input_file.getValue();
+  auto buf = llvm::MemoryBuffer::getFileOrSTDIN(path, /*IsText=*/false,
+                                                /*RequiresNullTerminator=*/false);
+  if (!buf) {
+    std::cerr << "[error] cannot open input file: " << input_file << std::endl;
+    return nullptr;
+  }
+  return std::move(*buf);
+}
+
+/// Print the phase times and write the trace, as far as requested.
+void report_timing() {
+  if (time_report) {
+    Timing::print_report(llvm::errs(), Timing::totals());
+  }
+  if (!trace_file.empty() && Timing::write_trace(trace_file)) {
+    std::cerr << "[time] trace written to " << trace_file << std::endl;
+  }
+}
+
+/// Derive the default output path for `--emit` from the input file name.
+std::string default_output(Compiler::OutputKind kind) {
+  llvm::SmallString<128> path(input_file.empty() || input_file == "-" ? "a" : input_file.getValue());
+  switch (kind) {
+  case Compiler::OK_OBJECT:
+    llvm::sys::path::replace_extension(path, "o");
+    break;
+  case Compiler::OK_SHARED:
+    llvm::sys::path::replace_extension(path, "so");
+    break;
+  case Compiler::OK_EXECUTABLE:
+    if (input_file.empty() || input_file == "-") {
+      return "a.out";
+    }
+    llvm::sys::path::replace_extension(path, "");
+    break;
+  }
+  return std::string(path);
+}
+
 } // namespace
 
-int main() {
+int main(int argc, char** argv) {
+  cl::HideUnrelatedOptions(kscope_category);
+  cl::ParseCommandLineOptions(argc, argv, "kscope - kaleidoscope jit\n");
+
   Executor::init_native_target();
-  Driver repl;
+  if (time_report || !trace_file.empty()) {
+    Timing::enable(!trace_file.empty(), trace_granularity);
+  }
+
+  OptLevel opt_level;
+  if (!parse_opt_level(opt_level_flag, opt_level)) {
+    std::cerr << "[error] invalid optimization level: -O" << opt_level_flag << std::endl;
+    return 1;
+  }
+
+  if (emit_kind.getNumOccurrences() > 0) {
+    auto out_path = output_file.empty() ? default_output(emit_kind) : output_file.getValue();
+    auto src = read_input();
+    if (!src) {
+      return 1;
+    }
+    int res = compile_aot(src->getBuffer(), emit_kind, out_path, opt_level);
+    report_timing();
+    return res;
+  }
+
+  if (tiered_jit && (lazy_jit || jit_threads > 0)) {
+    std::cerr << "[error] --tiered cannot be combined with --lazy or --jit-threads" << std::endl;
+    return 1;
+  }
+
+  if (whole_program && (lazy_jit || tiered_jit || exec_policy == EP_VM)) {
+    std::cerr << "[error] --whole-program cannot be combined with --lazy, --tiered or --exec=vm"
+              << std::endl;
+    return 1;
+  }
+
+  ExecutorOptions jit_opts;
+  jit_opts.cache_dir = cache_dir;
+  jit_opts.cache_max_bytes = uint64_t(cache_size_mb) << 20;
+  jit_opts.lazy = lazy_jit;
+  jit_opts.compile_threads = jit_threads;
+  jit_opts.opt_level = opt_level;
+  jit_opts.tier_threshold = tiered_jit ? tier_threshold : 0;
+  // With compile threads, optimization moves onto them as well.
+  jit_opts.optimize = jit_threads > 0 && !lazy_jit;
+
+  // Batch mode for a file argument or piped input, REPL otherwise.
+  bool batch = !input_file.empty() ||
+               (!force_repl && !llvm::sys::Process::StandardInIsUserInput());
+  if (batch) {
+    auto src = read_input();
+    if (!src) {
+      return 1;
+    }
+    Driver driver(true, jit_opts, exec_policy, whole_program, fp_reassoc);
+    driver.set_memo_size(memo_size);
+    driver.set_eval_fuel(eval_fuel);
+    driver.run_batch(src->getBuffer());
+    std::cout.flush();
+    driver.print_stats();
+    report_timing();
+    return 0;
+  }
+
+  Driver repl(false, jit_opts, exec_policy, whole_program, fp_reassoc, time_report);
+  repl.set_memo_size(memo_size);
+  repl.set_eval_fuel(eval_fuel);
 
   auto mod = repl.run();
   std::cerr << "\n=== module ===\n";
-  mod->print(llvm::errs(), nullptr);
+  mod.getModuleUnlocked()->print(llvm::errs(), nullptr);
   std::cerr << "==============\n";
+  repl.print_stats();
+  report_timing();
 
   return 0;
 }
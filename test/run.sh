@@ -0,0 +1,70 @@
+#!/usr/bin/env bash
+# Regression tests: runs small programs through kscope and compares their
+# output and exit status with what is expected. Prints the failing cases and
+# exits with status 1 if there are any.
+#
+#   test/run.sh
+#
+# KSCOPE overrides the binary.
+set -uo pipefail
+
+KSCOPE=${KSCOPE:-./build/bin/kscope}
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+# check NAME EXPECTED_STATUS EXPECTED_STDOUT ACTUAL_STATUS ACTUAL_STDOUT
+check() {
+  if [[ $4 != "$2" || $5 != "$3" ]]; then
+    echo "FAIL $1: expected status $2 and output '$3', got status $4 and output '$5'"
+    failed=1
+  else
+    echo "ok   $1"
+  fi
+}
+
+# The JIT runs each expression against the definitions before it; ahead of
+# time there is only one module, so redefinitions are rejected.
+test_aot_redefinition() {
+  local src='def f(x) x+1; f(1); def f(x) x+100; f(1);'
+  local out
+  out=$(echo "$src" | "$KSCOPE" 2>/dev/null | tr '\n' ' ')
+  check "redefinition in batch mode" 0 "2 101 " 0 "$out"
+  echo "$src" | "$KSCOPE" --emit=exe -o "$tmp/redef" 2>/dev/null
+  check "redefinition ahead of time" 1 "" $? "$([[ -e $tmp/redef ]] && echo written)"
+}
+
+# Indexes that are NaN or negative fractions truncate to 0 but are out of
+# bounds, so they abort like any other.
+test_index_bounds() {
+  local defs='def big(x n) if n < 1: x else big(x*10000000000, n - 1);
+def nan() big(1, 40)*0;
+def get(i) var a = array(3) in a[i];
+def set(i) var a = array(3) in a[i] = 1;'
+  local expr out
+  for expr in 'get(nan())' 'set(nan())' 'get(0-0.5)' 'set(0-0.5)'; do
+    out=$(echo "$defs $expr;" | "$KSCOPE" 2>/dev/null)
+    check "index $expr" 134 "" $? "$out"
+  done
+  out=$(echo "$defs get(2.5);" | "$KSCOPE" 2>/dev/null)
+  check "index get(2.5)" 0 "0" $? "$out"
+}
+
+# Results printed before a runtime error are written out, also ahead of time.
+test_output_before_error() {
+  local src='def get(i) var a = array(3) in a[i];
+1+2; 3+4; get(5); 5+6;'
+  # Subshells keep the shell from reporting the abort.
+  (echo "$src" | "$KSCOPE" >"$tmp/out") 2>/dev/null
+  check "output before a runtime error" 134 "3 7 " $? "$(tr '\n' ' ' <"$tmp/out")"
+  echo "$src" | "$KSCOPE" --emit=exe -o "$tmp/error" 2>/dev/null
+  ("$tmp/error" >"$tmp/out"; exit $?) 2>/dev/null
+  check "output before a runtime error ahead of time" 134 "3 7 " $? "$(tr '\n' ' ' <"$tmp/out")"
+}
+
+test_aot_redefinition
+test_index_bounds
+test_output_before_error
+
+exit $failed